@@ -0,0 +1,63 @@
+#ifndef CONCURRENT_QUEUE_ALIGNED_ALLOCATOR_HPP
+#define CONCURRENT_QUEUE_ALIGNED_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace concurrent_queue{
+
+// Before C++17, `new` and `std::allocator` only align to alignof(std::max_align_t), so the cache line aligned
+// counters of the lock-free queues could share a cache line again. These helpers honour any alignment.
+
+// allocate `size` bytes aligned to `alignment`, a power of two. Throw std::bad_alloc on failure.
+inline void* alignedAllocate(size_t size, size_t alignment){
+  if(alignment < sizeof(void*)) alignment = sizeof(void*);
+  void* p = nullptr;
+  if(posix_memalign(&p, alignment, size == 0 ? 1 : size) != 0) throw std::bad_alloc();
+  return p;
+}
+
+inline void alignedFree(void* p){
+  free(p);
+}
+
+// allocator of memory aligned to alignof(T), e.g. for std::allocate_shared of a queue
+template<typename T>
+class AlignedAllocator {
+public:
+  typedef T value_type;
+
+  AlignedAllocator() noexcept {}
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U>&) noexcept {}
+
+  T* allocate(size_t n){
+    return static_cast<T*>(alignedAllocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, size_t){
+    alignedFree(p);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&){
+  return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&){
+  return false;
+}
+
+// std::make_shared that honours the alignment of T, e.g. makeSharedAligned<MpmcQueue<int>>(1024)
+template<typename T, typename... Args>
+std::shared_ptr<T> makeSharedAligned(Args&&... args){
+  return std::allocate_shared<T>(AlignedAllocator<T>(), std::forward<Args>(args)...);
+}
+}
+
+#endif //CONCURRENT_QUEUE_ALIGNED_ALLOCATOR_HPP
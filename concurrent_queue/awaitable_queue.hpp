@@ -0,0 +1,206 @@
+#ifndef CONCURRENT_QUEUE_AWAITABLE_QUEUE_HPP
+#define CONCURRENT_QUEUE_AWAITABLE_QUEUE_HPP
+
+#if __cplusplus < 202002L
+#error "awaitable_queue.hpp needs C++20 coroutines"
+#endif
+
+#include <mutex>
+#include <atomic>
+#include <coroutine>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "ring_buffer.hpp"
+
+namespace concurrent_queue{
+
+// Resumes suspended coroutines, e.g. on a thread pool
+class CoroutineScheduler {
+public:
+  virtual ~CoroutineScheduler() = default;
+  virtual void schedule(std::coroutine_handle<> handle) = 0;
+};
+
+// resume `handle` on `scheduler`, or right here if it has none
+inline void resumeOn(CoroutineScheduler* scheduler, std::coroutine_handle<> handle){
+  if(scheduler){
+    scheduler->schedule(handle);
+  } else {
+    handle.resume();
+  }
+}
+
+// the scheduler of the coroutine behind `handle`, if its promise has a `scheduler` member
+template<typename Promise>
+CoroutineScheduler* schedulerOf(std::coroutine_handle<Promise> handle){
+  if constexpr(requires { handle.promise().scheduler; }){
+    return handle.promise().scheduler;
+  } else {
+    return nullptr;
+  }
+}
+
+/**
+ * Unbounded queue whose consumers are coroutines: `std::optional<T> value = co_await queue.pop();`
+ * A consumer that finds the queue empty is suspended instead of blocking its thread. `push` hands the value
+ * straight to the oldest suspended consumer and resumes it on the scheduler of its coroutine, or on the pushing
+ * thread if the coroutine has none.
+ * It has the same push/try_pop/shutdown/restart contract as `ConcurrentQueue`. `pop` returns an empty optional
+ * on shutdown. Producers can be plain threads or coroutines, `push` never waits.
+ */
+template<typename T>
+class AwaitableQueue {
+public:
+  class PopAwaiter;
+
+  AwaitableQueue(): mutex_(), data_queue_(), waiters_(), shutdown_(false), size_(0) {};
+  ~AwaitableQueue() = default;
+  AwaitableQueue(const AwaitableQueue<T>&) = delete;
+  void operator=(const AwaitableQueue<T>&) = delete;
+
+  // push a value or hand it to a suspended consumer. Return false on shutdown.
+  bool push(T new_value){
+    std::unique_lock<std::mutex> lk(mutex_);
+    if(shutdown_) return false;
+    if(waiters_.empty()){
+      data_queue_.push_back(std::move(new_value));
+      size_.store(data_queue_.size(), std::memory_order_relaxed);
+      return true;
+    }
+    PopAwaiter* waiter = waiters_.front();
+    waiters_.pop_front();
+    waiter->value_.emplace(std::move(new_value));
+    lk.unlock();
+    resumeOn(waiter->scheduler_, waiter->handle_);
+    return true;
+  }
+
+  // push all items in [first, last). Items are moved from. Return the number of pushed items.
+  template<typename Iterator>
+  size_t push_bulk(Iterator first, Iterator last){
+    size_t pushed = 0;
+    for(; first != last && push(std::move(*first)); ++first, ++pushed) {}
+    return pushed;
+  }
+
+  // wait for a value without blocking the thread. `co_await` it for a `std::optional<T>`, empty on shutdown.
+  PopAwaiter pop(){
+    return PopAwaiter(*this);
+  }
+
+  // pop without waiting for data availability. If empty queue the return false.
+  bool try_pop(T& value){
+    std::lock_guard<std::mutex> lk(mutex_);
+    if(shutdown_ || data_queue_.empty()) return false;
+    value = std::move(data_queue_.front());
+    data_queue_.pop_front();
+    size_.store(data_queue_.size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  // move every remaining item to the back of `container`, also after shutdown.
+  // Return the number of drained items.
+  template<typename Container>
+  size_t drain_into(Container& container){
+    std::lock_guard<std::mutex> lk(mutex_);
+    size_t drained = 0;
+    for(; !data_queue_.empty(); ++drained){
+      container.push_back(std::move(data_queue_.front()));
+      data_queue_.pop_front();
+    }
+    size_.store(0, std::memory_order_relaxed);
+    return drained;
+  }
+
+  // check if the queue is empty. It does not take the lock.
+  bool empty() const {
+    return size_.load(std::memory_order_relaxed) == 0;
+  }
+
+  // return the size of the queue. It does not take the lock.
+  size_t size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  // number of suspended consumers
+  size_t numWaiters() const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return waiters_.size();
+  }
+
+  // shutdown the queue and resume all suspended consumers with an empty value
+  void shutdown(){
+    std::unique_lock<std::mutex> lk(mutex_);
+    shutdown_ = true;
+    std::vector<PopAwaiter*> waiters;
+    for(; !waiters_.empty(); waiters_.pop_front()){
+      waiters.push_back(waiters_.front());
+    }
+    lk.unlock();
+    for(PopAwaiter* waiter : waiters){
+      resumeOn(waiter->scheduler_, waiter->handle_);
+    }
+  }
+
+  // restart the queue
+  void restart(){
+    std::lock_guard<std::mutex> lk(mutex_);
+    shutdown_ = false;
+  }
+
+  // check if the queue is shutdown
+  bool isShutdown() const{
+    return shutdown_;
+  }
+
+  // awaiter returned by pop(). It lives in the frame of the suspended coroutine, which keeps the handed value.
+  class PopAwaiter {
+  public:
+    explicit PopAwaiter(AwaitableQueue<T>& queue): queue_(queue), value_(), handle_(), scheduler_(nullptr) {}
+
+    // the queue is checked under its lock in await_suspend()
+    bool await_ready(){
+      return false;
+    }
+
+    // Return false to resume right away if a value is queued or the queue is shutdown
+    template<typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle){
+      std::lock_guard<std::mutex> lk(queue_.mutex_);
+      if(queue_.shutdown_) return false;
+      if(!queue_.data_queue_.empty()){
+        value_.emplace(std::move(queue_.data_queue_.front()));
+        queue_.data_queue_.pop_front();
+        queue_.size_.store(queue_.data_queue_.size(), std::memory_order_relaxed);
+        return false;
+      }
+      handle_ = handle;
+      scheduler_ = schedulerOf(handle);
+      PopAwaiter* self = this;
+      queue_.waiters_.push_back(std::move(self));
+      return true;
+    }
+
+    std::optional<T> await_resume(){
+      return std::move(value_);
+    }
+
+  private:
+    friend class AwaitableQueue<T>;
+    AwaitableQueue<T>& queue_;
+    std::optional<T> value_;
+    std::coroutine_handle<> handle_;
+    CoroutineScheduler* scheduler_;
+  };
+
+private:
+  mutable std::mutex mutex_;
+  RingBuffer<T> data_queue_;
+  // suspended consumers, oldest first
+  RingBuffer<PopAwaiter*> waiters_;
+  std::atomic_bool shutdown_;
+  std::atomic<size_t> size_;
+};
+}
+#endif //CONCURRENT_QUEUE_AWAITABLE_QUEUE_HPP
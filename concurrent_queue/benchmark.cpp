@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "benchmark_report.hpp"
+#include "concurrent_queue.hpp"
+#include "mpmc_queue.hpp"
+#include "priority_concurrent_queue.hpp"
+#include "queue_set.hpp"
+#include "shm_ring_queue.hpp"
+#include "spsc_ring_queue.hpp"
+
+// Throughput and latency of the queues for several producer/consumer counts and payload sizes.
+// Every item carries the time it was pushed, the consumers record the time until it is popped.
+// The urgent_backlog rows measure the latency of rare urgent items pushed behind a growing bulk backlog.
+// The cross_process rows send items from a forked producer process, through shared memory or TCP loopback.
+// The fan_in rows have one consumer thread for kFanInQueues queues, waiting with a QueueSet or polling them.
+// Usage: concurrent_queue_benchmark [--items N] [--csv FILE] [--json FILE]
+
+using concurrent_queue::BenchmarkOptions;
+using concurrent_queue::BenchmarkResult;
+
+static const uint64_t kStopSequence = UINT64_MAX;
+static const size_t kQueueCapacity = 1024;
+static const uint64_t kUrgentFlag = 1ull << 63;
+static const size_t kBulkPerUrgent = 1000;
+static const size_t kFanInQueues = 8;
+
+template<size_t Bytes>
+struct Payload {
+  static_assert(Bytes >= 16, "the payload holds a timestamp and a sequence number");
+  uint64_t sent_ns;
+  uint64_t sequence;
+  char padding[Bytes - 16];
+};
+
+template<typename T>
+using SpscQueue = concurrent_queue::SpscRingQueue<T, kQueueCapacity>;
+
+template<typename Queue, size_t Bytes>
+BenchmarkResult runQueue(const std::string& queue_name, const std::function<Queue*()>& make_queue,
+    size_t producers, size_t consumers, uint64_t items){
+  typedef Payload<Bytes> Item;
+  std::unique_ptr<Queue> queue(make_queue());
+  std::vector<std::vector<uint64_t>> latencies(consumers);
+  std::atomic<size_t> running_producers(producers);
+  std::atomic<bool> go(false);
+  const uint64_t items_per_producer = items / producers;
+
+  std::vector<std::thread> threads;
+  for(size_t c = 0; c < consumers; ++c){
+    threads.emplace_back([&, c]{
+      std::vector<uint64_t>& samples = latencies[c];
+      samples.reserve(items / consumers + 1);
+      Item item = Item();
+      while(queue->wait_and_pop(item)){
+        if(item.sequence == kStopSequence) break;
+        samples.push_back(concurrent_queue::benchmarkNowNs() - item.sent_ns);
+      }
+    });
+  }
+  for(size_t p = 0; p < producers; ++p){
+    threads.emplace_back([&]{
+      while(!go) std::this_thread::yield();
+      Item item = Item();
+      for(uint64_t i = 0; i < items_per_producer; ++i){
+        item.sequence = i;
+        item.sent_ns = concurrent_queue::benchmarkNowNs();
+        queue->push(item);
+      }
+      // the last producer tells every consumer to stop
+      if(--running_producers == 0){
+        item.sequence = kStopSequence;
+        for(size_t c = 0; c < consumers; ++c) queue->push(item);
+      }
+    });
+  }
+
+  const uint64_t start = concurrent_queue::benchmarkNowNs();
+  go = true;
+  for(std::thread& t : threads) t.join();
+  const uint64_t end = concurrent_queue::benchmarkNowNs();
+
+  std::vector<uint64_t> all;
+  all.reserve(items);
+  for(std::vector<uint64_t>& samples : latencies){
+    all.insert(all.end(), samples.begin(), samples.end());
+  }
+  BenchmarkResult result;
+  result.name = "queue";
+  result.queue = queue_name;
+  result.producers = producers;
+  result.consumers = consumers;
+  result.payload_bytes = Bytes;
+  result.items = all.size();
+  result.seconds = (end - start) / 1e9;
+  concurrent_queue::computePercentiles(all, result);
+  return result;
+}
+
+// one producer pushes kBulkPerUrgent bulk items, then one urgent item, over and over. The consumer spends a little
+// time on every bulk item, so a backlog builds up. Only the latency of the urgent items is recorded.
+template<typename Queue>
+BenchmarkResult runUrgentBehindBacklog(const std::string& queue_name, Queue& queue, uint64_t items){
+  typedef Payload<16> Item;
+  const uint64_t rounds = items / kBulkPerUrgent == 0 ? 1 : items / kBulkPerUrgent;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(rounds);
+  std::thread consumer([&]{
+    Item item = Item();
+    while(latencies.size() < rounds && queue.wait_and_pop(item)){
+      if(item.sequence & kUrgentFlag){
+        latencies.push_back(concurrent_queue::benchmarkNowNs() - item.sent_ns);
+      } else {
+        const uint64_t busy_until = concurrent_queue::benchmarkNowNs() + 200;
+        while(concurrent_queue::benchmarkNowNs() < busy_until) {}
+      }
+    }
+  });
+
+  const uint64_t start = concurrent_queue::benchmarkNowNs();
+  Item item = Item();
+  for(uint64_t round = 0; round < rounds; ++round){
+    for(size_t i = 0; i < kBulkPerUrgent; ++i){
+      item.sequence = i;
+      item.sent_ns = concurrent_queue::benchmarkNowNs();
+      queue.push(item);
+    }
+    item.sequence = round | kUrgentFlag;
+    item.sent_ns = concurrent_queue::benchmarkNowNs();
+    queue.push(item);
+  }
+  consumer.join();
+  const uint64_t end = concurrent_queue::benchmarkNowNs();
+
+  BenchmarkResult result;
+  result.name = "urgent_backlog";
+  result.queue = queue_name;
+  result.producers = 1;
+  result.consumers = 1;
+  result.payload_bytes = sizeof(Item);
+  result.items = latencies.size();
+  result.seconds = (end - start) / 1e9;
+  concurrent_queue::computePercentiles(latencies, result);
+  return result;
+}
+
+void runUrgent(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results){
+  typedef Payload<16> Item;
+  {
+    concurrent_queue::ConcurrentQueue<Item> queue;
+    results.push_back(runUrgentBehindBacklog("ConcurrentQueue", queue, options.items));
+    concurrent_queue::printResult(results.back());
+  }
+  {
+    typedef concurrent_queue::PriorityConcurrentQueue<Item> PriorityQueue;
+    PriorityQueue queue;
+    const size_t bulk_lane = queue.numLanes() - 1;
+    queue.setClassifier([bulk_lane](const Item& item){
+      return PriorityQueue::Priority{item.sequence & kUrgentFlag ? 0 : bulk_lane, PriorityQueue::noDeadline()};
+    });
+    results.push_back(runUrgentBehindBacklog("PriorityQueue", queue, options.items));
+    concurrent_queue::printResult(results.back());
+  }
+}
+
+// one producer per queue, one consumer pops from all queues. `pop_any` pops an item from any queue into `item` and
+// returns false once every queue is shutdown.
+template<typename PopAny>
+BenchmarkResult runFanIn(const std::string& queue_name, uint64_t items, PopAny pop_any,
+    std::vector<std::unique_ptr<concurrent_queue::ConcurrentQueue<Payload<16>>>>& queues){
+  typedef Payload<16> Item;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(items);
+  std::atomic<bool> go(false);
+  const uint64_t items_per_producer = items / queues.size();
+  std::vector<std::thread> producers;
+  for(size_t p = 0; p < queues.size(); ++p){
+    producers.emplace_back([&, p]{
+      while(!go) std::this_thread::yield();
+      Item item = Item();
+      for(uint64_t i = 0; i < items_per_producer; ++i){
+        item.sequence = i;
+        item.sent_ns = concurrent_queue::benchmarkNowNs();
+        queues[p]->push(item);
+        // producers are slower than the consumer, so it often waits for the next item
+        if(i % 64 == 63) std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    });
+  }
+  std::thread consumer([&]{
+    Item item = Item();
+    while(latencies.size() < items_per_producer * queues.size() && pop_any(item)){
+      latencies.push_back(concurrent_queue::benchmarkNowNs() - item.sent_ns);
+    }
+  });
+
+  const uint64_t start = concurrent_queue::benchmarkNowNs();
+  go = true;
+  for(std::thread& t : producers) t.join();
+  consumer.join();
+  const uint64_t end = concurrent_queue::benchmarkNowNs();
+
+  BenchmarkResult result;
+  result.name = "fan_in";
+  result.queue = queue_name;
+  result.producers = queues.size();
+  result.consumers = 1;
+  result.payload_bytes = sizeof(Item);
+  result.items = latencies.size();
+  result.seconds = (end - start) / 1e9;
+  concurrent_queue::computePercentiles(latencies, result);
+  return result;
+}
+
+void runFanInQueues(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results){
+  typedef Payload<16> Item;
+  typedef concurrent_queue::ConcurrentQueue<Item> Queue;
+  std::vector<std::unique_ptr<Queue>> queues;
+  for(size_t i = 0; i < kFanInQueues; ++i) queues.emplace_back(new Queue());
+  {
+    concurrent_queue::QueueSet set;
+    for(std::unique_ptr<Queue>& queue : queues) set.add(*queue);
+    results.push_back(runFanIn("QueueSet", options.items, [&](Item& item){
+      size_t index;
+      while((index = set.select()) != concurrent_queue::QueueSet::npos){
+        if(queues[index]->try_pop(item)) return true;
+      }
+      return false;
+    }, queues));
+    concurrent_queue::printResult(results.back());
+  }
+  {
+    // what a module does without a QueueSet: try every queue, yield when all are empty
+    size_t next = 0;
+    results.push_back(runFanIn("PollingLoop", options.items, [&](Item& item){
+      for(;;){
+        for(size_t i = 0; i < queues.size(); ++i, next = (next + 1) % queues.size()){
+          if(queues[next]->try_pop(item)){
+            next = (next + 1) % queues.size();
+            return true;
+          }
+        }
+        std::this_thread::yield();
+      }
+    }, queues));
+    concurrent_queue::printResult(results.back());
+  }
+}
+
+// a forked child process pushes the items with `produce`, this process pops them with `consume` and records the
+// latencies. steady_clock is CLOCK_MONOTONIC, which is the same in both processes.
+template<size_t Bytes, typename Produce, typename Consume>
+BenchmarkResult runCrossProcess(const std::string& queue_name, uint64_t items, Produce produce, Consume consume){
+  typedef Payload<Bytes> Item;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(items);
+  const uint64_t start = concurrent_queue::benchmarkNowNs();
+  const pid_t producer = fork();
+  if(producer == 0){
+    Item item = Item();
+    for(uint64_t i = 0; i < items; ++i){
+      item.sequence = i;
+      item.sent_ns = concurrent_queue::benchmarkNowNs();
+      if(!produce(item)) _exit(1);
+    }
+    _exit(0);
+  }
+  Item item = Item();
+  while(producer > 0 && latencies.size() < items && consume(item)){
+    latencies.push_back(concurrent_queue::benchmarkNowNs() - item.sent_ns);
+  }
+  int status = 0;
+  if(producer > 0) waitpid(producer, &status, 0);
+  const uint64_t end = concurrent_queue::benchmarkNowNs();
+
+  BenchmarkResult result;
+  result.name = "cross_process";
+  result.queue = queue_name;
+  result.producers = 1;
+  result.consumers = 1;
+  result.payload_bytes = Bytes;
+  result.items = latencies.size();
+  result.seconds = (end - start) / 1e9;
+  concurrent_queue::computePercentiles(latencies, result);
+  return result;
+}
+
+// read or write exactly `size` bytes. Return false on error or end of stream.
+template<typename Transfer, typename Buffer>
+bool transferAll(Transfer transfer, int fd, Buffer* buffer, size_t size){
+  for(size_t done = 0; done < size;){
+    const ssize_t n = transfer(fd, buffer + done, size - done);
+    if(n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+template<size_t Bytes>
+void runCrossProcessPayload(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results){
+  typedef Payload<Bytes> Item;
+  const std::string name = "/concurrent_queue_benchmark_" + std::to_string(getpid());
+  std::unique_ptr<concurrent_queue::ShmRingQueue<Item>> shm_queue =
+      concurrent_queue::ShmRingQueue<Item>::create(name, kQueueCapacity);
+  if(shm_queue){
+    concurrent_queue::ShmRingQueue<Item>::unlink(name);
+    concurrent_queue::ShmRingQueue<Item>& queue = *shm_queue;
+    results.push_back(runCrossProcess<Bytes>("ShmRingQueue/1024", options.items,
+        [&queue](const Item& item){ return queue.push(item); },
+        [&queue](Item& item){ return queue.wait_and_pop(item); }));
+    concurrent_queue::printResult(results.back());
+  } else {
+    std::cerr << "cannot create shared memory queue " << name << ": " << std::strerror(errno) << std::endl;
+  }
+
+  // TCP over the loopback interface, the usual way to link pipeline processes
+  const int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = sockaddr_in();
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t address_size = sizeof(address);
+  if(listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+     listen(listener, 1) != 0 || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &address_size) != 0){
+    std::cerr << "cannot listen on the loopback interface: " << std::strerror(errno) << std::endl;
+    if(listener >= 0) close(listener);
+    return;
+  }
+  int connection = -1;
+  const int one = 1;
+  results.push_back(runCrossProcess<Bytes>("TcpLoopback", options.items,
+      [&](const Item& item){
+        if(connection < 0){
+          connection = socket(AF_INET, SOCK_STREAM, 0);
+          setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          if(connect(connection, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) return false;
+        }
+        return transferAll(write, connection, reinterpret_cast<const char*>(&item), sizeof(item));
+      },
+      [&](Item& item){
+        if(connection < 0) connection = accept(listener, nullptr, nullptr);
+        return transferAll(read, connection, reinterpret_cast<char*>(&item), sizeof(item));
+      }));
+  concurrent_queue::printResult(results.back());
+  if(connection >= 0) close(connection);
+  close(listener);
+}
+
+template<size_t Bytes>
+void runPayloadSize(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results){
+  typedef Payload<Bytes> Item;
+  const size_t many = std::max<size_t>(2, std::min<size_t>(4, std::thread::hardware_concurrency()));
+  const size_t shapes[][2] = {{1, 1}, {many, 1}, {1, many}, {many, many}};
+
+  for(const auto& shape : shapes){
+    const size_t p = shape[0];
+    const size_t c = shape[1];
+    results.push_back(runQueue<concurrent_queue::ConcurrentQueue<Item>, Bytes>("ConcurrentQueue",
+        []{ return new concurrent_queue::ConcurrentQueue<Item>(); }, p, c, options.items));
+    concurrent_queue::printResult(results.back());
+    results.push_back(runQueue<concurrent_queue::ConcurrentQueue<Item>, Bytes>("ConcurrentQueue/1024",
+        []{ return new concurrent_queue::ConcurrentQueue<Item>(kQueueCapacity); }, p, c, options.items));
+    concurrent_queue::printResult(results.back());
+    results.push_back(runQueue<concurrent_queue::ConcurrentQueue<Item>, Bytes>("ConcurrentQueue/1024/SpinThenBlock",
+        []{
+          return new concurrent_queue::ConcurrentQueue<Item>(kQueueCapacity, concurrent_queue::WaitStrategy::SpinThenBlock);
+        }, p, c, options.items));
+    concurrent_queue::printResult(results.back());
+    results.push_back(runQueue<concurrent_queue::MpmcQueue<Item>, Bytes>("MpmcQueue/1024",
+        []{ return new concurrent_queue::MpmcQueue<Item>(kQueueCapacity); }, p, c, options.items));
+    concurrent_queue::printResult(results.back());
+    if(p == 1 && c == 1){
+      results.push_back(runQueue<SpscQueue<Item>, Bytes>("SpscRingQueue/1024",
+          []{ return new SpscQueue<Item>(); }, p, c, options.items));
+      concurrent_queue::printResult(results.back());
+    }
+  }
+}
+
+int main(int argc, char* argv[]){
+  const BenchmarkOptions options = BenchmarkOptions::parse(argc, argv);
+  std::vector<BenchmarkResult> results;
+  runPayloadSize<16>(options, results);
+  runPayloadSize<64>(options, results);
+  runPayloadSize<512>(options, results);
+  runUrgent(options, results);
+  runFanInQueues(options, results);
+  runCrossProcessPayload<64>(options, results);
+  runCrossProcessPayload<512>(options, results);
+  return concurrent_queue::writeResults(options, results) ? 0 : 1;
+}
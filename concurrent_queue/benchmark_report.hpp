@@ -0,0 +1,138 @@
+#ifndef CONCURRENT_QUEUE_BENCHMARK_REPORT_HPP
+#define CONCURRENT_QUEUE_BENCHMARK_REPORT_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace concurrent_queue{
+
+// helpers shared by the queue and pipeline benchmarks
+
+inline uint64_t benchmarkNowNs(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// one row of results
+struct BenchmarkResult {
+  BenchmarkResult(): name(), queue(), producers(0), consumers(0), stages(0), payload_bytes(0), items(0),
+                     seconds(0), p50_ns(0), p99_ns(0), p999_ns(0), max_ns(0) {}
+
+  double itemsPerSecond() const {
+    return seconds > 0 ? items / seconds : 0;
+  }
+
+  std::string name;
+  std::string queue;
+  size_t producers;
+  size_t consumers;
+  size_t stages;
+  size_t payload_bytes;
+  uint64_t items;
+  double seconds;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  uint64_t max_ns;
+};
+
+// sort the latencies and fill the percentiles of `result`
+inline void computePercentiles(std::vector<uint64_t>& latencies_ns, BenchmarkResult& result){
+  if(latencies_ns.empty()) return;
+  std::sort(latencies_ns.begin(), latencies_ns.end());
+  const size_t last = latencies_ns.size() - 1;
+  result.p50_ns = latencies_ns[last * 50 / 100];
+  result.p99_ns = latencies_ns[last * 99 / 100];
+  result.p999_ns = latencies_ns[last * 999 / 1000];
+  result.max_ns = latencies_ns[last];
+}
+
+// command line options: --items N, --csv FILE, --json FILE
+struct BenchmarkOptions {
+  BenchmarkOptions(): items(200000), csv_path(), json_path() {}
+
+  static BenchmarkOptions parse(int argc, char* argv[]){
+    BenchmarkOptions options;
+    for(int i = 1; i < argc; ++i){
+      const bool has_value = i + 1 < argc;
+      if(std::strcmp(argv[i], "--items") == 0 && has_value){
+        options.items = std::strtoull(argv[++i], nullptr, 10);
+      } else if(std::strcmp(argv[i], "--csv") == 0 && has_value){
+        options.csv_path = argv[++i];
+      } else if(std::strcmp(argv[i], "--json") == 0 && has_value){
+        options.json_path = argv[++i];
+      } else {
+        std::cerr << "Usage: " << argv[0] << " [--items N] [--csv FILE] [--json FILE]" << std::endl;
+        std::exit(2);
+      }
+    }
+    return options;
+  }
+
+  uint64_t items;
+  std::string csv_path;
+  std::string json_path;
+};
+
+inline void printResult(const BenchmarkResult& r){
+  std::cout << std::left << std::setw(16) << r.name << std::setw(20) << r.queue
+            << " p=" << r.producers << " c=" << r.consumers << " k=" << r.stages
+            << " bytes=" << std::setw(4) << r.payload_bytes
+            << std::right << std::fixed << std::setprecision(0)
+            << std::setw(12) << r.itemsPerSecond() << " items/s"
+            << "  p50=" << r.p50_ns << "ns p99=" << r.p99_ns << "ns p999=" << r.p999_ns
+            << "ns max=" << r.max_ns << "ns" << std::endl;
+}
+
+inline bool writeCsv(const std::string& path, const std::vector<BenchmarkResult>& results){
+  std::ofstream out(path.c_str());
+  if(!out) return false;
+  out << "name,queue,producers,consumers,stages,payload_bytes,items,seconds,items_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n";
+  for(const BenchmarkResult& r : results){
+    out << r.name << "," << r.queue << "," << r.producers << "," << r.consumers << "," << r.stages << ","
+        << r.payload_bytes << "," << r.items << "," << r.seconds << "," << static_cast<uint64_t>(r.itemsPerSecond())
+        << "," << r.p50_ns << "," << r.p99_ns << "," << r.p999_ns << "," << r.max_ns << "\n";
+  }
+  return true;
+}
+
+inline bool writeJson(const std::string& path, const std::vector<BenchmarkResult>& results){
+  std::ofstream out(path.c_str());
+  if(!out) return false;
+  out << "[\n";
+  for(size_t i = 0; i < results.size(); ++i){
+    const BenchmarkResult& r = results[i];
+    out << "  {\"name\":\"" << r.name << "\",\"queue\":\"" << r.queue << "\",\"producers\":" << r.producers
+        << ",\"consumers\":" << r.consumers << ",\"stages\":" << r.stages << ",\"payload_bytes\":" << r.payload_bytes
+        << ",\"items\":" << r.items << ",\"seconds\":" << r.seconds
+        << ",\"items_per_sec\":" << static_cast<uint64_t>(r.itemsPerSecond())
+        << ",\"p50_ns\":" << r.p50_ns << ",\"p99_ns\":" << r.p99_ns << ",\"p999_ns\":" << r.p999_ns
+        << ",\"max_ns\":" << r.max_ns << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "]\n";
+  return true;
+}
+
+// write the results to the files given on the command line. Return false if a file can't be written.
+inline bool writeResults(const BenchmarkOptions& options, const std::vector<BenchmarkResult>& results){
+  bool success = true;
+  if(!options.csv_path.empty() && !writeCsv(options.csv_path, results)){
+    std::cerr << "Can't write " << options.csv_path << std::endl;
+    success = false;
+  }
+  if(!options.json_path.empty() && !writeJson(options.json_path, results)){
+    std::cerr << "Can't write " << options.json_path << std::endl;
+    success = false;
+  }
+  return success;
+}
+}
+#endif //CONCURRENT_QUEUE_BENCHMARK_REPORT_HPP
@@ -1,19 +1,35 @@
 #ifndef CONCURRENT_QUEUE_HPP
 #define CONCURRENT_QUEUE_HPP
 
-#include <queue>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <memory>
+#include <string>
 #include <atomic>
+#include <iterator>
+#include <utility>
+#include "event_tracer.hpp"
+#include "ring_buffer.hpp"
+#include "wait_strategy.hpp"
 
 namespace concurrent_queue{
 
 template<typename T>
 class ConcurrentQueue {
 public:
-  typedef std::queue<std::shared_ptr<T>> DataQueue;
-  explicit ConcurrentQueue():
-    mutex_(), data_queue_(), data_cond_(), shutdown_(false) {
+  // values are stored directly, the `bool` pop overloads move them out without any allocation
+  typedef RingBuffer<T> DataQueue;
+
+  // `capacity` limits the number of queued items. 0 means unbounded.
+  // In bounded mode `push` blocks while the queue is full, so a slow consumer slows down its producers
+  // instead of growing the heap.
+  // `strategy` selects how waiting threads wait, see `WaitStrategy`. With `SpinThenBlock` or `BusySpin` they poll
+  // the queue size without the lock before sleeping on the condition variables.
+  explicit ConcurrentQueue(size_t capacity = 0, WaitStrategy strategy = WaitStrategy::Block):
+    mutex_(), data_queue_(), data_cond_(), not_full_cond_(), capacity_(capacity), strategy_(strategy),
+    shutdown_(false), size_(0), data_waiters_(0), space_waiters_(0), ready_event_(nullptr),
+    trace_name_(traceName("ConcurrentQueue")) {
   };
   ~ConcurrentQueue() = default;
   ConcurrentQueue(const ConcurrentQueue<T>&) = delete;
@@ -21,43 +37,157 @@ public:
 
   // waits until it can push
   bool push(T new_value){
+    return emplace(std::move(new_value));
+  }
+
+  // waits until it can push, then construct the value in place from `args`
+  template<typename... Args>
+  bool emplace(Args&&... args){
+    if(shutdown_) return false;
+    std::unique_lock<std::mutex> lk(mutex_);
+    waitForSpace(lk);
+    if(shutdown_) return false;
+    data_queue_.emplace_back(std::forward<Args>(args)...);
+    traceInstant(TraceKind::Enqueue, trace_name_, data_queue_.back());
+    publishSize();
+    notifyNotEmpty();
+    return true;
+  }
+
+  // push without waiting for free space. Return false if the queue is full or shutdown.
+  // `new_value` is only moved from on success, so the caller still owns it after a failed push.
+  bool try_push(T&& new_value){
     if(shutdown_) return false;
-    std::shared_ptr<T> data(std::make_shared<T>(std::move(new_value)));
     std::lock_guard<std::mutex> lk(mutex_);
-    data_queue_.push(data);
-    data_cond_.notify_one();
+    if(full() || shutdown_) return false;
+    data_queue_.push_back(std::move(new_value));
+    traceInstant(TraceKind::Enqueue, trace_name_, data_queue_.back());
+    publishSize();
+    notifyNotEmpty();
+    return true;
+  }
+
+  // push without waiting. If the queue is full, the oldest item is dropped to make room.
+  // `dropped_oldest` is set to true if an item was dropped. Return false on shutdown.
+  bool force_push(T new_value, bool *dropped_oldest = nullptr){
+    if(shutdown_) return false;
+    // the dropped item is destroyed after the lock is released
+    T oldest;
+    bool dropped = false;
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      if(shutdown_) return false;
+      if(full()){
+        oldest = std::move(data_queue_.front());
+        data_queue_.pop_front();
+        dropped = true;
+      }
+      data_queue_.push_back(std::move(new_value));
+      traceInstant(TraceKind::Enqueue, trace_name_, data_queue_.back());
+      publishSize();
+      notifyNotEmpty();
+    }
+    if(dropped_oldest) *dropped_oldest = dropped;
+    return true;
+  }
+
+  // waits at most `timeout` for free space. Return false on timeout or shutdown.
+  // `new_value` is only moved from on success.
+  template<typename Rep, typename Period>
+  bool push_for(T&& new_value, const std::chrono::duration<Rep, Period>& timeout){
+    if(shutdown_) return false;
+    std::unique_lock<std::mutex> lk(mutex_);
+    if(!waitForSpace(lk, deadlineAfter(timeout))) return false;
+    if(shutdown_) return false;
+    data_queue_.push_back(std::move(new_value));
+    traceInstant(TraceKind::Enqueue, trace_name_, data_queue_.back());
+    publishSize();
+    notifyNotEmpty();
     return true;
   }
 
+  // push all items in [first, last) taking the lock once per batch. Items are moved from.
+  // In bounded mode waits for free space as needed. Return the number of pushed items, which is less than the
+  // range size only if the queue was shutdown.
+  template<typename Iterator>
+  size_t push_bulk(Iterator first, Iterator last){
+    size_t pushed = 0;
+    std::unique_lock<std::mutex> lk(mutex_);
+    while(first != last){
+      waitForSpace(lk);
+      if(shutdown_) break;
+      size_t batch = 0;
+      for(; first != last && !full(); ++first, ++batch){
+        data_queue_.push_back(std::move(*first));
+        traceInstant(TraceKind::Enqueue, trace_name_, data_queue_.back());
+      }
+      pushed += batch;
+      publishSize();
+      if(batch == 1){
+        notifyNotEmpty();
+      } else {
+        if(data_waiters_ != 0) data_cond_.notify_all();
+        notifyReadyEvent();
+      }
+    }
+    return pushed;
+  }
+
   // wait until data is available in the queue and return the value
+  // kept for compatibility, it allocates a shared_ptr on every call. Prefer `wait_and_pop(T&)`.
   std::shared_ptr<T> wait_and_pop(){
     std::unique_lock<std::mutex> lk(mutex_);
-    data_cond_.wait(lk, [this]{return !data_queue_.empty() || shutdown_;});
+    waitForData(lk);
     if(shutdown_) return std::shared_ptr<T>();
-    std::shared_ptr<T> res = data_queue_.front();
-    data_queue_.pop();
+    traceInstant(TraceKind::Dequeue, trace_name_, data_queue_.front());
+    std::shared_ptr<T> res = std::make_shared<T>(std::move(data_queue_.front()));
+    data_queue_.pop_front();
+    publishSize();
+    notifyNotFull();
     return res;
   }
 
   // wait until data is available in the queue and assign the value to the `value` parameter
   bool wait_and_pop(T& value){
     std::unique_lock<std::mutex> lk(mutex_);
-    data_cond_.wait(lk, [this]{return !data_queue_.empty() || shutdown_;});
+    waitForData(lk);
+    if(shutdown_) return false;
+    traceInstant(TraceKind::Dequeue, trace_name_, data_queue_.front());
+    value = std::move(data_queue_.front());
+    data_queue_.pop_front();
+    publishSize();
+    notifyNotFull();
+    return true;
+  }
+
+  // waits at most `timeout` for data and assign the value to the `value` parameter.
+  // Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool pop_for(T& value, const std::chrono::duration<Rep, Period>& timeout){
+    std::unique_lock<std::mutex> lk(mutex_);
+    if(!waitForData(lk, deadlineAfter(timeout))) return false;
     if(shutdown_) return false;
-    value = std::move(*data_queue_.front());
-    data_queue_.pop();
+    traceInstant(TraceKind::Dequeue, trace_name_, data_queue_.front());
+    value = std::move(data_queue_.front());
+    data_queue_.pop_front();
+    publishSize();
+    notifyNotFull();
     return true;
   }
 
   // pop without waiting for data availability. If empty queue the return nullptr.
   // the caller has to implement the wait functionality explicitly.
   // if need wait for data, use `wait_and_pop()`
+  // kept for compatibility, it allocates a shared_ptr on every call. Prefer `try_pop(T&)`.
   std::shared_ptr<T> try_pop(){
     std::lock_guard<std::mutex> lk(mutex_);
     if(data_queue_.empty() || shutdown_)
       return std::shared_ptr<T>();
-    std::shared_ptr<T> res = data_queue_.front();
-    data_queue_.pop();
+    traceInstant(TraceKind::Dequeue, trace_name_, data_queue_.front());
+    std::shared_ptr<T> res = std::make_shared<T>(std::move(data_queue_.front()));
+    data_queue_.pop_front();
+    publishSize();
+    notifyNotFull();
     return res;
   }
 
@@ -67,21 +197,77 @@ public:
   bool try_pop(T& value){
     std::lock_guard<std::mutex> lk(mutex_);
     if(data_queue_.empty() || shutdown_) return false;
-    value = std::move(*data_queue_.front());
-    data_queue_.pop();
+    traceInstant(TraceKind::Dequeue, trace_name_, data_queue_.front());
+    value = std::move(data_queue_.front());
+    data_queue_.pop_front();
+    publishSize();
+    notifyNotFull();
     return true;
   }
 
-  // check if the queue is empty
-  bool empty() const {
+  // pop up to `max_n` items in a single critical section without waiting.
+  // Return the number of items written to `out`, 0 if the queue is empty or shutdown.
+  template<typename OutputIt>
+  size_t pop_bulk(OutputIt out, size_t max_n){
     std::lock_guard<std::mutex> lk(mutex_);
-    return data_queue_.empty();
+    if(shutdown_) return 0;
+    return popBulkLocked(out, max_n);
   }
 
-  // return the size of the queue
+  // wait until data is available, then pop up to `max_n` items in a single critical section.
+  // Return the number of items written to `out`, 0 on shutdown.
+  template<typename OutputIt>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n){
+    std::unique_lock<std::mutex> lk(mutex_);
+    waitForData(lk);
+    if(shutdown_) return 0;
+    return popBulkLocked(out, max_n);
+  }
+
+  // waits at most `timeout` for data, then pop up to `max_n` items in a single critical section.
+  // Return the number of items written to `out`, 0 on timeout or shutdown.
+  template<typename OutputIt, typename Rep, typename Period>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n, const std::chrono::duration<Rep, Period>& timeout){
+    std::unique_lock<std::mutex> lk(mutex_);
+    if(!waitForData(lk, deadlineAfter(timeout))) return 0;
+    if(shutdown_) return 0;
+    return popBulkLocked(out, max_n);
+  }
+
+  // move every remaining item to the back of `container`, also after shutdown.
+  // Return the number of drained items.
+  template<typename Container>
+  size_t drain_into(Container& container){
+    std::lock_guard<std::mutex> lk(mutex_);
+    return popBulkLocked(std::back_inserter(container), data_queue_.size());
+  }
+
+  // check if the queue is empty. It does not take the lock.
+  bool empty() const {
+    return size_.load(std::memory_order_relaxed) == 0;
+  }
+
+  // return the size of the queue. It does not take the lock.
   size_t size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  // return how waiting threads wait
+  WaitStrategy waitStrategy() const{
+    return strategy_;
+  }
+
+  // return the maximum number of queued items. 0 means unbounded.
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // allocate and touch room for `n` items now, so pushes don't allocate or take page faults. The memory comes from
+  // the NUMA node of the calling thread, e.g. a pinned consumer.
+  void reserve(size_t n){
     std::lock_guard<std::mutex> lk(mutex_);
-    return data_queue_.size();
+    data_queue_.reserve(n);
+    data_queue_.prefault();
   }
 
   // shutdown the queue and notify all waiting threads
@@ -90,6 +276,8 @@ public:
     shutdown_ = true;
     lk.unlock();
     data_cond_.notify_all();
+    not_full_cond_.notify_all();
+    notifyReadyEvent();
   }
 
   // restart the queue
@@ -98,6 +286,19 @@ public:
     shutdown_ = false;
     lk.unlock();
     data_cond_.notify_all();
+    not_full_cond_.notify_all();
+    notifyReadyEvent();
+  }
+
+  // notify `event` after every push and on shutdown, so a thread can wait on several queues at once, see `QueueSet`.
+  // nullptr detaches it. The event must outlive the queue or be detached first.
+  void setReadyEvent(EventCount* event){
+    ready_event_.store(event, std::memory_order_release);
+  }
+
+  // name of the queue in traces, see `Tracer`. Call it before the queue is used.
+  void setTraceName(const std::string& name){
+    trace_name_ = traceName(name);
   }
 
   // check if the queue is shutdown
@@ -106,10 +307,134 @@ public:
   }
 
 private:
+  // must be called with `mutex_` held
+  bool full() const {
+    return capacity_ != 0 && data_queue_.size() >= capacity_;
+  }
+
+  // must be called with `mutex_` held after changing `data_queue_`
+  void publishSize(){
+    size_.store(data_queue_.size(), std::memory_order_relaxed);
+  }
+
+  // must be called with `mutex_` held after adding an item. Skip the notification if no consumer sleeps.
+  void notifyNotEmpty(){
+    if(data_waiters_ != 0) data_cond_.notify_one();
+    notifyReadyEvent();
+  }
+
+  // a fence and a load when nobody waits on the ready event
+  void notifyReadyEvent(){
+    EventCount* event = ready_event_.load(std::memory_order_acquire);
+    if(event) event->notifyAll();
+  }
+
+  // must be called with `mutex_` held after removing an item. Skip the notification if no producer sleeps.
+  void notifyNotFull(){
+    if(capacity_ != 0 && space_waiters_ != 0) not_full_cond_.notify_one();
+  }
+
+  template<typename Rep, typename Period>
+  static std::chrono::steady_clock::time_point deadlineAfter(const std::chrono::duration<Rep, Period>& timeout){
+    return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+  }
+
+  // wait through `lk` until data is available or the queue is shutdown
+  void waitForData(std::unique_lock<std::mutex>& lk){
+    waitLocked(lk, data_cond_, data_waiters_,
+               [this]{return !data_queue_.empty();},
+               [this]{return size_.load(std::memory_order_relaxed) != 0;});
+  }
+
+  bool waitForData(std::unique_lock<std::mutex>& lk, std::chrono::steady_clock::time_point deadline){
+    return waitLocked(lk, data_cond_, data_waiters_,
+                      [this]{return !data_queue_.empty();},
+                      [this]{return size_.load(std::memory_order_relaxed) != 0;}, deadline);
+  }
+
+  // wait through `lk` until there is free space or the queue is shutdown
+  void waitForSpace(std::unique_lock<std::mutex>& lk){
+    waitLocked(lk, not_full_cond_, space_waiters_,
+               [this]{return !full();},
+               [this]{return capacity_ == 0 || size_.load(std::memory_order_relaxed) < capacity_;});
+  }
+
+  bool waitForSpace(std::unique_lock<std::mutex>& lk, std::chrono::steady_clock::time_point deadline){
+    return waitLocked(lk, not_full_cond_, space_waiters_,
+                      [this]{return !full();},
+                      [this]{return capacity_ == 0 || size_.load(std::memory_order_relaxed) < capacity_;}, deadline);
+  }
+
+  // wait with the wait strategy of the queue until `ready` or shutdown. `lk` must hold `mutex_`.
+  // The spin phase releases the lock and polls `hint`, a lock-free guess of `ready`. Sleeping threads are counted
+  // in `waiters`, so the other side only notifies `cond` when someone sleeps on it.
+  template<typename Ready, typename Hint>
+  void waitLocked(std::unique_lock<std::mutex>& lk, std::condition_variable& cond, size_t& waiters,
+      Ready ready, Hint hint){
+    while(!ready() && !shutdown_){
+      if(strategy_ != WaitStrategy::Block){
+        lk.unlock();
+        spinWait(strategy_, [&]{return shutdown_.load(std::memory_order_relaxed) || hint();});
+        lk.lock();
+        if(strategy_ == WaitStrategy::BusySpin || ready() || shutdown_) continue;
+      }
+      ++waiters;
+      cond.wait(lk);
+      --waiters;
+    }
+  }
+
+  // same as above but gives up at `deadline`. Return false on timeout.
+  template<typename Ready, typename Hint>
+  bool waitLocked(std::unique_lock<std::mutex>& lk, std::condition_variable& cond, size_t& waiters,
+      Ready ready, Hint hint, std::chrono::steady_clock::time_point deadline){
+    while(!ready() && !shutdown_){
+      if(std::chrono::steady_clock::now() >= deadline) return false;
+      if(strategy_ != WaitStrategy::Block){
+        lk.unlock();
+        spinWait(strategy_, [&]{
+          return shutdown_.load(std::memory_order_relaxed) || hint() || std::chrono::steady_clock::now() >= deadline;
+        });
+        lk.lock();
+        if(strategy_ == WaitStrategy::BusySpin || ready() || shutdown_) continue;
+      }
+      ++waiters;
+      cond.wait_until(lk, deadline);
+      --waiters;
+    }
+    return true;
+  }
+
+  // must be called with `mutex_` held
+  template<typename OutputIt>
+  size_t popBulkLocked(OutputIt out, size_t max_n){
+    size_t popped = 0;
+    for(; popped < max_n && !data_queue_.empty(); ++popped){
+      traceInstant(TraceKind::Dequeue, trace_name_, data_queue_.front());
+      *out++ = std::move(data_queue_.front());
+      data_queue_.pop_front();
+    }
+    if(popped != 0) publishSize();
+    if(capacity_ != 0 && popped != 0 && space_waiters_ != 0) not_full_cond_.notify_all();
+    return popped;
+  }
+
   mutable std::mutex mutex_;
   DataQueue data_queue_;
   std::condition_variable data_cond_;
+  std::condition_variable not_full_cond_;
+  const size_t capacity_;
+  const WaitStrategy strategy_;
   std::atomic_bool shutdown_;
+  // `data_queue_.size()`, written under `mutex_` and read without it by size() and spinning threads
+  std::atomic<size_t> size_;
+  // threads sleeping on `data_cond_` and `not_full_cond_`, guarded by `mutex_`
+  size_t data_waiters_;
+  size_t space_waiters_;
+  // set by `setReadyEvent`, e.g. to the event of a QueueSet
+  std::atomic<EventCount*> ready_event_;
+  // interned name of the queue in traces
+  uint32_t trace_name_;
 };
 }
 #endif //CONCURRENT_QUEUE_HPP
@@ -0,0 +1,97 @@
+#ifndef CONCURRENT_QUEUE_EVENT_COUNT_HPP
+#define CONCURRENT_QUEUE_EVENT_COUNT_HPP
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace concurrent_queue{
+
+// size used to pad atomics that are written by different threads onto their own cache line
+static constexpr size_t kCacheLineSize = 64;
+
+// hint the CPU that we are in a spin loop
+inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#else
+  std::this_thread::yield();
+#endif
+}
+
+// Lets threads sleep until a condition on lock-free state becomes true.
+// Notifying is a fence and a load when nobody is waiting, the mutex is only taken if a waiter is parked.
+//
+// Waiter:
+//   uint64_t key = event.prepareWait();
+//   if(condition()) event.cancelWait(); else event.wait(key);
+// Notifier:
+//   make condition() true, then call event.notifyAll()
+class EventCount {
+public:
+  EventCount(): waiters_(0), epoch_(0), mutex_(), cond_() {}
+  EventCount(const EventCount&) = delete;
+  void operator=(const EventCount&) = delete;
+
+  // announce that the caller is about to wait. The condition must be checked again after this call.
+  uint64_t prepareWait(){
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return epoch_.load(std::memory_order_acquire);
+  }
+
+  // the condition became true after `prepareWait()`, don't wait
+  void cancelWait(){
+    waiters_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  // sleep until a notification is sent after `prepareWait()` returned `key`
+  void wait(uint64_t key){
+    std::unique_lock<std::mutex> lk(mutex_);
+    cond_.wait(lk, [this, key]{return epoch_.load(std::memory_order_acquire) != key;});
+    waiters_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  // sleep at most `timeout`. Return false on timeout.
+  template<typename Rep, typename Period>
+  bool wait_for(uint64_t key, const std::chrono::duration<Rep, Period>& timeout){
+    std::unique_lock<std::mutex> lk(mutex_);
+    bool notified = cond_.wait_for(lk, timeout, [this, key]{return epoch_.load(std::memory_order_acquire) != key;});
+    waiters_.fetch_sub(1, std::memory_order_seq_cst);
+    return notified;
+  }
+
+  // wake one waiting thread, if any
+  void notifyOne(){
+    if(!bumpEpoch()) return;
+    cond_.notify_one();
+  }
+
+  // wake all waiting threads, if any
+  void notifyAll(){
+    if(!bumpEpoch()) return;
+    cond_.notify_all();
+  }
+
+private:
+  // return false if there is nobody to wake up
+  bool bumpEpoch(){
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(waiters_.load(std::memory_order_relaxed) == 0) return false;
+    std::lock_guard<std::mutex> lk(mutex_);
+    epoch_.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  std::atomic<uint32_t> waiters_;
+  std::atomic<uint64_t> epoch_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+}
+#endif //CONCURRENT_QUEUE_EVENT_COUNT_HPP
@@ -0,0 +1,405 @@
+#ifndef CONCURRENT_QUEUE_EVENT_TRACER_HPP
+#define CONCURRENT_QUEUE_EVENT_TRACER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#ifdef PIPELINE_TRACING
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+#endif
+
+// Event tracing of queues and pipeline modules, exported as a Chrome trace (chrome://tracing, ui.perfetto.dev).
+// It is compiled in only with -DPIPELINE_TRACING (the PIPELINE_TRACING CMake option). Without it every trace call is
+// an empty inline function. With it, tracing is still off until `Tracer::instance().setEnabled(true)`, and a disabled
+// trace call is a relaxed load and a branch.
+//
+// Payloads with a `uint64_t trace_id` member are followed through the pipeline: a module gives an input without an
+// id the next message id, copies the id of its input to its output, and queues tag their events with it. The trace
+// links the events of a message with flow arrows, so a slow message can be followed from module to module.
+
+namespace concurrent_queue{
+
+enum class TraceKind : uint8_t {
+  Prepare,
+  Spin,
+  Send,
+  Enqueue,
+  Dequeue
+};
+
+inline const char* toString(TraceKind kind){
+  switch(kind){
+    case TraceKind::Prepare: return "prepareInputPayload";
+    case TraceKind::Spin: return "spinOnce";
+    case TraceKind::Send: return "sendOutputPayload";
+    case TraceKind::Enqueue: return "enqueue";
+    default: return "dequeue";
+  }
+}
+
+// trace_id of a payload, 0 if its type has none
+template<typename T>
+auto traceMessageId(const T& payload, int) -> decltype(static_cast<uint64_t>(payload.trace_id)){
+  return payload.trace_id;
+}
+
+template<typename T>
+uint64_t traceMessageId(const T&, long){
+  return 0;
+}
+
+// trace_id of the payload a queue item points to, 0 for a null pointer
+template<typename T, typename D>
+uint64_t traceMessageId(const std::unique_ptr<T, D>& payload, int){
+  return payload ? traceMessageId(*payload, 0) : 0;
+}
+
+template<typename T>
+uint64_t traceMessageId(const std::shared_ptr<T>& payload, int){
+  return payload ? traceMessageId(*payload, 0) : 0;
+}
+
+// set the trace_id of a payload, does nothing if its type has none. Return true if it has one.
+template<typename T>
+auto setTraceMessageId(T& payload, uint64_t id, int) -> decltype(payload.trace_id = id, bool()){
+  payload.trace_id = id;
+  return true;
+}
+
+template<typename T>
+bool setTraceMessageId(T&, uint64_t, long){
+  return false;
+}
+
+// the Tracer and the trace calls of queues and modules. Without PIPELINE_TRACING there is no Tracer, the calls
+// compile to nothing and the queues don't pull in the headers of the export.
+#ifdef PIPELINE_TRACING
+// Collects trace events in one lock-free ring per thread. A thread only writes its own ring, the oldest events are
+// overwritten when it is full. Rings stay alive after their thread exits, so they can be exported at the end.
+class Tracer {
+public:
+  static Tracer& instance(){
+    static Tracer tracer;
+    return tracer;
+  }
+
+  // the global switch, checked by every trace call
+  static std::atomic_bool& enabledFlag(){
+    static std::atomic_bool enabled(false);
+    return enabled;
+  }
+
+  void setEnabled(bool enabled){
+    enabledFlag().store(enabled, std::memory_order_relaxed);
+  }
+
+  static bool isEnabled(){
+    return enabledFlag().load(std::memory_order_relaxed);
+  }
+
+  // events per thread ring, rounded up to a power of two. Applies to the rings of threads that trace afterwards.
+  void setRingCapacity(size_t capacity){
+    size_t rounded = 1;
+    while(rounded < capacity) rounded <<= 1;
+    ring_capacity_.store(rounded, std::memory_order_relaxed);
+  }
+
+  // return a small id for `name`, e.g. a module id. The same name always returns the same id.
+  uint32_t intern(const std::string& name){
+    std::lock_guard<std::mutex> lk(mutex_);
+    std::map<std::string, uint32_t>::iterator it = name_ids_.find(name);
+    if(it != name_ids_.end()) return it->second;
+    names_.push_back(name);
+    const uint32_t id = static_cast<uint32_t>(names_.size() - 1);
+    name_ids_[name] = id;
+    return id;
+  }
+
+  // give the next message a trace id, starting from 1
+  uint64_t nextMessageId(){
+    return next_message_id_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // name the calling thread in the trace
+  void setThreadName(const std::string& name){
+    Ring& ring = threadRing();
+    std::lock_guard<std::mutex> lk(mutex_);
+    ring.thread_name = name;
+  }
+
+  static uint64_t nowNs(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // record that `kind` of the component `name` ran from `begin_ns` to now for message `message_id`
+  void complete(TraceKind kind, uint32_t name, uint64_t message_id, uint64_t begin_ns){
+    const uint64_t end_ns = nowNs();
+    record(kind, 'X', name, message_id, begin_ns, end_ns > begin_ns ? end_ns - begin_ns : 0);
+  }
+
+  // record that `kind` happened to message `message_id` in the component `name`
+  void instant(TraceKind kind, uint32_t name, uint64_t message_id){
+    record(kind, 'i', name, message_id, nowNs(), 0);
+  }
+
+  // number of events overwritten before they were exported
+  uint64_t numOverwritten() const{
+    std::lock_guard<std::mutex> lk(mutex_);
+    uint64_t overwritten = 0;
+    for(const std::unique_ptr<Ring>& ring : rings_){
+      const uint64_t head = ring->head.load(std::memory_order_acquire);
+      const uint64_t first = ring->first.load(std::memory_order_relaxed);
+      if(head > first + ring->slots.size()) overwritten += head - first - ring->slots.size();
+    }
+    return overwritten;
+  }
+
+  // forget the events recorded so far
+  void clear(){
+    std::lock_guard<std::mutex> lk(mutex_);
+    for(std::unique_ptr<Ring>& ring : rings_){
+      ring->first.store(ring->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+  }
+
+  // return the events as Chrome trace JSON. It may run while other threads trace.
+  std::string chromeTrace() const{
+    std::vector<Event> events;
+    std::vector<std::string> names;
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const long pid = static_cast<long>(getpid());
+    bool first = true;
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      names = names_;
+      for(const std::unique_ptr<Ring>& ring : rings_){
+        copyEvents(*ring, events);
+        out << (first ? "" : ",") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":"
+            << ring->tid << ",\"args\":{\"name\":\"" << escape(ring->thread_name.empty()
+                                                                     ? "thread " + std::to_string(ring->tid)
+                                                                     : ring->thread_name) << "\"}}";
+        first = false;
+      }
+    }
+    std::sort(events.begin(), events.end(), [](const Event& a, const Event& b){ return a.ts_ns < b.ts_ns; });
+    // the events of each message, in time order, to link them with flow arrows
+    std::map<uint64_t, std::vector<size_t>> flows;
+    for(size_t i = 0; i < events.size(); ++i){
+      const Event& event = events[i];
+      const std::string name = event.name < names.size() ? names[event.name] : "unknown";
+      out << (first ? "" : ",") << "{\"name\":\"" << escape(name) << " " << toString(event.kind)
+          << "\",\"cat\":\"" << toString(event.kind) << "\",\"ph\":\"" << event.phase << "\",\"ts\":"
+          << microseconds(event.ts_ns) << ",\"pid\":" << pid << ",\"tid\":" << event.tid;
+      if(event.phase == 'X') out << ",\"dur\":" << microseconds(event.dur_ns);
+      if(event.phase == 'i') out << ",\"s\":\"t\"";
+      out << ",\"args\":{\"message\":" << event.message_id << "}}";
+      first = false;
+      if(event.message_id != 0 && event.phase == 'X') flows[event.message_id].push_back(i);
+    }
+    for(const std::pair<const uint64_t, std::vector<size_t>>& flow : flows){
+      for(size_t step = 0; flow.second.size() > 1 && step < flow.second.size(); ++step){
+        const Event& event = events[flow.second[step]];
+        const char phase = step == 0 ? 's' : step + 1 == flow.second.size() ? 'f' : 't';
+        out << ",{\"name\":\"message\",\"cat\":\"flow\",\"ph\":\"" << phase << "\",\"id\":" << flow.first
+            << ",\"ts\":" << microseconds(event.ts_ns) << ",\"pid\":" << pid << ",\"tid\":" << event.tid;
+        if(phase != 's') out << ",\"bp\":\"e\"";
+        out << "}";
+      }
+    }
+    out << "]}";
+    return out.str();
+  }
+
+  // write chromeTrace() to `path`. Return false if it can't be written.
+  bool writeChromeTrace(const std::string& path) const{
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::trunc);
+    if(!file) return false;
+    file << chromeTrace();
+    file.close();
+    return static_cast<bool>(file);
+  }
+
+private:
+  // the fields are relaxed atomics, so the exporter can read a slot while its thread overwrites it
+  struct Slot {
+    Slot(): ts_ns(0), dur_ns(0), meta(0), message_id(0) {}
+    std::atomic<uint64_t> ts_ns;
+    std::atomic<uint64_t> dur_ns;
+    // name << 16 | kind << 8 | phase
+    std::atomic<uint64_t> meta;
+    std::atomic<uint64_t> message_id;
+  };
+
+  struct Ring {
+    Ring(size_t capacity, uint32_t id): slots(capacity), head(0), first(0), tid(id), thread_name() {}
+    std::vector<Slot> slots;
+    // index of the next event, only written by the owner thread
+    std::atomic<uint64_t> head;
+    // events before it are cleared
+    std::atomic<uint64_t> first;
+    const uint32_t tid;
+    // guarded by the mutex of the tracer
+    std::string thread_name;
+  };
+
+  struct Event {
+    uint64_t ts_ns;
+    uint64_t dur_ns;
+    uint64_t message_id;
+    uint32_t name;
+    uint32_t tid;
+    TraceKind kind;
+    char phase;
+  };
+
+  Tracer(): mutex_(), rings_(), names_(), name_ids_(), next_message_id_(1), ring_capacity_(1 << 16) {}
+  Tracer(const Tracer&) = delete;
+  void operator=(const Tracer&) = delete;
+
+  Ring& threadRing(){
+    static thread_local Ring* ring = nullptr;
+    if(!ring){
+      std::lock_guard<std::mutex> lk(mutex_);
+      rings_.emplace_back(new Ring(ring_capacity_.load(std::memory_order_relaxed),
+                                   static_cast<uint32_t>(rings_.size() + 1)));
+      ring = rings_.back().get();
+    }
+    return *ring;
+  }
+
+  void record(TraceKind kind, char phase, uint32_t name, uint64_t message_id, uint64_t ts_ns, uint64_t dur_ns){
+    Ring& ring = threadRing();
+    const uint64_t index = ring.head.load(std::memory_order_relaxed);
+    Slot& slot = ring.slots[index & (ring.slots.size() - 1)];
+    // a reader that sees any of the stores below also sees the head of the previous event
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.ts_ns.store(ts_ns, std::memory_order_relaxed);
+    slot.dur_ns.store(dur_ns, std::memory_order_relaxed);
+    slot.meta.store(static_cast<uint64_t>(name) << 16 | static_cast<uint64_t>(kind) << 8
+                    | static_cast<uint8_t>(phase), std::memory_order_relaxed);
+    slot.message_id.store(message_id, std::memory_order_relaxed);
+    ring.head.store(index + 1, std::memory_order_release);
+  }
+
+  // copy the events of `ring` that were not overwritten while they were copied
+  static void copyEvents(const Ring& ring, std::vector<Event>& events){
+    const uint64_t capacity = ring.slots.size();
+    const uint64_t head = ring.head.load(std::memory_order_acquire);
+    uint64_t begin = std::max(ring.first.load(std::memory_order_relaxed), head > capacity ? head - capacity : 0);
+    const size_t start = events.size();
+    for(uint64_t index = begin; index < head; ++index){
+      const Slot& slot = ring.slots[index & (capacity - 1)];
+      Event event;
+      event.ts_ns = slot.ts_ns.load(std::memory_order_relaxed);
+      event.dur_ns = slot.dur_ns.load(std::memory_order_relaxed);
+      const uint64_t meta = slot.meta.load(std::memory_order_relaxed);
+      event.message_id = slot.message_id.load(std::memory_order_relaxed);
+      event.name = static_cast<uint32_t>(meta >> 16);
+      event.kind = static_cast<TraceKind>((meta >> 8) & 0xff);
+      event.phase = static_cast<char>(meta & 0xff);
+      event.tid = ring.tid;
+      events.push_back(event);
+    }
+    // the owner may have overwritten the oldest copied slots in the meantime, including the one it is writing now
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t new_head = ring.head.load(std::memory_order_relaxed);
+    const uint64_t valid = new_head + 1 > capacity ? new_head + 1 - capacity : 0;
+    if(valid > begin){
+      const size_t torn = static_cast<size_t>(std::min(valid - begin, head - begin));
+      events.erase(events.begin() + start, events.begin() + start + torn);
+    }
+  }
+
+  static std::string microseconds(uint64_t ns){
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%llu.%03llu", static_cast<unsigned long long>(ns / 1000),
+                  static_cast<unsigned long long>(ns % 1000));
+    return buffer;
+  }
+
+  static std::string escape(const std::string& text){
+    std::string escaped;
+    for(char c : text){
+      if(c == '"' || c == '\\') escaped += '\\';
+      if(static_cast<unsigned char>(c) < 0x20) continue;
+      escaped += c;
+    }
+    return escaped;
+  }
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::vector<std::string> names_;
+  std::map<std::string, uint32_t> name_ids_;
+  std::atomic<uint64_t> next_message_id_;
+  std::atomic<size_t> ring_capacity_;
+};
+
+inline bool tracingEnabled(){
+  return Tracer::isEnabled();
+}
+
+// start time of a complete event, 0 if tracing is off
+inline uint64_t traceBegin(){
+  return Tracer::isEnabled() ? Tracer::nowNs() : 0;
+}
+
+inline void traceComplete(TraceKind kind, uint32_t name, uint64_t message_id, uint64_t begin_ns){
+  if(begin_ns != 0 && Tracer::isEnabled()) Tracer::instance().complete(kind, name, message_id, begin_ns);
+}
+
+template<typename T>
+inline void traceInstant(TraceKind kind, uint32_t name, const T& payload){
+  if(Tracer::isEnabled()) Tracer::instance().instant(kind, name, traceMessageId(payload, 0));
+}
+
+inline uint32_t traceName(const std::string& name){
+  return Tracer::instance().intern(name);
+}
+
+inline void traceThreadName(const std::string& name){
+  if(Tracer::isEnabled()) Tracer::instance().setThreadName(name);
+}
+
+// a new message id, 0 if tracing is off
+inline uint64_t traceNextMessageId(){
+  return Tracer::isEnabled() ? Tracer::instance().nextMessageId() : 0;
+}
+#else
+inline constexpr bool tracingEnabled(){
+  return false;
+}
+
+inline constexpr uint64_t traceBegin(){
+  return 0;
+}
+
+inline void traceComplete(TraceKind, uint32_t, uint64_t, uint64_t) {}
+
+template<typename T>
+inline void traceInstant(TraceKind, uint32_t, const T&) {}
+
+inline uint32_t traceName(const std::string&){
+  return 0;
+}
+
+inline void traceThreadName(const std::string&) {}
+
+inline constexpr uint64_t traceNextMessageId(){
+  return 0;
+}
+#endif
+}
+#endif //CONCURRENT_QUEUE_EVENT_TRACER_HPP
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <string>
+#include <thread>
+#include <chrono>
 #include "concurrent_queue.hpp"
 
 concurrent_queue::ConcurrentQueue<std::string> queue;
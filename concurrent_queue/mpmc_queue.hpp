@@ -0,0 +1,326 @@
+#ifndef CONCURRENT_QUEUE_MPMC_QUEUE_HPP
+#define CONCURRENT_QUEUE_MPMC_QUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include "aligned_allocator.hpp"
+#include "event_count.hpp"
+#include "wait_strategy.hpp"
+
+namespace concurrent_queue{
+
+/**
+ * Bounded lock-free queue for many producers and many consumers (D. Vyukov's algorithm).
+ * Every slot carries a sequence number that tells producers and consumers whose turn it is, so threads only
+ * contend on the head or tail counter with a single CAS and never on a shared mutex.
+ * It has the same push/try_pop/wait_and_pop/shutdown/restart contract as `ConcurrentQueue`.
+ * `push` waits while the queue is full. Waiting threads follow the wait strategy of the queue, by default they spin
+ * for a short while, then sleep.
+ */
+template<typename T>
+class MpmcQueue {
+public:
+  // `capacity` is rounded up to a power of two
+  explicit MpmcQueue(size_t capacity = 1024, WaitStrategy strategy = WaitStrategy::SpinThenBlock):
+    mask_(roundUpPowerOfTwo(capacity) - 1), cells_(new Cell[mask_ + 1]),
+    enqueue_pos_(0), dequeue_pos_(0), shutdown_(false), strategy_(strategy), not_empty_(), not_full_() {
+    for(size_t i = 0; i <= mask_; ++i){
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  };
+  ~MpmcQueue(){
+    const size_t enqueue_pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for(size_t pos = dequeue_pos_.load(std::memory_order_relaxed); pos != enqueue_pos; ++pos){
+      reinterpret_cast<T*>(&cells_[pos & mask_].storage)->~T();
+    }
+  }
+  MpmcQueue(const MpmcQueue&) = delete;
+  void operator=(const MpmcQueue&) = delete;
+
+  // the counters are cache line aligned, which plain `new` doesn't honour before C++17
+  static void* operator new(size_t size){
+    return alignedAllocate(size, alignof(MpmcQueue));
+  }
+  static void operator delete(void* p){
+    alignedFree(p);
+  }
+
+  // waits until it can push
+  bool push(T new_value){
+    for(;;){
+      if(try_push(std::move(new_value))) return true;
+      if(!waitUntil(not_full_, [this]{return hasFreeCell();})) return false;
+    }
+  }
+
+  // push without waiting for free space. Return false if the queue is full or shutdown.
+  // `new_value` is only moved from on success.
+  bool try_push(T&& new_value){
+    if(shutdown_.load(std::memory_order_relaxed)) return false;
+    if(!enqueue(new_value)) return false;
+    not_empty_.notifyOne();
+    return true;
+  }
+
+  // waits at most `timeout` for free space. Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool push_for(T&& new_value, const std::chrono::duration<Rep, Period>& timeout){
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for(;;){
+      if(try_push(std::move(new_value))) return true;
+      if(!waitUntil(not_full_, [this]{return hasFreeCell();}, deadline)) return false;
+    }
+  }
+
+  // push all items in [first, last) and notify consumers once. Items are moved from.
+  // Waits for free space as needed. Return the number of pushed items, less than the range size only on shutdown.
+  template<typename Iterator>
+  size_t push_bulk(Iterator first, Iterator last){
+    size_t pushed = 0;
+    while(first != last){
+      if(shutdown_) break;
+      size_t batch = 0;
+      for(; first != last && enqueue(*first); ++first){
+        ++batch;
+      }
+      if(batch != 0){
+        not_empty_.notifyAll();
+        pushed += batch;
+      } else if(!waitUntil(not_full_, [this]{return hasFreeCell();})){
+        break;
+      }
+    }
+    return pushed;
+  }
+
+  // wait until data is available and assign the value to the `value` parameter
+  bool wait_and_pop(T& value){
+    for(;;){
+      if(try_pop(value)) return true;
+      if(!waitUntil(not_empty_, [this]{return hasFilledCell();})) return false;
+    }
+  }
+
+  // waits at most `timeout` for data. Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool pop_for(T& value, const std::chrono::duration<Rep, Period>& timeout){
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for(;;){
+      if(try_pop(value)) return true;
+      if(!waitUntil(not_empty_, [this]{return hasFilledCell();}, deadline)) return false;
+    }
+  }
+
+  // pop without waiting for data availability. If empty queue or shutdown the return false.
+  bool try_pop(T& value){
+    if(shutdown_.load(std::memory_order_relaxed)) return false;
+    if(!dequeue(value)) return false;
+    not_full_.notifyOne();
+    return true;
+  }
+
+  // pop up to `max_n` items without waiting and notify producers once.
+  // Return the number of items written to `out`, 0 if the queue is empty or shutdown.
+  template<typename OutputIt>
+  size_t pop_bulk(OutputIt out, size_t max_n){
+    if(shutdown_.load(std::memory_order_relaxed)) return 0;
+    const size_t popped = dequeueBulk(out, max_n);
+    if(popped != 0) not_full_.notifyAll();
+    return popped;
+  }
+
+  // wait until data is available, then pop up to `max_n` items.
+  // Return the number of items written to `out`, 0 on shutdown.
+  template<typename OutputIt>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n){
+    for(;;){
+      const size_t popped = pop_bulk(out, max_n);
+      if(popped != 0) return popped;
+      if(!waitUntil(not_empty_, [this]{return hasFilledCell();})) return 0;
+    }
+  }
+
+  // waits at most `timeout` for data, then pop up to `max_n` items.
+  // Return the number of items written to `out`, 0 on timeout or shutdown.
+  template<typename OutputIt, typename Rep, typename Period>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n, const std::chrono::duration<Rep, Period>& timeout){
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for(;;){
+      const size_t popped = pop_bulk(out, max_n);
+      if(popped != 0) return popped;
+      if(!waitUntil(not_empty_, [this]{return hasFilledCell();}, deadline)) return 0;
+    }
+  }
+
+  // move every remaining item to the back of `container`, also after shutdown.
+  // Return the number of drained items.
+  template<typename Container>
+  size_t drain_into(Container& container){
+    const size_t popped = dequeueBulk(std::back_inserter(container), capacity());
+    if(popped != 0) not_full_.notifyAll();
+    return popped;
+  }
+
+  // check if the queue is empty
+  bool empty() const {
+    return size() == 0;
+  }
+
+  // return the approximate size of the queue
+  size_t size() const {
+    const size_t dequeue_pos = dequeue_pos_.load(std::memory_order_acquire);
+    const size_t enqueue_pos = enqueue_pos_.load(std::memory_order_acquire);
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+  }
+
+  // return the number of slots
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+
+  // shutdown the queue and notify all waiting threads
+  void shutdown(){
+    shutdown_ = true;
+    not_empty_.notifyAll();
+    not_full_.notifyAll();
+  }
+
+  // restart the queue
+  void restart(){
+    shutdown_ = false;
+    not_empty_.notifyAll();
+    not_full_.notifyAll();
+  }
+
+  // check if the queue is shutdown
+  bool isShutdown() const{
+    return shutdown_;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  static size_t roundUpPowerOfTwo(size_t n){
+    size_t result = 2;
+    while(result < n) result <<= 1;
+    return result;
+  }
+
+  // The wait predicates look at the cell the next pop or push will claim and not at the counters: a position is
+  // claimed before its cell is published, so `!empty()` can be true while try_pop still fails, and waiting on it
+  // would spin instead of blocking.
+
+  // the cell at dequeue_pos_ holds a value, or another consumer already took it and try_pop should look again
+  bool hasFilledCell() const {
+    const size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    const size_t seq = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+    return static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) >= 0;
+  }
+
+  // the cell at enqueue_pos_ is free, or another producer already filled it and try_push should look again
+  bool hasFreeCell() const {
+    const size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    const size_t seq = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+    return static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos) >= 0;
+  }
+
+
+  // claim the next free cell and move `new_value` into it. Return false if the queue is full.
+  bool enqueue(T& new_value){
+    Cell* cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for(;;){
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if(diff == 0){
+        if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if(diff < 0){
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    new (&cell->storage) T(std::move(new_value));
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // claim the oldest filled cell. Return nullptr if the queue is empty.
+  Cell* claimFilledCell(size_t& pos){
+    pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for(;;){
+      Cell* cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if(diff == 0){
+        if(dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return cell;
+      } else if(diff < 0){
+        return nullptr;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // move the value out of a claimed cell and hand the cell back to producers
+  template<typename OutputIt>
+  void releaseFilledCell(Cell* cell, size_t pos, OutputIt out){
+    T* item = reinterpret_cast<T*>(&cell->storage);
+    *out = std::move(*item);
+    item->~T();
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+  }
+
+  // move the oldest value out. Return false if the queue is empty.
+  bool dequeue(T& value){
+    size_t pos;
+    Cell* cell = claimFilledCell(pos);
+    if(!cell) return false;
+    releaseFilledCell(cell, pos, &value);
+    return true;
+  }
+
+  template<typename OutputIt>
+  size_t dequeueBulk(OutputIt out, size_t max_n){
+    size_t popped = 0;
+    for(; popped < max_n; ++popped){
+      size_t pos;
+      Cell* cell = claimFilledCell(pos);
+      if(!cell) break;
+      releaseFilledCell(cell, pos, out++);
+    }
+    return popped;
+  }
+
+  // wait with the wait strategy of the queue until `ready`. Return false on shutdown.
+  template<typename Predicate>
+  bool waitUntil(EventCount& event, Predicate ready){
+    return waitOnEvent(strategy_, event, shutdown_, ready);
+  }
+
+  // same as above but gives up at `deadline`. Return false on timeout or shutdown.
+  template<typename Predicate>
+  bool waitUntil(EventCount& event, Predicate ready, std::chrono::steady_clock::time_point deadline){
+    return waitOnEvent(strategy_, event, shutdown_, ready, deadline);
+  }
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(kCacheLineSize) std::atomic<size_t> enqueue_pos_;
+  alignas(kCacheLineSize) std::atomic<size_t> dequeue_pos_;
+  alignas(kCacheLineSize) std::atomic_bool shutdown_;
+  const WaitStrategy strategy_;
+  EventCount not_empty_;
+  EventCount not_full_;
+};
+}
+#endif //CONCURRENT_QUEUE_MPMC_QUEUE_HPP
@@ -0,0 +1,398 @@
+#ifndef CONCURRENT_QUEUE_PRIORITY_CONCURRENT_QUEUE_HPP
+#define CONCURRENT_QUEUE_PRIORITY_CONCURRENT_QUEUE_HPP
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <iterator>
+#include <utility>
+#include "ring_buffer.hpp"
+
+namespace concurrent_queue{
+
+/**
+ * Thread safe queue with a small fixed number of FIFO priority lanes. Lane 0 is the most urgent.
+ * Pops always take the front of the most urgent non-empty lane, so urgent items never wait behind a bulk backlog.
+ * Lower lanes are only served while the upper lanes are empty.
+ * Every item can carry a deadline. Items whose deadline has passed are dropped when they reach the front of their
+ * lane and counted by `numExpired()`.
+ * It has the same push/try_pop/wait_and_pop/shutdown/restart contract as `ConcurrentQueue`, so it can replace the
+ * input queue of a pipeline module. Plain `push(value)` asks the classifier for the lane and deadline of `value`.
+ */
+template<typename T>
+class PriorityConcurrentQueue {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // lane and deadline of one item
+  struct Priority {
+    size_t lane;
+    Clock::time_point deadline;
+  };
+
+  // return the priority of an item pushed without explicit priority
+  typedef std::function<Priority(const T&)> Classifier;
+
+  static constexpr size_t kDefaultNumLanes = 4;
+
+  static Clock::time_point noDeadline(){
+    return Clock::time_point::max();
+  }
+
+  // `capacity` limits the number of queued items of each lane. 0 means unbounded.
+  // A full bulk lane blocks only the producers of that lane, urgent items still get through.
+  // Items pushed without explicit priority go to the last lane without deadline until a classifier is set.
+  explicit PriorityConcurrentQueue(size_t capacity = 0, size_t num_lanes = kDefaultNumLanes):
+    mutex_(), lanes_(new Lane[num_lanes == 0 ? 1 : num_lanes]), num_lanes_(num_lanes == 0 ? 1 : num_lanes),
+    data_cond_(), capacity_(capacity), classifier_(), shutdown_(false), size_(0), expired_(0), data_waiters_(0) {
+  };
+  ~PriorityConcurrentQueue() = default;
+  PriorityConcurrentQueue(const PriorityConcurrentQueue<T>&) = delete;
+  void operator=(const PriorityConcurrentQueue<T>&) = delete;
+
+  // set the classifier used by the pushes without explicit priority. Must be called before the queue is used.
+  // It runs with the queue lock held, so it should only read a field or two of the item.
+  void setClassifier(Classifier classifier){
+    std::lock_guard<std::mutex> lk(mutex_);
+    classifier_ = std::move(classifier);
+  }
+
+  // waits until it can push into the lane chosen by the classifier
+  bool push(T new_value){
+    std::unique_lock<std::mutex> lk(mutex_);
+    const Priority priority = classify(new_value);
+    return pushLocked(lk, std::move(new_value), priority);
+  }
+
+  // waits until it can push into `lane`. `deadline` is when the item becomes worthless.
+  bool push(T new_value, size_t lane, Clock::time_point deadline = noDeadline()){
+    std::unique_lock<std::mutex> lk(mutex_);
+    return pushLocked(lk, std::move(new_value), Priority{clampLane(lane), deadline});
+  }
+
+  // push without waiting for free space. Return false if the lane is full or the queue is shutdown.
+  // `new_value` is only moved from on success, so the caller still owns it after a failed push.
+  bool try_push(T&& new_value){
+    std::lock_guard<std::mutex> lk(mutex_);
+    return tryPushLocked(new_value, classify(new_value));
+  }
+
+  bool try_push(T&& new_value, size_t lane, Clock::time_point deadline = noDeadline()){
+    std::lock_guard<std::mutex> lk(mutex_);
+    return tryPushLocked(new_value, Priority{clampLane(lane), deadline});
+  }
+
+  // waits at most `timeout` for free space in the lane chosen by the classifier. Return false on timeout or shutdown.
+  // `new_value` is only moved from on success.
+  template<typename Rep, typename Period>
+  bool push_for(T&& new_value, const std::chrono::duration<Rep, Period>& timeout){
+    const Clock::time_point until = Clock::now() + std::chrono::duration_cast<Clock::duration>(timeout);
+    std::unique_lock<std::mutex> lk(mutex_);
+    const Priority priority = classify(new_value);
+    Lane& lane = lanes_[priority.lane];
+    while(full(lane) && !shutdown_){
+      ++lane.space_waiters;
+      const std::cv_status status = lane.not_full_cond.wait_until(lk, until);
+      --lane.space_waiters;
+      if(status == std::cv_status::timeout && full(lane)) return false;
+    }
+    if(shutdown_) return false;
+    pushBackLocked(lane, std::move(new_value), priority.deadline);
+    return true;
+  }
+
+  // push all items in [first, last) taking the lock once. Items are moved from.
+  // In bounded mode waits for free space as needed. Return the number of pushed items, which is less than the
+  // range size only if the queue was shutdown.
+  template<typename Iterator>
+  size_t push_bulk(Iterator first, Iterator last){
+    size_t pushed = 0;
+    std::unique_lock<std::mutex> lk(mutex_);
+    for(; first != last; ++first, ++pushed){
+      const Priority priority = classify(*first);
+      if(!pushLocked(lk, std::move(*first), priority)) break;
+    }
+    return pushed;
+  }
+
+  // wait until an item is available and assign the most urgent one to the `value` parameter
+  bool wait_and_pop(T& value){
+    std::unique_lock<std::mutex> lk(mutex_);
+    while(!shutdown_){
+      if(popLocked(value)) return true;
+      waitForData(lk);
+    }
+    return false;
+  }
+
+  // waits at most `timeout` for an item and assign the most urgent one to the `value` parameter.
+  // Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool pop_for(T& value, const std::chrono::duration<Rep, Period>& timeout){
+    const Clock::time_point until = Clock::now() + std::chrono::duration_cast<Clock::duration>(timeout);
+    std::unique_lock<std::mutex> lk(mutex_);
+    while(!shutdown_){
+      if(popLocked(value)) return true;
+      if(!waitForData(lk, until)) return false;
+    }
+    return false;
+  }
+
+  // pop the most urgent item without waiting. Return false if the queue is empty or shutdown.
+  bool try_pop(T& value){
+    std::lock_guard<std::mutex> lk(mutex_);
+    if(shutdown_) return false;
+    return popLocked(value);
+  }
+
+  // pop up to `max_n` items in priority order in a single critical section without waiting.
+  // Return the number of items written to `out`, 0 if the queue is empty or shutdown.
+  template<typename OutputIt>
+  size_t pop_bulk(OutputIt out, size_t max_n){
+    std::lock_guard<std::mutex> lk(mutex_);
+    if(shutdown_) return 0;
+    return popBulkLocked(out, max_n);
+  }
+
+  // wait until an item is available, then pop up to `max_n` items in priority order in a single critical section.
+  // Return the number of items written to `out`, 0 on shutdown.
+  template<typename OutputIt>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n){
+    std::unique_lock<std::mutex> lk(mutex_);
+    while(!shutdown_){
+      size_t popped = popBulkLocked(out, max_n);
+      if(popped != 0) return popped;
+      waitForData(lk);
+    }
+    return 0;
+  }
+
+  // waits at most `timeout` for an item, then pop up to `max_n` items in priority order in a single critical
+  // section. Return the number of items written to `out`, 0 on timeout or shutdown.
+  template<typename OutputIt, typename Rep, typename Period>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n, const std::chrono::duration<Rep, Period>& timeout){
+    const Clock::time_point until = Clock::now() + std::chrono::duration_cast<Clock::duration>(timeout);
+    std::unique_lock<std::mutex> lk(mutex_);
+    while(!shutdown_){
+      size_t popped = popBulkLocked(out, max_n);
+      if(popped != 0) return popped;
+      if(!waitForData(lk, until)) return 0;
+    }
+    return 0;
+  }
+
+  // move every remaining unexpired item to the back of `container` in priority order, also after shutdown.
+  // Return the number of drained items.
+  template<typename Container>
+  size_t drain_into(Container& container){
+    std::lock_guard<std::mutex> lk(mutex_);
+    return popBulkLocked(std::back_inserter(container), size_.load(std::memory_order_relaxed));
+  }
+
+  // check if the queue is empty. Expired items that were not popped yet still count. It does not take the lock.
+  bool empty() const {
+    return size_.load(std::memory_order_relaxed) == 0;
+  }
+
+  // return the number of queued items in all lanes. It does not take the lock.
+  size_t size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  // return the number of queued items in `lane`
+  size_t laneSize(size_t lane) const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return lanes_[clampLane(lane)].items.size();
+  }
+
+  // return the maximum number of queued items per lane. 0 means unbounded.
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  size_t numLanes() const {
+    return num_lanes_;
+  }
+
+  // return the number of items dropped because their deadline passed before they were popped
+  uint64_t numExpired() const {
+    return expired_.load(std::memory_order_relaxed);
+  }
+
+  // shutdown the queue and notify all waiting threads
+  void shutdown(){
+    std::unique_lock<std::mutex> lk(mutex_);
+    shutdown_ = true;
+    lk.unlock();
+    notifyAll();
+  }
+
+  // restart the queue
+  void restart(){
+    std::unique_lock<std::mutex> lk(mutex_);
+    shutdown_ = false;
+    lk.unlock();
+    notifyAll();
+  }
+
+  // check if the queue is shutdown
+  bool isShutdown() const{
+    return shutdown_;
+  }
+
+private:
+  struct Entry {
+    Entry(T&& value, Clock::time_point deadline): value(std::move(value)), deadline(deadline) {}
+    T value;
+    Clock::time_point deadline;
+  };
+
+  struct Lane {
+    Lane(): items(), not_full_cond(), space_waiters(0) {}
+    RingBuffer<Entry> items;
+    std::condition_variable not_full_cond;
+    // producers sleeping on `not_full_cond`, guarded by `mutex_`
+    size_t space_waiters;
+  };
+
+  size_t clampLane(size_t lane) const {
+    return lane < num_lanes_ ? lane : num_lanes_ - 1;
+  }
+
+  // must be called with `mutex_` held
+  Priority classify(const T& value) const {
+    if(!classifier_) return Priority{num_lanes_ - 1, noDeadline()};
+    Priority priority = classifier_(value);
+    priority.lane = clampLane(priority.lane);
+    return priority;
+  }
+
+  // must be called with `mutex_` held
+  bool full(const Lane& lane) const {
+    return capacity_ != 0 && lane.items.size() >= capacity_;
+  }
+
+  // must be called with `mutex_` held through `lk`. Waits for free space in the lane of `priority`.
+  bool pushLocked(std::unique_lock<std::mutex>& lk, T&& new_value, const Priority& priority){
+    Lane& lane = lanes_[priority.lane];
+    while(full(lane) && !shutdown_){
+      ++lane.space_waiters;
+      lane.not_full_cond.wait(lk);
+      --lane.space_waiters;
+    }
+    if(shutdown_) return false;
+    pushBackLocked(lane, std::move(new_value), priority.deadline);
+    return true;
+  }
+
+  // must be called with `mutex_` held
+  bool tryPushLocked(T& new_value, const Priority& priority){
+    Lane& lane = lanes_[priority.lane];
+    if(shutdown_ || full(lane)) return false;
+    pushBackLocked(lane, std::move(new_value), priority.deadline);
+    return true;
+  }
+
+  // must be called with `mutex_` held. Skip the notification if no consumer sleeps.
+  void pushBackLocked(Lane& lane, T&& new_value, Clock::time_point deadline){
+    lane.items.emplace_back(std::move(new_value), deadline);
+    size_.fetch_add(1, std::memory_order_relaxed);
+    if(data_waiters_ != 0) data_cond_.notify_one();
+  }
+
+  // must be called with `mutex_` held. Drop the expired items at the front of `lane`.
+  void dropExpiredLocked(Lane& lane, Clock::time_point& now){
+    while(!lane.items.empty() && lane.items.front().deadline != noDeadline()){
+      // read the clock at most once per pop, and only for items with a deadline
+      if(now == Clock::time_point::min()) now = Clock::now();
+      if(lane.items.front().deadline > now) break;
+      lane.items.pop_front();
+      size_.fetch_sub(1, std::memory_order_relaxed);
+      expired_.fetch_add(1, std::memory_order_relaxed);
+      notifyNotFull(lane);
+    }
+  }
+
+  // must be called with `mutex_` held. Return false if every lane is empty.
+  bool popLocked(T& value){
+    Clock::time_point now = Clock::time_point::min();
+    for(size_t i = 0; i < num_lanes_; ++i){
+      Lane& lane = lanes_[i];
+      dropExpiredLocked(lane, now);
+      if(lane.items.empty()) continue;
+      value = std::move(lane.items.front().value);
+      lane.items.pop_front();
+      size_.fetch_sub(1, std::memory_order_relaxed);
+      notifyNotFull(lane);
+      return true;
+    }
+    return false;
+  }
+
+  // must be called with `mutex_` held
+  template<typename OutputIt>
+  size_t popBulkLocked(OutputIt out, size_t max_n){
+    Clock::time_point now = Clock::time_point::min();
+    size_t popped = 0;
+    for(size_t i = 0; i < num_lanes_ && popped < max_n; ++i){
+      Lane& lane = lanes_[i];
+      size_t lane_popped = 0;
+      for(dropExpiredLocked(lane, now); popped < max_n && !lane.items.empty(); dropExpiredLocked(lane, now)){
+        *out++ = std::move(lane.items.front().value);
+        lane.items.pop_front();
+        ++popped;
+        ++lane_popped;
+      }
+      if(lane_popped == 0) continue;
+      size_.fetch_sub(lane_popped, std::memory_order_relaxed);
+      if(capacity_ != 0 && lane.space_waiters != 0) lane.not_full_cond.notify_all();
+    }
+    return popped;
+  }
+
+  // must be called with `mutex_` held after removing an item from `lane`
+  void notifyNotFull(Lane& lane){
+    if(capacity_ != 0 && lane.space_waiters != 0) lane.not_full_cond.notify_one();
+  }
+
+  // must be called with `mutex_` held through `lk`. Sleep until an item is pushed or the queue is shutdown.
+  void waitForData(std::unique_lock<std::mutex>& lk){
+    ++data_waiters_;
+    data_cond_.wait(lk);
+    --data_waiters_;
+  }
+
+  // same as above but gives up at `until`. Return false on timeout.
+  bool waitForData(std::unique_lock<std::mutex>& lk, Clock::time_point until){
+    if(Clock::now() >= until) return false;
+    ++data_waiters_;
+    data_cond_.wait_until(lk, until);
+    --data_waiters_;
+    return true;
+  }
+
+  void notifyAll(){
+    data_cond_.notify_all();
+    for(size_t i = 0; i < num_lanes_; ++i){
+      lanes_[i].not_full_cond.notify_all();
+    }
+  }
+
+  mutable std::mutex mutex_;
+  std::unique_ptr<Lane[]> lanes_;
+  const size_t num_lanes_;
+  std::condition_variable data_cond_;
+  const size_t capacity_;
+  Classifier classifier_;
+  std::atomic_bool shutdown_;
+  // number of queued items in all lanes, written under `mutex_` and read without it by size()
+  std::atomic<size_t> size_;
+  std::atomic<uint64_t> expired_;
+  // consumers sleeping on `data_cond_`, guarded by `mutex_`
+  size_t data_waiters_;
+};
+}
+#endif //CONCURRENT_QUEUE_PRIORITY_CONCURRENT_QUEUE_HPP
@@ -0,0 +1,176 @@
+#ifndef CONCURRENT_QUEUE_QUEUE_SET_HPP
+#define CONCURRENT_QUEUE_QUEUE_SET_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "event_count.hpp"
+
+namespace concurrent_queue{
+
+// Waits on several queues with one thread, like select/poll on file descriptors.
+// Every registered queue notifies the same EventCount when an item is pushed, so no queue needs its own thread and
+// a waiting consumer sleeps until any of them has data. Queues are picked by weighted round-robin: a queue with
+// weight w is selected up to w times in a row while it has data, then the next ready queue gets its turn. Empty
+// queues are skipped, so the consumer never idles while one of them has data.
+//
+//   concurrent_queue::QueueSet set;
+//   const size_t video = set.add(video_queue, 3);
+//   const size_t audio = set.add(audio_queue);
+//   size_t index;
+//   while((index = set.select()) != concurrent_queue::QueueSet::npos){
+//     if(index == video && video_queue.try_pop(frame)) ...
+//   }
+//
+// A queue must have `setReadyEvent(EventCount*)`, `empty()` and `isShutdown()`, like `ConcurrentQueue`.
+// With several consumers another thread may pop the item first, so pop with `try_pop` and select again on failure.
+class QueueSet {
+public:
+  // returned by the select functions when there is nothing to wait for anymore, or on timeout
+  static const size_t npos = static_cast<size_t>(-1);
+
+  QueueSet(): event_(), mutex_(), members_(), cursor_(0), credit_(0), shutdown_(false) {}
+  // detach the event from the queues, they must still be alive
+  ~QueueSet(){
+    for(std::unique_ptr<Member>& member : members_){
+      member->detach();
+    }
+  }
+  QueueSet(const QueueSet&) = delete;
+  void operator=(const QueueSet&) = delete;
+
+  // register `queue` with `weight` turns per round, at least 1. A queue belongs to at most one set.
+  // Return the index select() returns when the queue is ready.
+  template<typename Queue>
+  size_t add(Queue& queue, size_t weight = 1){
+    std::lock_guard<std::mutex> lk(mutex_);
+    members_.emplace_back(new QueueMember<Queue>(queue, weight == 0 ? 1 : weight));
+    if(members_.size() == 1) credit_ = members_.front()->weight;
+    queue.setReadyEvent(&event_);
+    // items pushed before the event was attached did not notify anyone
+    event_.notifyAll();
+    return members_.size() - 1;
+  }
+
+  // wait until a queue has data and return its index.
+  // Return npos once the set is shutdown or every queue is shutdown.
+  size_t select(){
+    for(;;){
+      size_t index = trySelect();
+      if(index != npos || closed()) return index;
+      const uint64_t key = event_.prepareWait();
+      index = trySelect();
+      if(index != npos || closed()){
+        event_.cancelWait();
+        return index;
+      }
+      event_.wait(key);
+    }
+  }
+
+  // wait at most `timeout` for a queue with data. Return npos on timeout or shutdown.
+  template<typename Rep, typename Period>
+  size_t select_for(const std::chrono::duration<Rep, Period>& timeout){
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+    for(;;){
+      size_t index = trySelect();
+      if(index != npos || closed()) return index;
+      const uint64_t key = event_.prepareWait();
+      index = trySelect();
+      if(index != npos || closed()){
+        event_.cancelWait();
+        return index;
+      }
+      const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if(now >= deadline){
+        event_.cancelWait();
+        return npos;
+      }
+      event_.wait_for(key, deadline - now);
+    }
+  }
+
+  // return the index of the next ready queue by weighted round-robin without waiting, npos if none is ready
+  size_t trySelect(){
+    std::lock_guard<std::mutex> lk(mutex_);
+    const size_t n = members_.size();
+    for(size_t i = 0; i < n; ++i){
+      const size_t index = cursor_;
+      if(members_[index]->ready()){
+        if(--credit_ == 0) advance();
+        return index;
+      }
+      advance();
+    }
+    return npos;
+  }
+
+  // wake up the selecting threads, select() returns npos until restart()
+  void shutdown(){
+    shutdown_ = true;
+    event_.notifyAll();
+  }
+
+  void restart(){
+    shutdown_ = false;
+  }
+
+  bool isShutdown() const{
+    return shutdown_;
+  }
+
+  size_t size() const{
+    std::lock_guard<std::mutex> lk(mutex_);
+    return members_.size();
+  }
+
+private:
+  struct Member {
+    explicit Member(size_t w): weight(w) {}
+    virtual ~Member() = default;
+    // has an item to pop
+    virtual bool ready() const = 0;
+    virtual bool isShutdown() const = 0;
+    virtual void detach() = 0;
+    const size_t weight;
+  };
+
+  template<typename Queue>
+  struct QueueMember : Member {
+    QueueMember(Queue& q, size_t w): Member(w), queue(q) {}
+    bool ready() const override { return !queue.empty() && !queue.isShutdown(); }
+    bool isShutdown() const override { return queue.isShutdown(); }
+    void detach() override { queue.setReadyEvent(nullptr); }
+    Queue& queue;
+  };
+
+  // must be called with `mutex_` held
+  void advance(){
+    cursor_ = (cursor_ + 1) % members_.size();
+    credit_ = members_[cursor_]->weight;
+  }
+
+  // nothing left to wait for
+  bool closed() const{
+    if(shutdown_) return true;
+    std::lock_guard<std::mutex> lk(mutex_);
+    if(members_.empty()) return false;
+    for(const std::unique_ptr<Member>& member : members_){
+      if(!member->isShutdown()) return false;
+    }
+    return true;
+  }
+
+  EventCount event_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Member>> members_;
+  // queue whose turn it is and the number of selections it has left in this turn, guarded by `mutex_`
+  size_t cursor_;
+  size_t credit_;
+  std::atomic_bool shutdown_;
+};
+}
+#endif //CONCURRENT_QUEUE_QUEUE_SET_HPP
@@ -0,0 +1,311 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "concurrent_queue.hpp"
+#include "mpmc_queue.hpp"
+#include "priority_concurrent_queue.hpp"
+#include "shm_ring_queue.hpp"
+#include "spsc_ring_queue.hpp"
+
+// Stress tests of the queues, run by ctest:
+// - N:M push/pop: every pushed item is popped exactly once, and a consumer sees the items of one producer in order.
+// - shutdown and restart races: producers and consumers block while the queue is shutdown under them, no item
+//   pushed before the shutdown is lost, and the queue works again after restart.
+// - ShmRingQueue across fork(): the consumer peeks several slots and releases them out of order while the producer
+//   process waits for free slots, and a shutdown wakes the producer process.
+// Exits with 1 after the first failed check.
+// Usage: concurrent_queue_stress_test [--items N]
+
+static const size_t kQueueCapacity = 64;
+static const auto kTimeout = std::chrono::seconds(60);
+
+#define STRESS_CHECK(condition, message) \
+  do { \
+    if(!(condition)){ \
+      std::cerr << "FAILED " << __FILE__ << ":" << __LINE__ << ": " << #condition << ": " << message << std::endl; \
+      std::exit(1); \
+    } \
+  } while(0)
+
+template<typename T>
+using SpscQueue = concurrent_queue::SpscRingQueue<T, kQueueCapacity>;
+
+// an item is its producer and its sequence number, starting at 1 so that 0 is never a valid item
+static uint64_t makeItem(size_t producer, uint64_t sequence){
+  return (static_cast<uint64_t>(producer) << 40) | (sequence + 1);
+}
+
+static size_t producerOf(uint64_t item){
+  return static_cast<size_t>(item >> 40);
+}
+
+static uint64_t sequenceOf(uint64_t item){
+  return (item & ((1ull << 40) - 1)) - 1;
+}
+
+// `producers` threads push `items_per_producer` items each, half of them with push_bulk. `consumers` threads pop
+// them, half of them with wait_and_pop_bulk.
+template<typename Queue>
+void runConservation(const std::string& queue_name, const std::function<Queue*()>& make_queue,
+    size_t producers, size_t consumers, uint64_t items_per_producer){
+  std::unique_ptr<Queue> queue(make_queue());
+  const uint64_t total = producers * items_per_producer;
+  const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+  std::atomic<uint64_t> popped(0);
+  std::vector<std::vector<uint64_t>> received(consumers);
+
+  std::vector<std::thread> threads;
+  for(size_t c = 0; c < consumers; ++c){
+    threads.emplace_back([&, c]{
+      std::vector<uint64_t>& items = received[c];
+      std::vector<uint64_t> last_sequence(producers, 0);
+      std::vector<uint64_t> batch;
+      while(popped.load() < total){
+        STRESS_CHECK(std::chrono::steady_clock::now() < deadline, queue_name << ": consumers timed out");
+        batch.clear();
+        if(c % 2 == 0){
+          uint64_t item = 0;
+          if(queue->pop_for(item, std::chrono::milliseconds(10))) batch.push_back(item);
+        } else {
+          queue->wait_and_pop_bulk(std::back_inserter(batch), 16, std::chrono::milliseconds(10));
+        }
+        for(uint64_t item : batch){
+          const size_t producer = producerOf(item);
+          STRESS_CHECK(producer < producers, queue_name << ": popped an item that was never pushed: " << item);
+          STRESS_CHECK(sequenceOf(item) + 1 > last_sequence[producer],
+              queue_name << ": items of producer " << producer << " out of order");
+          last_sequence[producer] = sequenceOf(item) + 1;
+          items.push_back(item);
+        }
+        popped += batch.size();
+      }
+    });
+  }
+  for(size_t p = 0; p < producers; ++p){
+    threads.emplace_back([&, p]{
+      if(p % 2 == 0){
+        for(uint64_t i = 0; i < items_per_producer; ++i){
+          STRESS_CHECK(queue->push(makeItem(p, i)), queue_name << ": push failed");
+        }
+      } else {
+        std::vector<uint64_t> batch;
+        for(uint64_t i = 0; i < items_per_producer;){
+          batch.clear();
+          for(size_t n = 0; n < 16 && i < items_per_producer; ++n, ++i){
+            batch.push_back(makeItem(p, i));
+          }
+          STRESS_CHECK(queue->push_bulk(batch.begin(), batch.end()) == batch.size(), queue_name << ": push_bulk failed");
+        }
+      }
+    });
+  }
+  for(std::thread& thread : threads){
+    thread.join();
+  }
+
+  STRESS_CHECK(popped.load() == total, queue_name << ": popped " << popped.load() << " of " << total << " items");
+  std::vector<uint8_t> seen(total, 0);
+  for(const std::vector<uint64_t>& items : received){
+    for(uint64_t item : items){
+      uint8_t& count = seen[producerOf(item) * items_per_producer + sequenceOf(item)];
+      STRESS_CHECK(count == 0, queue_name << ": item " << item << " popped twice");
+      count = 1;
+    }
+  }
+  STRESS_CHECK(queue->empty(), queue_name << ": not empty after every item was popped");
+  std::cout << "conservation " << queue_name << " p=" << producers << " c=" << consumers << ": ok" << std::endl;
+}
+
+// producers push and consumers pop until the queue is shutdown under them, `rounds` times. The items pushed
+// successfully are popped or still queued, and the queue works again after restart().
+template<typename Queue>
+void runShutdownRestart(const std::string& queue_name, const std::function<Queue*()>& make_queue,
+    size_t producers, size_t consumers, size_t rounds){
+  std::unique_ptr<Queue> queue(make_queue());
+  for(size_t round = 0; round < rounds; ++round){
+    std::atomic<uint64_t> pushed(0);
+    std::atomic<uint64_t> popped(0);
+    std::vector<std::thread> threads;
+    for(size_t c = 0; c < consumers; ++c){
+      threads.emplace_back([&]{
+        uint64_t item = 0;
+        while(queue->wait_and_pop(item)){
+          ++popped;
+        }
+      });
+    }
+    for(size_t p = 0; p < producers; ++p){
+      threads.emplace_back([&, p]{
+        for(uint64_t i = 0; queue->push(makeItem(p, i)); ++i){
+          ++pushed;
+        }
+      });
+    }
+    // vary the moment of the shutdown, from before the threads run to a full queue
+    std::this_thread::sleep_for(std::chrono::microseconds(round % 4 * 500));
+    queue->shutdown();
+    for(std::thread& thread : threads){
+      thread.join();
+    }
+    STRESS_CHECK(queue->isShutdown(), queue_name << ": not shutdown");
+    std::vector<uint64_t> remaining;
+    queue->drain_into(remaining);
+    STRESS_CHECK(pushed.load() == popped.load() + remaining.size(),
+        queue_name << ": round " << round << ": pushed " << pushed.load() << ", popped " << popped.load()
+                   << ", remaining " << remaining.size());
+
+    queue->restart();
+    STRESS_CHECK(!queue->isShutdown(), queue_name << ": still shutdown after restart");
+    STRESS_CHECK(queue->empty(), queue_name << ": not empty after drain_into");
+    uint64_t item = makeItem(0, round);
+    STRESS_CHECK(queue->try_push(std::move(item)), queue_name << ": try_push failed after restart");
+    uint64_t popped_item = 0;
+    STRESS_CHECK(queue->try_pop(popped_item) && popped_item == makeItem(0, round),
+        queue_name << ": try_pop failed after restart");
+  }
+  std::cout << "shutdown/restart " << queue_name << " p=" << producers << " c=" << consumers << ": ok" << std::endl;
+}
+
+template<typename Queue>
+void runQueue(const std::string& queue_name, const std::function<Queue*()>& make_queue, size_t max_producers,
+    size_t max_consumers, uint64_t items){
+  const size_t counts[] = {1, 2, 4};
+  for(size_t producers : counts){
+    for(size_t consumers : counts){
+      if(producers > max_producers || consumers > max_consumers) continue;
+      runConservation<Queue>(queue_name, make_queue, producers, consumers, items / producers);
+    }
+  }
+  runShutdownRestart<Queue>(queue_name, make_queue, max_producers, max_consumers, 40);
+}
+
+// child process side of runShmRingQueue: open the queue and push items 1..items, half of them with push_bulk
+static int produceShm(const std::string& name, uint64_t items){
+  std::unique_ptr<concurrent_queue::ShmRingQueue<uint64_t>> queue =
+      concurrent_queue::ShmRingQueue<uint64_t>::open(name);
+  if(!queue) return 2;
+  std::vector<uint64_t> batch;
+  for(uint64_t i = 1; i <= items;){
+    if(i % 2 == 0){
+      if(!queue->push(i++)) return 3;
+      continue;
+    }
+    batch.clear();
+    for(size_t n = 0; n < 5 && i <= items; ++n){
+      batch.push_back(i++);
+    }
+    if(queue->push_bulk(batch.begin(), batch.end()) != batch.size()) return 4;
+  }
+  return 0;
+}
+
+static void waitForChild(pid_t child, int expected_status, const std::string& what){
+  int status = 0;
+  STRESS_CHECK(waitpid(child, &status, 0) == child, what << ": waitpid failed");
+  STRESS_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == expected_status,
+      what << ": producer process exited with " << (WIFEXITED(status) ? WEXITSTATUS(status) : -1));
+}
+
+// a forked producer process feeds a consumer that peeks up to 7 slots at a time and releases them in a shuffled
+// order, so the producer keeps waiting for slots that are released out of order
+static void runShmRingQueue(uint64_t items){
+  typedef concurrent_queue::ShmRingQueue<uint64_t> Queue;
+  const std::string name = "/concurrent_queue_stress_test_" + std::to_string(getpid());
+  std::unique_ptr<Queue> queue = Queue::create(name, kQueueCapacity);
+  STRESS_CHECK(queue, "cannot create shared memory queue " << name << ": " << std::strerror(errno));
+
+  pid_t child = fork();
+  STRESS_CHECK(child >= 0, "fork failed: " << std::strerror(errno));
+  if(child == 0) _exit(produceShm(name, items));
+  uint64_t expected = 1;
+  uint32_t random = 12345;
+  std::vector<const uint64_t*> peeked;
+  while(expected <= items){
+    const uint64_t want = std::min<uint64_t>(expected % 7 + 1, items - expected + 1);
+    peeked.clear();
+    for(uint64_t n = 0; n < want; ++n){
+      const uint64_t* item = queue->peek_for(kTimeout);
+      STRESS_CHECK(item, "ShmRingQueue: peek timed out at item " << expected);
+      STRESS_CHECK(*item == expected, "ShmRingQueue: peeked " << *item << " instead of " << expected);
+      peeked.push_back(item);
+      ++expected;
+    }
+    for(size_t i = peeked.size(); i > 1; --i){
+      random = random * 1103515245u + 12345u;
+      std::swap(peeked[i - 1], peeked[(random >> 16) % i]);
+    }
+    for(const uint64_t* item : peeked){
+      queue->release(item);
+    }
+  }
+  waitForChild(child, 0, "ShmRingQueue");
+  STRESS_CHECK(queue->empty() && queue->size() == 0, "ShmRingQueue: not empty after every item was popped");
+  std::cout << "fork ShmRingQueue out-of-order release: ok" << std::endl;
+
+  // the producer process fills the queue and blocks, the shutdown of this process wakes it
+  child = fork();
+  STRESS_CHECK(child >= 0, "fork failed: " << std::strerror(errno));
+  if(child == 0){
+    std::unique_ptr<Queue> producer_queue = Queue::open(name);
+    if(!producer_queue) _exit(255);
+    uint64_t pushed = 0;
+    while(producer_queue->push(pushed + 1)) ++pushed;
+    _exit(static_cast<int>(pushed));
+  }
+  const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+  while(queue->size() < queue->capacity()){
+    STRESS_CHECK(std::chrono::steady_clock::now() < deadline, "ShmRingQueue: the producer process never filled it");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  queue->shutdown();
+  waitForChild(child, static_cast<int>(queue->capacity()), "ShmRingQueue shutdown");
+  uint64_t item = 0;
+  STRESS_CHECK(!queue->try_pop(item), "ShmRingQueue: popped after shutdown");
+  queue->restart();
+  for(uint64_t i = 1; i <= queue->capacity(); ++i){
+    STRESS_CHECK(queue->try_pop(item) && item == i, "ShmRingQueue: lost item " << i << " across shutdown");
+  }
+  STRESS_CHECK(queue->empty(), "ShmRingQueue: not empty after restart and drain");
+  Queue::unlink(name);
+  std::cout << "fork ShmRingQueue shutdown/restart: ok" << std::endl;
+}
+
+int main(int argc, char* argv[]){
+  uint64_t items = 200000;
+  for(int i = 1; i < argc; ++i){
+    const std::string arg = argv[i];
+    if(arg == "--items" && i + 1 < argc){
+      items = std::strtoull(argv[++i], nullptr, 10);
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--items N]" << std::endl;
+      return 1;
+    }
+  }
+
+  runQueue<concurrent_queue::ConcurrentQueue<uint64_t>>("ConcurrentQueue/64",
+      []{ return new concurrent_queue::ConcurrentQueue<uint64_t>(kQueueCapacity); }, 4, 4, items);
+  runQueue<concurrent_queue::ConcurrentQueue<uint64_t>>("ConcurrentQueue/64/SpinThenBlock",
+      []{ return new concurrent_queue::ConcurrentQueue<uint64_t>(kQueueCapacity,
+          concurrent_queue::WaitStrategy::SpinThenBlock); }, 4, 4, items);
+  runQueue<concurrent_queue::MpmcQueue<uint64_t>>("MpmcQueue/64",
+      []{ return new concurrent_queue::MpmcQueue<uint64_t>(kQueueCapacity); }, 4, 4, items);
+  runQueue<concurrent_queue::MpmcQueue<uint64_t>>("MpmcQueue/64/Block",
+      []{ return new concurrent_queue::MpmcQueue<uint64_t>(kQueueCapacity, concurrent_queue::WaitStrategy::Block); },
+      4, 4, items);
+  runQueue<SpscQueue<uint64_t>>("SpscRingQueue/64", []{ return new SpscQueue<uint64_t>(); }, 1, 1, items);
+  runQueue<concurrent_queue::PriorityConcurrentQueue<uint64_t>>("PriorityConcurrentQueue/64",
+      []{ return new concurrent_queue::PriorityConcurrentQueue<uint64_t>(kQueueCapacity); }, 4, 4, items);
+  runShmRingQueue(items);
+  return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef CONCURRENT_QUEUE_RING_BUFFER_HPP
+#define CONCURRENT_QUEUE_RING_BUFFER_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace concurrent_queue{
+
+/**
+ * Growable FIFO ring buffer that stores values directly in one contiguous block.
+ * Unlike std::deque it never frees its storage while items flow through it, so a queue in steady state does not
+ * allocate. The capacity doubles when the ring is full. Not thread-safe.
+ */
+template<typename T>
+class RingBuffer {
+public:
+  RingBuffer(): slots_(), capacity_(0), head_(0), size_(0) {}
+  ~RingBuffer(){
+    clear();
+  }
+  RingBuffer(const RingBuffer&) = delete;
+  void operator=(const RingBuffer&) = delete;
+
+  // construct a new item in place at the back
+  template<typename... Args>
+  void emplace_back(Args&&... args){
+    if(size_ == capacity_) grow(capacity_ == 0 ? kInitialCapacity : capacity_ * 2);
+    new (&slots_[(head_ + size_) & (capacity_ - 1)]) T(std::forward<Args>(args)...);
+    ++size_;
+  }
+
+  void push_back(T&& value){
+    emplace_back(std::move(value));
+  }
+
+  T& front(){
+    return *reinterpret_cast<T*>(&slots_[head_]);
+  }
+
+  T& back(){
+    return *reinterpret_cast<T*>(&slots_[(head_ + size_ - 1) & (capacity_ - 1)]);
+  }
+
+  void pop_front(){
+    front().~T();
+    head_ = (head_ + 1) & (capacity_ - 1);
+    --size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // number of items that can be stored without allocating
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // make room for at least `n` items
+  void reserve(size_t n){
+    if(n <= capacity_) return;
+    size_t new_capacity = capacity_ == 0 ? kInitialCapacity : capacity_;
+    while(new_capacity < n) new_capacity *= 2;
+    grow(new_capacity);
+  }
+
+  // write the free slots, so their pages are allocated now, e.g. on the NUMA node of the calling thread, and not
+  // on the first pushes
+  void prefault(){
+    for(size_t i = size_; i < capacity_; ++i){
+      std::memset(static_cast<void*>(&slots_[(head_ + i) & (capacity_ - 1)]), 0, sizeof(Slot));
+    }
+  }
+
+  void clear(){
+    while(size_ != 0) pop_front();
+    head_ = 0;
+  }
+
+private:
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+  static constexpr size_t kInitialCapacity = 16;
+
+  void grow(size_t new_capacity){
+    std::unique_ptr<Slot[]> new_slots(new Slot[new_capacity]);
+    for(size_t i = 0; i < size_; ++i){
+      T& item = *reinterpret_cast<T*>(&slots_[(head_ + i) & (capacity_ - 1)]);
+      new (&new_slots[i]) T(std::move(item));
+      item.~T();
+    }
+    slots_ = std::move(new_slots);
+    capacity_ = new_capacity;
+    head_ = 0;
+  }
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t capacity_;
+  size_t head_;
+  size_t size_;
+};
+}
+#endif //CONCURRENT_QUEUE_RING_BUFFER_HPP
@@ -0,0 +1,501 @@
+#ifndef CONCURRENT_QUEUE_SHM_RING_QUEUE_HPP
+#define CONCURRENT_QUEUE_SHM_RING_QUEUE_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "event_count.hpp"
+#include "wait_strategy.hpp"
+
+namespace concurrent_queue{
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_BOOL_LOCK_FREE == 2,
+              "atomics in shared memory must be lock-free");
+
+// EventCount for threads of different processes. It lives in shared memory and sleeps on a futex.
+class ShmEventCount {
+public:
+  ShmEventCount(): waiters_(0), epoch_(0) {}
+  ShmEventCount(const ShmEventCount&) = delete;
+  void operator=(const ShmEventCount&) = delete;
+
+  uint64_t prepareWait(){
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return epoch_.load(std::memory_order_acquire);
+  }
+
+  void cancelWait(){
+    waiters_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  void wait(uint64_t key){
+    while(epoch_.load(std::memory_order_acquire) == key){
+      futex(FUTEX_WAIT, static_cast<uint32_t>(key), nullptr);
+    }
+    waiters_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  // Return false on timeout
+  template<typename Rep, typename Period>
+  bool wait_for(uint64_t key, const std::chrono::duration<Rep, Period>& timeout){
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+    bool notified = true;
+    while(epoch_.load(std::memory_order_acquire) == key){
+      const std::chrono::nanoseconds left = deadline - std::chrono::steady_clock::now();
+      if(left.count() <= 0){
+        notified = false;
+        break;
+      }
+      struct timespec ts;
+      ts.tv_sec = static_cast<time_t>(left.count() / 1000000000);
+      ts.tv_nsec = static_cast<long>(left.count() % 1000000000);
+      futex(FUTEX_WAIT, static_cast<uint32_t>(key), &ts);
+    }
+    waiters_.fetch_sub(1, std::memory_order_seq_cst);
+    return notified;
+  }
+
+  void notifyOne(){
+    if(bumpEpoch()) futex(FUTEX_WAKE, 1, nullptr);
+  }
+
+  void notifyAll(){
+    if(bumpEpoch()) futex(FUTEX_WAKE, INT_MAX, nullptr);
+  }
+
+private:
+  bool bumpEpoch(){
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(waiters_.load(std::memory_order_relaxed) == 0) return false;
+    epoch_.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  // not FUTEX_PRIVATE_FLAG, the waiters are in other processes
+  long futex(int op, uint32_t value, const struct timespec* timeout){
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), op, value, timeout, nullptr, 0);
+  }
+
+  std::atomic<uint32_t> waiters_;
+  std::atomic<uint32_t> epoch_;
+};
+
+/**
+ * Single producer process, single consumer process queue in POSIX shared memory, for pipelines split across
+ * processes on one Linux host. Items are trivially copyable and stored in a ring of preallocated slots.
+ * One process calls `create(name)`, the other `open(name)`. Threads of the same process are serialized by a local
+ * mutex per side, so a process may push or pop from several threads.
+ * Waiting threads follow the wait strategy of the queue, by default they spin for a short while, then sleep on a
+ * futex. `shutdown` and `restart` act on both processes.
+ *
+ * Consumers can read in place: `const T* item = queue.wait_and_peek()` hands out the next slot, `release(item)`
+ * gives it back to the producer. Items may be released in any order, a slot is reused once it and all slots
+ * before it are released. The copying pops are peek, copy and release.
+ */
+template<typename T>
+class ShmRingQueue {
+  static_assert(std::is_trivially_copyable<T>::value, "shared memory items must be trivially copyable");
+  static_assert(alignof(T) <= kCacheLineSize, "over-aligned items are not supported");
+public:
+  // create the shared memory object `name`, e.g. "/pipeline_edge", with `capacity` slots rounded up to a power of
+  // two. A stale object of the same name is replaced. Return nullptr on failure, errno tells why.
+  static std::unique_ptr<ShmRingQueue<T>> create(const std::string& name, size_t capacity = 1024,
+      WaitStrategy strategy = WaitStrategy::SpinThenBlock){
+    const size_t slots = roundUpPowerOfTwo(capacity);
+    const size_t length = kSlotsOffset + slots * sizeof(T);
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0) return std::unique_ptr<ShmRingQueue<T>>();
+    if(ftruncate(fd, static_cast<off_t>(length)) != 0){
+      closeKeepErrno(fd);
+      return std::unique_ptr<ShmRingQueue<T>>();
+    }
+    void* base = mapShared(fd, length);
+    if(!base) return std::unique_ptr<ShmRingQueue<T>>();
+    Header* header = new (base) Header();
+    header->slot_size = sizeof(T);
+    header->capacity = slots;
+    // publish the header last, `open` fails until it is complete
+    header->magic.store(kMagic, std::memory_order_release);
+    return std::unique_ptr<ShmRingQueue<T>>(new ShmRingQueue<T>(base, length, strategy));
+  }
+
+  // map the shared memory object `name` created by another process. Return nullptr if it does not exist, is not
+  // initialized yet or was created for another item type. errno tells why.
+  static std::unique_ptr<ShmRingQueue<T>> open(const std::string& name,
+      WaitStrategy strategy = WaitStrategy::SpinThenBlock){
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if(fd < 0) return std::unique_ptr<ShmRingQueue<T>>();
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+      closeKeepErrno(fd);
+      return std::unique_ptr<ShmRingQueue<T>>();
+    }
+    const size_t length = static_cast<size_t>(st.st_size);
+    if(length < kSlotsOffset){
+      close(fd);
+      errno = EAGAIN;
+      return std::unique_ptr<ShmRingQueue<T>>();
+    }
+    void* base = mapShared(fd, length);
+    if(!base) return std::unique_ptr<ShmRingQueue<T>>();
+    Header* header = static_cast<Header*>(base);
+    int error = 0;
+    if(header->magic.load(std::memory_order_acquire) != kMagic){
+      error = EAGAIN;
+    } else if(header->slot_size != sizeof(T) || kSlotsOffset + header->capacity * sizeof(T) != length){
+      error = EINVAL;
+    }
+    if(error != 0){
+      munmap(base, length);
+      errno = error;
+      return std::unique_ptr<ShmRingQueue<T>>();
+    }
+    return std::unique_ptr<ShmRingQueue<T>>(new ShmRingQueue<T>(base, length, strategy));
+  }
+
+  // remove the name of the shared memory object. Mapped queues keep working.
+  static bool unlink(const std::string& name){
+    return shm_unlink(name.c_str()) == 0;
+  }
+
+  ~ShmRingQueue(){
+    munmap(base_, length_);
+  }
+  ShmRingQueue(const ShmRingQueue<T>&) = delete;
+  void operator=(const ShmRingQueue<T>&) = delete;
+
+  // waits until it can push
+  bool push(const T& new_value){
+    std::lock_guard<std::mutex> lk(producer_mutex_);
+    if(!waitForSpace()) return false;
+    pushLocked(new_value);
+    return true;
+  }
+
+  // push without waiting for free space. Return false if the queue is full or shutdown.
+  bool try_push(const T& new_value){
+    std::lock_guard<std::mutex> lk(producer_mutex_);
+    if(header_->shutdown || full()) return false;
+    pushLocked(new_value);
+    return true;
+  }
+
+  // waits at most `timeout` for free space. Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool push_for(const T& new_value, const std::chrono::duration<Rep, Period>& timeout){
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+    std::lock_guard<std::mutex> lk(producer_mutex_);
+    if(!waitForSpace(deadline)) return false;
+    pushLocked(new_value);
+    return true;
+  }
+
+  // push all items in [first, last), waiting for free space as needed. Return the number of pushed items, which
+  // is less than the range size only if the queue was shutdown.
+  template<typename Iterator>
+  size_t push_bulk(Iterator first, Iterator last){
+    size_t pushed = 0;
+    std::lock_guard<std::mutex> lk(producer_mutex_);
+    for(; first != last; ++first, ++pushed){
+      if(!waitForSpace()) break;
+      pushLocked(*first);
+    }
+    return pushed;
+  }
+
+  // wait for the next item and return its slot without copying it. Return nullptr on shutdown.
+  // The slot belongs to the caller until `release`.
+  T* wait_and_peek(){
+    while(true){
+      T* item = try_peek();
+      if(item) return item;
+      if(!waitUntil(header_->not_empty, [this]{return hasUnread();})) return nullptr;
+    }
+  }
+
+  // return the slot of the next item without waiting, nullptr if there is none or the queue is shutdown
+  T* try_peek(){
+    std::lock_guard<std::mutex> lk(consumer_mutex_);
+    if(header_->shutdown) return nullptr;
+    const uint64_t read = header_->read.load(std::memory_order_relaxed);
+    if(read == header_->tail.load(std::memory_order_acquire)) return nullptr;
+    header_->read.store(read + 1, std::memory_order_relaxed);
+    return &slots_[read & mask_];
+  }
+
+  // waits at most `timeout` for the next item. Return nullptr on timeout or shutdown.
+  template<typename Rep, typename Period>
+  T* peek_for(const std::chrono::duration<Rep, Period>& timeout){
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+    while(true){
+      T* item = try_peek();
+      if(item) return item;
+      if(!waitUntil(header_->not_empty, [this]{return hasUnread();}, deadline)) return nullptr;
+    }
+  }
+
+  // give a slot from a peek back to the producer
+  void release(const T* item){
+    std::lock_guard<std::mutex> lk(consumer_mutex_);
+    const uint64_t head = header_->head.load(std::memory_order_relaxed);
+    const uint64_t read = header_->read.load(std::memory_order_relaxed);
+    const size_t index = static_cast<size_t>(item - slots_);
+    if(index == (head & mask_)){
+      // in order, the common case
+      advanceHead(head + 1, read);
+      return;
+    }
+    released_[index] = true;
+  }
+
+  // wait until data is available in the queue and copy the value to the `value` parameter
+  bool wait_and_pop(T& value){
+    const T* item = wait_and_peek();
+    if(!item) return false;
+    std::memcpy(static_cast<void*>(&value), item, sizeof(T));
+    release(item);
+    return true;
+  }
+
+  // pop without waiting for data availability. If empty queue the return false.
+  bool try_pop(T& value){
+    const T* item = try_peek();
+    if(!item) return false;
+    std::memcpy(static_cast<void*>(&value), item, sizeof(T));
+    release(item);
+    return true;
+  }
+
+  // waits at most `timeout` for data and copy the value to the `value` parameter.
+  // Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool pop_for(T& value, const std::chrono::duration<Rep, Period>& timeout){
+    const T* item = peek_for(timeout);
+    if(!item) return false;
+    std::memcpy(static_cast<void*>(&value), item, sizeof(T));
+    release(item);
+    return true;
+  }
+
+  // pop up to `max_n` items without waiting. Return the number of items written to `out`.
+  template<typename OutputIt>
+  size_t pop_bulk(OutputIt out, size_t max_n){
+    size_t popped = 0;
+    T value;
+    for(; popped < max_n && try_pop(value); ++popped){
+      *out++ = value;
+    }
+    return popped;
+  }
+
+  // wait until data is available, then pop up to `max_n` items. Return the number of items written to `out`,
+  // 0 on shutdown.
+  template<typename OutputIt>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n){
+    if(max_n == 0) return 0;
+    T value;
+    if(!wait_and_pop(value)) return 0;
+    *out++ = value;
+    return 1 + pop_bulk(out, max_n - 1);
+  }
+
+  // waits at most `timeout` for data, then pop up to `max_n` items. Return the number of items written to `out`,
+  // 0 on timeout or shutdown.
+  template<typename OutputIt, typename Rep, typename Period>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n, const std::chrono::duration<Rep, Period>& timeout){
+    if(max_n == 0) return 0;
+    T value;
+    if(!pop_for(value, timeout)) return 0;
+    *out++ = value;
+    return 1 + pop_bulk(out, max_n - 1);
+  }
+
+  // copy every unread item to the back of `container`, also after shutdown. Return the number of drained items.
+  template<typename Container>
+  size_t drain_into(Container& container){
+    size_t drained = 0;
+    while(true){
+      std::unique_lock<std::mutex> lk(consumer_mutex_);
+      const uint64_t read = header_->read.load(std::memory_order_relaxed);
+      if(read == header_->tail.load(std::memory_order_acquire)) break;
+      header_->read.store(read + 1, std::memory_order_relaxed);
+      const T* item = &slots_[read & mask_];
+      container.push_back(*item);
+      lk.unlock();
+      release(item);
+      ++drained;
+    }
+    return drained;
+  }
+
+  // check if there is no unread item
+  bool empty() const {
+    return !hasUnread();
+  }
+
+  // return the number of unread items
+  size_t size() const {
+    // `read` first: it never passes a `tail` loaded after it, so the difference can't wrap
+    const uint64_t read = header_->read.load(std::memory_order_acquire);
+    return static_cast<size_t>(header_->tail.load(std::memory_order_acquire) - read);
+  }
+
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+
+  // shutdown the queue in both processes and notify all waiting threads
+  void shutdown(){
+    header_->shutdown = true;
+    header_->not_empty.notifyAll();
+    header_->not_full.notifyAll();
+  }
+
+  // restart the queue in both processes
+  void restart(){
+    header_->shutdown = false;
+    header_->not_empty.notifyAll();
+    header_->not_full.notifyAll();
+  }
+
+  // check if the queue is shutdown
+  bool isShutdown() const{
+    return header_->shutdown;
+  }
+
+private:
+  static constexpr uint64_t kMagic = 0x53484d5152494e47ull; // "SHMQRING"
+
+  // shared by both processes. Counters only grow, slot `n & mask` holds item `n`.
+  struct Header {
+    Header(): magic(0), slot_size(0), capacity(0), tail(0), read(0), head(0), shutdown(false),
+              not_empty(), not_full() {}
+    std::atomic<uint64_t> magic;
+    uint64_t slot_size;
+    uint64_t capacity;
+    // items pushed, written by the producer
+    alignas(kCacheLineSize) std::atomic<uint64_t> tail;
+    // items handed out and items released, written by the consumer
+    alignas(kCacheLineSize) std::atomic<uint64_t> read;
+    std::atomic<uint64_t> head;
+    alignas(kCacheLineSize) std::atomic_bool shutdown;
+    ShmEventCount not_empty;
+    ShmEventCount not_full;
+  };
+
+  static constexpr size_t kSlotsOffset = (sizeof(Header) + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize;
+
+  ShmRingQueue(void* base, size_t length, WaitStrategy strategy):
+    base_(base), length_(length), header_(static_cast<Header*>(base)),
+    slots_(reinterpret_cast<T*>(static_cast<char*>(base) + kSlotsOffset)),
+    mask_(static_cast<size_t>(header_->capacity) - 1), strategy_(strategy),
+    producer_mutex_(), consumer_mutex_(), released_(header_->capacity, false) {
+  }
+
+  static size_t roundUpPowerOfTwo(size_t n){
+    size_t result = 2;
+    while(result < n) result <<= 1;
+    return result;
+  }
+
+  static void closeKeepErrno(int fd){
+    const int error = errno;
+    close(fd);
+    errno = error;
+  }
+
+  // map the whole object and touch it now, so pushes and pops don't take page faults. Closes `fd`.
+  static void* mapShared(int fd, size_t length){
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    closeKeepErrno(fd);
+    return base == MAP_FAILED ? nullptr : base;
+  }
+
+  // must be called with `producer_mutex_` held
+  bool full() const {
+    return header_->tail.load(std::memory_order_relaxed) - header_->head.load(std::memory_order_acquire) > mask_;
+  }
+
+  bool hasUnread() const {
+    return header_->tail.load(std::memory_order_acquire) != header_->read.load(std::memory_order_acquire);
+  }
+
+  // must be called with `producer_mutex_` held and free space
+  void pushLocked(const T& new_value){
+    const uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    std::memcpy(static_cast<void*>(&slots_[tail & mask_]), &new_value, sizeof(T));
+    header_->tail.store(tail + 1, std::memory_order_release);
+    header_->not_empty.notifyOne();
+  }
+
+  // must be called with `consumer_mutex_` held. Release every slot from `head` on that was released out of order.
+  void advanceHead(uint64_t head, uint64_t read){
+    while(head != read && released_[head & mask_]){
+      released_[head & mask_] = false;
+      ++head;
+    }
+    header_->head.store(head, std::memory_order_release);
+    header_->not_full.notifyOne();
+  }
+
+  // must be called with `producer_mutex_` held. Return false on shutdown.
+  bool waitForSpace(){
+    while(!header_->shutdown && full()){
+      if(!waitUntil(header_->not_full, [this]{return !full();})) return false;
+    }
+    return !header_->shutdown;
+  }
+
+  // same as above but gives up at `deadline`. Return false on timeout or shutdown.
+  bool waitForSpace(std::chrono::steady_clock::time_point deadline){
+    while(!header_->shutdown && full()){
+      if(!waitUntil(header_->not_full, [this]{return !full();}, deadline)) return false;
+    }
+    return !header_->shutdown;
+  }
+
+  template<typename Predicate>
+  bool waitUntil(ShmEventCount& event, Predicate ready){
+    return waitOnEvent(strategy_, event, header_->shutdown, ready);
+  }
+
+  template<typename Predicate>
+  bool waitUntil(ShmEventCount& event, Predicate ready, std::chrono::steady_clock::time_point deadline){
+    return waitOnEvent(strategy_, event, header_->shutdown, ready, deadline);
+  }
+
+  void* const base_;
+  const size_t length_;
+  Header* const header_;
+  T* const slots_;
+  const size_t mask_;
+  const WaitStrategy strategy_;
+  // local to this process
+  std::mutex producer_mutex_;
+  std::mutex consumer_mutex_;
+  // slots released out of order, guarded by `consumer_mutex_`
+  std::vector<bool> released_;
+};
+}
+#endif //CONCURRENT_QUEUE_SHM_RING_QUEUE_HPP
@@ -0,0 +1,287 @@
+#ifndef CONCURRENT_QUEUE_SPSC_RING_QUEUE_HPP
+#define CONCURRENT_QUEUE_SPSC_RING_QUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include "aligned_allocator.hpp"
+#include "event_count.hpp"
+#include "wait_strategy.hpp"
+
+namespace concurrent_queue{
+
+/**
+ * Lock-free queue for exactly one producer thread and one consumer thread.
+ * Items are stored in a ring of `Capacity` preallocated slots, so push and pop never allocate.
+ * It has the same push/try_pop/wait_and_pop/shutdown/restart contract as `ConcurrentQueue`, except that
+ * it is always bounded: `push` waits while the ring is full.
+ * Waiting threads follow the wait strategy of the queue, by default they spin for a short while, then sleep until
+ * the other side notifies them.
+ *
+ * To use it as a pipeline queue policy, fix the capacity with an alias template:
+ *   template<typename T> using SpscQueue1024 = concurrent_queue::SpscRingQueue<T, 1024>;
+ */
+template<typename T, size_t Capacity>
+class SpscRingQueue {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+  explicit SpscRingQueue(WaitStrategy strategy = WaitStrategy::SpinThenBlock):
+    head_(0), cached_tail_(0), tail_(0), cached_head_(0), shutdown_(false), strategy_(strategy),
+    not_empty_(), not_full_(), slots_(new Slot[Capacity]) {
+  };
+  ~SpscRingQueue(){
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    for(size_t i = head_.load(std::memory_order_relaxed); i != tail; ++i){
+      slot(i).~T();
+    }
+  }
+  SpscRingQueue(const SpscRingQueue&) = delete;
+  void operator=(const SpscRingQueue&) = delete;
+
+  // the counters are cache line aligned, which plain `new` doesn't honour before C++17
+  static void* operator new(size_t size){
+    return alignedAllocate(size, alignof(SpscRingQueue));
+  }
+  static void operator delete(void* p){
+    alignedFree(p);
+  }
+
+  // waits until it can push. Must only be called from the producer thread.
+  bool push(T new_value){
+    for(;;){
+      if(try_push(std::move(new_value))) return true;
+      if(!waitUntil(not_full_, [this]{return writable();})) return false;
+    }
+  }
+
+  // push without waiting for free space. Return false if the ring is full or shutdown.
+  // `new_value` is only moved from on success.
+  bool try_push(T&& new_value){
+    if(shutdown_.load(std::memory_order_relaxed)) return false;
+    if(!enqueue(new_value)) return false;
+    not_empty_.notifyOne();
+    return true;
+  }
+
+  // waits at most `timeout` for free space. Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool push_for(T&& new_value, const std::chrono::duration<Rep, Period>& timeout){
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for(;;){
+      if(try_push(std::move(new_value))) return true;
+      if(!waitUntil(not_full_, [this]{return writable();}, deadline)) return false;
+    }
+  }
+
+  // push all items in [first, last), publishing and notifying once per batch. Items are moved from.
+  // Waits for free space as needed. Return the number of pushed items, less than the range size only on shutdown.
+  template<typename Iterator>
+  size_t push_bulk(Iterator first, Iterator last){
+    size_t pushed = 0;
+    while(first != last){
+      if(shutdown_) break;
+      size_t batch = 0;
+      const size_t tail = tail_.load(std::memory_order_relaxed);
+      const size_t free_slots = Capacity - (tail - head_.load(std::memory_order_acquire));
+      for(; first != last && batch < free_slots; ++first, ++batch){
+        new (&slots_[(tail + batch) & kMask]) T(std::move(*first));
+      }
+      if(batch != 0){
+        tail_.store(tail + batch, std::memory_order_release);
+        not_empty_.notifyOne();
+        pushed += batch;
+      } else if(!waitUntil(not_full_, [this]{return writable();})){
+        break;
+      }
+    }
+    return pushed;
+  }
+
+  // wait until data is available and assign the value to the `value` parameter.
+  // Must only be called from the consumer thread.
+  bool wait_and_pop(T& value){
+    for(;;){
+      if(try_pop(value)) return true;
+      if(!waitUntil(not_empty_, [this]{return readable();})) return false;
+    }
+  }
+
+  // waits at most `timeout` for data. Return false on timeout or shutdown.
+  template<typename Rep, typename Period>
+  bool pop_for(T& value, const std::chrono::duration<Rep, Period>& timeout){
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for(;;){
+      if(try_pop(value)) return true;
+      if(!waitUntil(not_empty_, [this]{return readable();}, deadline)) return false;
+    }
+  }
+
+  // pop without waiting for data availability. If empty queue or shutdown the return false.
+  bool try_pop(T& value){
+    if(shutdown_.load(std::memory_order_relaxed)) return false;
+    if(!dequeue(value)) return false;
+    not_full_.notifyOne();
+    return true;
+  }
+
+  // pop up to `max_n` items without waiting, publishing and notifying once.
+  // Return the number of items written to `out`, 0 if the queue is empty or shutdown.
+  template<typename OutputIt>
+  size_t pop_bulk(OutputIt out, size_t max_n){
+    if(shutdown_.load(std::memory_order_relaxed)) return 0;
+    const size_t popped = dequeueBulk(out, max_n);
+    if(popped != 0) not_full_.notifyOne();
+    return popped;
+  }
+
+  // wait until data is available, then pop up to `max_n` items.
+  // Return the number of items written to `out`, 0 on shutdown.
+  template<typename OutputIt>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n){
+    for(;;){
+      const size_t popped = pop_bulk(out, max_n);
+      if(popped != 0) return popped;
+      if(!waitUntil(not_empty_, [this]{return readable();})) return 0;
+    }
+  }
+
+  // waits at most `timeout` for data, then pop up to `max_n` items.
+  // Return the number of items written to `out`, 0 on timeout or shutdown.
+  template<typename OutputIt, typename Rep, typename Period>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n, const std::chrono::duration<Rep, Period>& timeout){
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for(;;){
+      const size_t popped = pop_bulk(out, max_n);
+      if(popped != 0) return popped;
+      if(!waitUntil(not_empty_, [this]{return readable();}, deadline)) return 0;
+    }
+  }
+
+  // move every remaining item to the back of `container`, also after shutdown.
+  // Return the number of drained items.
+  template<typename Container>
+  size_t drain_into(Container& container){
+    const size_t popped = dequeueBulk(std::back_inserter(container), Capacity);
+    if(popped != 0) not_full_.notifyOne();
+    return popped;
+  }
+
+  // check if the queue is empty
+  bool empty() const {
+    return size() == 0;
+  }
+
+  // return the size of the queue. Only exact when called from the producer or the consumer thread.
+  size_t size() const {
+    const size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+  // return the number of slots in the ring
+  size_t capacity() const {
+    return Capacity;
+  }
+
+  // shutdown the queue and notify all waiting threads
+  void shutdown(){
+    shutdown_ = true;
+    not_empty_.notifyAll();
+    not_full_.notifyAll();
+  }
+
+  // restart the queue
+  void restart(){
+    shutdown_ = false;
+    not_empty_.notifyAll();
+    not_full_.notifyAll();
+  }
+
+  // check if the queue is shutdown
+  bool isShutdown() const{
+    return shutdown_;
+  }
+
+private:
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+  static constexpr size_t kMask = Capacity - 1;
+
+  T& slot(size_t index){
+    return *reinterpret_cast<T*>(&slots_[index & kMask]);
+  }
+
+  bool readable() const {
+    return head_.load(std::memory_order_relaxed) != tail_.load(std::memory_order_acquire);
+  }
+
+  bool writable() const {
+    return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) < Capacity;
+  }
+
+  bool enqueue(T& new_value){
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if(tail - cached_head_ == Capacity){
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if(tail - cached_head_ == Capacity) return false;
+    }
+    new (&slots_[tail & kMask]) T(std::move(new_value));
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool dequeue(T& value){
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if(head == cached_tail_){
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if(head == cached_tail_) return false;
+    }
+    T& item = slot(head);
+    value = std::move(item);
+    item.~T();
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  template<typename OutputIt>
+  size_t dequeueBulk(OutputIt out, size_t max_n){
+    const size_t head = head_.load(std::memory_order_relaxed);
+    cached_tail_ = tail_.load(std::memory_order_acquire);
+    size_t popped = 0;
+    for(; popped < max_n && head + popped != cached_tail_; ++popped){
+      T& item = slot(head + popped);
+      *out++ = std::move(item);
+      item.~T();
+    }
+    head_.store(head + popped, std::memory_order_release);
+    return popped;
+  }
+
+  // wait with the wait strategy of the queue until `ready`. Return false on shutdown.
+  template<typename Predicate>
+  bool waitUntil(EventCount& event, Predicate ready){
+    return waitOnEvent(strategy_, event, shutdown_, ready);
+  }
+
+  // same as above but gives up at `deadline`. Return false on timeout or shutdown.
+  template<typename Predicate>
+  bool waitUntil(EventCount& event, Predicate ready, std::chrono::steady_clock::time_point deadline){
+    return waitOnEvent(strategy_, event, shutdown_, ready, deadline);
+  }
+
+  // consumer side
+  alignas(kCacheLineSize) std::atomic<size_t> head_;
+  size_t cached_tail_;
+  // producer side
+  alignas(kCacheLineSize) std::atomic<size_t> tail_;
+  size_t cached_head_;
+
+  alignas(kCacheLineSize) std::atomic_bool shutdown_;
+  const WaitStrategy strategy_;
+  EventCount not_empty_;
+  EventCount not_full_;
+  std::unique_ptr<Slot[]> slots_;
+};
+}
+#endif //CONCURRENT_QUEUE_SPSC_RING_QUEUE_HPP
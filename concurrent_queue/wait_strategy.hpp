@@ -0,0 +1,76 @@
+#ifndef CONCURRENT_QUEUE_WAIT_STRATEGY_HPP
+#define CONCURRENT_QUEUE_WAIT_STRATEGY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include "event_count.hpp"
+
+namespace concurrent_queue{
+
+// How a thread waits for data or free space in a queue
+enum class WaitStrategy {
+  // sleep right away. Lowest CPU use, every hand-off pays a futex wake-up.
+  Block,
+  // spin with pause instructions, then yield, then sleep. Fast hand-off under load, idle threads still sleep.
+  SpinThenBlock,
+  // never sleep. Sub-microsecond hand-off, but every waiting thread burns a core.
+  BusySpin
+};
+
+static constexpr int kWaitSpinCount = 256;
+static constexpr int kWaitYieldCount = 16;
+
+// the spin phase of `strategy`: poll `ready` until it returns true or the strategy says it is time to sleep.
+// Return the last value of `ready()`. Never returns false for BusySpin.
+template<typename Predicate>
+bool spinWait(WaitStrategy strategy, Predicate ready){
+  if(strategy == WaitStrategy::Block) return ready();
+  for(int i = 0; strategy == WaitStrategy::BusySpin || i < kWaitSpinCount; ++i){
+    if(ready()) return true;
+    cpuRelax();
+  }
+  for(int i = 0; i < kWaitYieldCount; ++i){
+    if(ready()) return true;
+    std::this_thread::yield();
+  }
+  return ready();
+}
+
+// wait with `strategy` until `ready`, sleeping on `event` once the spin phase is over.
+// Return false on shutdown. The caller must try again after a true return, another thread may have won the race.
+// `Event` is an EventCount or anything with the same prepareWait/cancelWait/wait/wait_for interface.
+template<typename Event, typename Predicate>
+bool waitOnEvent(WaitStrategy strategy, Event& event, const std::atomic_bool& shutdown, Predicate ready){
+  if(spinWait(strategy, [&]{return shutdown.load(std::memory_order_relaxed) || ready();})){
+    return !shutdown;
+  }
+  uint64_t key = event.prepareWait();
+  if(ready() || shutdown){
+    event.cancelWait();
+  } else {
+    event.wait(key);
+  }
+  return !shutdown;
+}
+
+// same as above but gives up at `deadline`. Return false on timeout or shutdown.
+template<typename Event, typename Predicate>
+bool waitOnEvent(WaitStrategy strategy, Event& event, const std::atomic_bool& shutdown, Predicate ready,
+    std::chrono::steady_clock::time_point deadline){
+  if(spinWait(strategy, [&]{
+      return shutdown.load(std::memory_order_relaxed) || ready() || std::chrono::steady_clock::now() >= deadline;
+    })){
+    return !shutdown && ready();
+  }
+  uint64_t key = event.prepareWait();
+  if(ready() || shutdown){
+    event.cancelWait();
+  } else if(!event.wait_for(key, deadline - std::chrono::steady_clock::now())){
+    return false;
+  }
+  return !shutdown;
+}
+}
+#endif //CONCURRENT_QUEUE_WAIT_STRATEGY_HPP
@@ -0,0 +1,71 @@
+#include <glog/logging.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "async_pipeline_module.hpp"
+
+// Many I/O-bound async modules multiplexed over a handful of executor threads.
+// Every stage waits 10ms per input, like a disk read, but only suspends its coroutine while it waits.
+
+using Async = modular_pipeline::AsyncPipelineModule<std::string, std::string>;
+
+class ExampleReadModule : public Async {
+public:
+  ExampleReadModule(InputQueueSharedPtr &input_queue, OutputQueueSharedPtr &output_queue,
+      const std::string &module_id, size_t concurrency)
+      : Async(input_queue, output_queue, module_id, concurrency) {
+  }
+
+protected:
+  modular_pipeline::Task<OutputSharedPtr> spinOnce(InputUniquePtr input) override{
+    co_await executor().sleepFor(std::chrono::milliseconds(10));
+    co_return makeOutputPayload("[Read] " + *input);
+  }
+};
+
+int main(int argc, char* argv[]){
+  google::InstallFailureSignalHandler();
+  google::InitGoogleLogging(argv[0]);
+
+  const size_t kNumModules = 1000;
+  const size_t kInputsPerModule = 10;
+  modular_pipeline::PipelineExecutor executor(4);
+
+  Async::OutputQueueSharedPtr no_output_queue;
+  std::atomic<uint64_t> outputs(0);
+  std::vector<Async::InputQueueSharedPtr> input_queues;
+  std::vector<std::unique_ptr<ExampleReadModule>> modules;
+  for(size_t i = 0; i < kNumModules; ++i){
+    input_queues.push_back(std::make_shared<Async::InputQueue>());
+    modules.emplace_back(new ExampleReadModule(input_queues.back(), no_output_queue,
+                                               "ExampleReadModule_" + std::to_string(i), 2));
+    modules.back()->setOutputSink([&outputs](Async::OutputSharedPtr){
+      ++outputs;
+      return true;
+    });
+    modules.back()->start(executor);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  for(size_t n = 0; n < kInputsPerModule; ++n){
+    for(Async::InputQueueSharedPtr &input_queue : input_queues){
+      input_queue->push(Async::makeInputPayload("block " + std::to_string(n)));
+    }
+  }
+  while(outputs < kNumModules * kInputsPerModule){
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  LOG(INFO) << kNumModules << " modules processed " << outputs << " inputs of 10ms each in " << seconds
+            << "s on " << executor.numThreads() << " threads";
+
+  for(std::unique_ptr<ExampleReadModule> &module : modules){
+    module->shutdownQueues();
+  }
+  for(std::unique_ptr<ExampleReadModule> &module : modules){
+    module->waitUntilStopped();
+  }
+  executor.stop();
+  return 0;
+}
@@ -0,0 +1,288 @@
+#include <glog/logging.h>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "benchmark_report.hpp"
+#include "concurrent_queue.hpp"
+#include "fused_pipeline.hpp"
+#include "pipeline_graph.hpp"
+#include "pipeline_module.hpp"
+#include "spsc_ring_queue.hpp"
+#include "traffic_recorder.hpp"
+
+// End-to-end throughput and latency through a chain of K SISO stages wired by a PipelineGraph.
+// The main thread pushes timestamped messages into the first stage and pops them from the output queue of the last.
+// The replay_chain rows feed the chain from a recorded traffic log instead, as fast as the chain takes them.
+// The fused_chain rows run the same K stages fused into one module, with one queue hop instead of K.
+// Usage: modular_pipeline_benchmark [--items N] [--csv FILE] [--json FILE]
+
+using concurrent_queue::BenchmarkOptions;
+using concurrent_queue::BenchmarkResult;
+
+static const size_t kQueueCapacity = 1024;
+
+struct Message {
+  uint64_t sent_ns;
+  uint64_t sequence;
+};
+
+template<typename T>
+using SpscQueue = concurrent_queue::SpscRingQueue<T, kQueueCapacity>;
+
+// ConcurrentQueue with the same capacity as the SPSC ring, so both chains apply the same back pressure
+template<typename T>
+class BoundedQueue : public concurrent_queue::ConcurrentQueue<T> {
+public:
+  BoundedQueue(): concurrent_queue::ConcurrentQueue<T>(kQueueCapacity) {}
+};
+
+template<template<typename> class QueueT>
+class ForwardStage : public modular_pipeline::SISOPipelineModule<Message, Message, QueueT> {
+public:
+  using SISO = modular_pipeline::SISOPipelineModule<Message, Message, QueueT>;
+
+  ForwardStage(typename SISO::InputQueueSharedPtr &input_queue, typename SISO::OutputQueueSharedPtr &output_queue,
+      const std::string &module_id)
+      : SISO(input_queue, output_queue, module_id, false) {}
+
+protected:
+  typename SISO::OutputSharedPtr spinOnce(typename SISO::InputUniquePtr input) override{
+    return std::make_shared<Message>(*input);
+  }
+};
+
+template<template<typename> class QueueT>
+BenchmarkResult runChain(const std::string &queue_name, size_t num_stages, uint64_t items){
+  using Stage = ForwardStage<QueueT>;
+  using SISO = typename Stage::SISO;
+
+  // only the last stage uses its output queue, the others send to the next stage
+  typename SISO::OutputQueueSharedPtr unused_output_queue;
+  typename SISO::OutputQueueSharedPtr output_queue =
+      concurrent_queue::makeSharedAligned<typename SISO::OutputQueue>(kQueueCapacity);
+  std::vector<typename SISO::InputQueueSharedPtr> input_queues;
+  std::vector<std::unique_ptr<Stage>> stages;
+  for(size_t i = 0; i < num_stages; ++i){
+    input_queues.push_back(modular_pipeline::PipelineGraph::makeInputQueue<SISO>());
+    stages.emplace_back(new Stage(input_queues.back(), i + 1 == num_stages ? output_queue : unused_output_queue,
+                                  "stage_" + std::to_string(i)));
+  }
+
+  modular_pipeline::PipelineGraph graph;
+  graph.addModule(*stages.front());
+  for(size_t i = 0; i + 1 < num_stages; ++i){
+    graph.connect(*stages[i], *stages[i + 1]);
+  }
+  graph.start();
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(items);
+  std::thread consumer([&]{
+    typename SISO::OutputSharedPtr output;
+    while(latencies.size() < items && output_queue->wait_and_pop(output)){
+      latencies.push_back(concurrent_queue::benchmarkNowNs() - output->sent_ns);
+    }
+  });
+
+  const uint64_t start = concurrent_queue::benchmarkNowNs();
+  for(uint64_t i = 0; i < items; ++i){
+    std::unique_ptr<Message> message(new Message());
+    message->sequence = i;
+    message->sent_ns = concurrent_queue::benchmarkNowNs();
+    input_queues.front()->push(std::move(message));
+  }
+  consumer.join();
+  const uint64_t end = concurrent_queue::benchmarkNowNs();
+  graph.drain(std::chrono::seconds(10));
+
+  BenchmarkResult result;
+  result.name = "siso_chain";
+  result.queue = queue_name;
+  result.producers = 1;
+  result.consumers = 1;
+  result.stages = num_stages;
+  result.payload_bytes = sizeof(Message);
+  result.items = latencies.size();
+  result.seconds = (end - start) / 1e9;
+  concurrent_queue::computePercentiles(latencies, result);
+  return result;
+}
+
+// the stage of ForwardStage as a FusedStages stage
+struct ForwardFn {
+  using Input = Message;
+  using Output = Message;
+  bool operator()(Message &&input, Message &output){
+    output = input;
+    return true;
+  }
+};
+
+// FusedStages of K ForwardFn
+template<size_t K, typename... Stages>
+struct ForwardChain : ForwardChain<K - 1, ForwardFn, Stages...> {};
+
+template<typename... Stages>
+struct ForwardChain<0, Stages...> {
+  using type = modular_pipeline::FusedStages<Stages...>;
+};
+
+template<size_t K>
+BenchmarkResult runFusedChain(const std::string &queue_name, uint64_t items){
+  using Stage = modular_pipeline::FusedPipelineModule<typename ForwardChain<K>::type, BoundedQueue>;
+
+  typename Stage::OutputQueueSharedPtr output_queue =
+      concurrent_queue::makeSharedAligned<typename Stage::OutputQueue>(kQueueCapacity);
+  typename Stage::InputQueueSharedPtr input_queue = modular_pipeline::PipelineGraph::makeInputQueue<Stage>();
+  Stage stage(input_queue, output_queue, "fused", false);
+  modular_pipeline::PipelineGraph graph;
+  graph.addModule(stage);
+  graph.start();
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(items);
+  std::thread consumer([&]{
+    typename Stage::OutputSharedPtr output;
+    while(latencies.size() < items && output_queue->wait_and_pop(output)){
+      latencies.push_back(concurrent_queue::benchmarkNowNs() - output->sent_ns);
+    }
+  });
+
+  const uint64_t start = concurrent_queue::benchmarkNowNs();
+  for(uint64_t i = 0; i < items; ++i){
+    typename Stage::InputUniquePtr message = Stage::makeInputPayload();
+    message->sequence = i;
+    message->sent_ns = concurrent_queue::benchmarkNowNs();
+    input_queue->push(std::move(message));
+  }
+  consumer.join();
+  const uint64_t end = concurrent_queue::benchmarkNowNs();
+  graph.drain(std::chrono::seconds(10));
+
+  BenchmarkResult result;
+  result.name = "fused_chain";
+  result.queue = queue_name;
+  result.producers = 1;
+  result.consumers = 1;
+  result.stages = K;
+  result.payload_bytes = sizeof(Message);
+  result.items = latencies.size();
+  result.seconds = (end - start) / 1e9;
+  concurrent_queue::computePercentiles(latencies, result);
+  return result;
+}
+
+// restamps the replayed messages, so the latency covers the chain and not the time since they were recorded
+class ReplayStage : public modular_pipeline::TrafficReplaySource<Message, Message> {
+public:
+  using Source = modular_pipeline::TrafficReplaySource<Message, Message>;
+
+  ReplayStage(const std::string &log_prefix, Source::OutputQueueSharedPtr &output_queue)
+      : Source(log_prefix, output_queue, "replay", false) {}
+
+protected:
+  Source::OutputSharedPtr spinOnce(Source::InputUniquePtr input) override{
+    Source::OutputSharedPtr output = std::make_shared<Message>(*input);
+    output->sent_ns = concurrent_queue::benchmarkNowNs();
+    return output;
+  }
+};
+
+bool recordMessages(const std::string &log_prefix, uint64_t items){
+  modular_pipeline::TrafficRecorder recorder(log_prefix, 64 << 20, items);
+  Message message = Message();
+  for(uint64_t i = 0; i < items; ++i){
+    message.sequence = i;
+    recorder.record(message);
+  }
+  recorder.close();
+  return recorder.numRecorded() == items;
+}
+
+void removeLog(const std::string &log_prefix){
+  for(size_t i = 0; std::remove(modular_pipeline::TrafficLog::segmentPath(log_prefix, i).c_str()) == 0; ++i) {}
+}
+
+template<template<typename> class QueueT>
+BenchmarkResult runReplayChain(const std::string &queue_name, const std::string &log_prefix, size_t num_stages,
+    uint64_t items){
+  using Stage = ForwardStage<QueueT>;
+  using SISO = typename Stage::SISO;
+
+  typename SISO::OutputQueueSharedPtr unused_output_queue;
+  typename SISO::OutputQueueSharedPtr output_queue =
+      concurrent_queue::makeSharedAligned<typename SISO::OutputQueue>(kQueueCapacity);
+  ReplayStage source(log_prefix, unused_output_queue);
+  std::vector<typename SISO::InputQueueSharedPtr> input_queues;
+  std::vector<std::unique_ptr<Stage>> stages;
+  for(size_t i = 0; i < num_stages; ++i){
+    input_queues.push_back(modular_pipeline::PipelineGraph::makeInputQueue<SISO>());
+    stages.emplace_back(new Stage(input_queues.back(), i + 1 == num_stages ? output_queue : unused_output_queue,
+                                  "stage_" + std::to_string(i)));
+  }
+
+  modular_pipeline::PipelineGraph graph;
+  graph.connect(source, *stages.front());
+  for(size_t i = 0; i + 1 < num_stages; ++i){
+    graph.connect(*stages[i], *stages[i + 1]);
+  }
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(items);
+  const uint64_t start = concurrent_queue::benchmarkNowNs();
+  graph.start();
+  typename SISO::OutputSharedPtr output;
+  while(latencies.size() < items && output_queue->wait_and_pop(output)){
+    latencies.push_back(concurrent_queue::benchmarkNowNs() - output->sent_ns);
+  }
+  const uint64_t end = concurrent_queue::benchmarkNowNs();
+  graph.drain(std::chrono::seconds(10));
+
+  BenchmarkResult result;
+  result.name = "replay_chain";
+  result.queue = queue_name;
+  result.producers = 1;
+  result.consumers = 1;
+  result.stages = num_stages;
+  result.payload_bytes = sizeof(Message);
+  result.items = latencies.size();
+  result.seconds = (end - start) / 1e9;
+  concurrent_queue::computePercentiles(latencies, result);
+  return result;
+}
+
+int main(int argc, char* argv[]){
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_minloglevel = google::GLOG_WARNING;
+  const BenchmarkOptions options = BenchmarkOptions::parse(argc, argv);
+  std::vector<BenchmarkResult> results;
+  for(size_t num_stages : {1, 2, 4, 8}){
+    results.push_back(runChain<BoundedQueue>("ConcurrentQueue/1024", num_stages, options.items));
+    concurrent_queue::printResult(results.back());
+    results.push_back(runChain<SpscQueue>("SpscRingQueue/1024", num_stages, options.items));
+    concurrent_queue::printResult(results.back());
+  }
+  results.push_back(runFusedChain<1>("ConcurrentQueue/1024", options.items));
+  concurrent_queue::printResult(results.back());
+  results.push_back(runFusedChain<2>("ConcurrentQueue/1024", options.items));
+  concurrent_queue::printResult(results.back());
+  results.push_back(runFusedChain<4>("ConcurrentQueue/1024", options.items));
+  concurrent_queue::printResult(results.back());
+  results.push_back(runFusedChain<8>("ConcurrentQueue/1024", options.items));
+  concurrent_queue::printResult(results.back());
+  const std::string log_prefix = "/tmp/modular_pipeline_benchmark_" + std::to_string(getpid());
+  if(recordMessages(log_prefix, options.items)){
+    for(size_t num_stages : {1, 4}){
+      results.push_back(runReplayChain<BoundedQueue>("ConcurrentQueue/1024", log_prefix, num_stages, options.items));
+      concurrent_queue::printResult(results.back());
+    }
+  } else {
+    LOG(ERROR) << "can't record the replay_chain traffic log to " << log_prefix;
+  }
+  removeLog(log_prefix);
+  return concurrent_queue::writeResults(options, results) ? 0 : 1;
+}
@@ -0,0 +1,500 @@
+#ifndef MODULAR_PIPELINE_ASYNC_PIPELINE_MODULE_HPP
+#define MODULAR_PIPELINE_ASYNC_PIPELINE_MODULE_HPP
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <glog/logging.h>
+#include "awaitable_queue.hpp"
+#include "concurrent_queue.hpp"
+#include "payload_pool.hpp"
+
+namespace modular_pipeline {
+
+template <typename T = void>
+class Task;
+
+/**
+ * State shared by the promises of every Task: the awaiting coroutine, the scheduler that resumes the task after
+ * it is suspended and the exception it finished with
+ */
+class TaskPromiseBase {
+public:
+  TaskPromiseBase(): scheduler(nullptr), continuation(), exception() {}
+
+  /**
+   * Resume the awaiting coroutine on this thread once the task is done
+   */
+  struct FinalAwaiter {
+    bool await_ready() noexcept {
+      return false;
+    }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept {
+    return {};
+  }
+  FinalAwaiter final_suspend() noexcept {
+    return {};
+  }
+  void unhandled_exception(){
+    exception = std::current_exception();
+  }
+
+  concurrent_queue::CoroutineScheduler *scheduler;
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+};
+
+template <typename T>
+class TaskPromise : public TaskPromiseBase {
+public:
+  Task<T> get_return_object();
+  template <typename U>
+  void return_value(U &&value){
+    value_.emplace(std::forward<U>(value));
+  }
+  T result(){
+    if(exception) std::rethrow_exception(exception);
+    return std::move(*value_);
+  }
+
+private:
+  std::optional<T> value_;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+  Task<void> get_return_object();
+  void return_void() {}
+  void result(){
+    if(exception) std::rethrow_exception(exception);
+  }
+};
+
+/**
+ * Lazy coroutine that produces a T. It starts when it is awaited and runs on the scheduler of the awaiting
+ * coroutine, which it resumes when it is done. Exceptions are rethrown to the awaiting coroutine.
+ */
+template <typename T>
+class Task {
+public:
+  using promise_type = TaskPromise<T>;
+
+  Task(): handle_() {}
+  explicit Task(std::coroutine_handle<promise_type> handle): handle_(handle) {}
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task& operator=(Task &&other) noexcept {
+    if(this != &other){
+      if(handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  void operator=(const Task&) = delete;
+  ~Task(){
+    if(handle_) handle_.destroy();
+  }
+
+  bool await_ready() const noexcept {
+    return !handle_ || handle_.done();
+  }
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting) noexcept {
+    handle_.promise().continuation = awaiting;
+    handle_.promise().scheduler = concurrent_queue::schedulerOf(awaiting);
+    return handle_;
+  }
+  T await_resume(){
+    return handle_.promise().result();
+  }
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object(){
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object(){
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+class PipelineExecutor;
+
+/**
+ * Fire-and-forget coroutine started by PipelineExecutor::spawn(). It destroys itself when it is done.
+ */
+class DetachedTask {
+public:
+  class promise_type {
+  public:
+    template <typename... Args>
+    promise_type(PipelineExecutor &executor, Args&&...);
+
+    DetachedTask get_return_object(){
+      return DetachedTask();
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception(){
+      try {
+        throw;
+      } catch(const std::exception &e) {
+        LOG(ERROR) << "Detached task: unhandled exception: " << e.what();
+      } catch(...) {
+        LOG(ERROR) << "Detached task: unhandled exception";
+      }
+    }
+
+    concurrent_queue::CoroutineScheduler *scheduler;
+  };
+};
+
+/**
+ * Small thread pool that runs coroutines. Thousands of suspended async modules cost no thread, only the resumed
+ * ones occupy one of the `num_threads` workers.
+ * A timer thread resumes the coroutines suspended by sleepFor().
+ * Modules must be stopped before the executor is destroyed, coroutines still suspended in it are leaked.
+ */
+class PipelineExecutor : public concurrent_queue::CoroutineScheduler {
+public:
+  /**
+   * Make the current coroutine continue on a worker of the executor
+   */
+  struct ScheduleAwaiter {
+    bool await_ready() noexcept {
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle){
+      executor.schedule(handle);
+    }
+    void await_resume() noexcept {}
+    PipelineExecutor &executor;
+  };
+
+  /**
+   * Suspend the current coroutine without blocking its thread until `deadline`
+   */
+  struct SleepAwaiter {
+    bool await_ready() noexcept {
+      return std::chrono::steady_clock::now() >= deadline;
+    }
+    void await_suspend(std::coroutine_handle<> handle){
+      executor.scheduleAt(deadline, handle);
+    }
+    void await_resume() noexcept {}
+    PipelineExecutor &executor;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  explicit PipelineExecutor(size_t num_threads = std::thread::hardware_concurrency())
+  : ready_(), workers_(), timer_mutex_(), timer_cond_(), timers_(), timer_thread_(), stopped_(false) {
+    if(num_threads == 0) num_threads = 1;
+    for(size_t i = 0; i < num_threads; ++i){
+      workers_.emplace_back(&PipelineExecutor::runWorker, this);
+    }
+    timer_thread_ = std::thread(&PipelineExecutor::runTimers, this);
+  }
+  ~PipelineExecutor(){
+    stop();
+  }
+  PipelineExecutor(const PipelineExecutor&) = delete;
+  void operator=(const PipelineExecutor&) = delete;
+
+  void schedule(std::coroutine_handle<> handle) override {
+    if(!ready_.push(handle)){
+      LOG(WARNING) << "PipelineExecutor: schedule after stop(), the coroutine is leaked";
+    }
+  }
+
+  /**
+   * Resume `handle` on a worker once `deadline` has passed
+   */
+  void scheduleAt(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> handle){
+    std::lock_guard<std::mutex> lk(timer_mutex_);
+    const bool earliest = timers_.empty() || deadline < timers_.begin()->first;
+    timers_.emplace(deadline, handle);
+    if(earliest) timer_cond_.notify_one();
+  }
+
+  /**
+   * co_await executor.yield() lets the other ready coroutines run first
+   */
+  ScheduleAwaiter yield(){
+    return ScheduleAwaiter{*this};
+  }
+
+  /**
+   * co_await executor.sleepFor(duration) suspends the coroutine, e.g. to stand in for an I/O wait
+   */
+  template <typename Rep, typename Period>
+  SleepAwaiter sleepFor(const std::chrono::duration<Rep, Period> &duration){
+    return SleepAwaiter{*this, std::chrono::steady_clock::now()
+                               + std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration)};
+  }
+
+  /**
+   * Run `task` on the executor without waiting for it
+   */
+  void spawn(Task<void> task){
+    runDetached(*this, std::move(task));
+  }
+
+  /**
+   * Stop the workers and the timer thread. Coroutines that are still ready or sleeping are not resumed.
+   */
+  void stop(){
+    {
+      std::lock_guard<std::mutex> lk(timer_mutex_);
+      if(stopped_) return;
+      stopped_ = true;
+    }
+    timer_cond_.notify_all();
+    ready_.shutdown();
+    for(std::thread &worker : workers_){
+      worker.join();
+    }
+    timer_thread_.join();
+  }
+
+  size_t numThreads() const{
+    return workers_.size();
+  }
+
+private:
+  static DetachedTask runDetached(PipelineExecutor &executor, Task<void> task){
+    co_await executor.yield();
+    co_await std::move(task);
+  }
+
+  void runWorker(){
+    std::coroutine_handle<> handle;
+    while(ready_.wait_and_pop(handle)){
+      handle.resume();
+    }
+  }
+
+  void runTimers(){
+    std::unique_lock<std::mutex> lk(timer_mutex_);
+    while(!stopped_){
+      if(timers_.empty()){
+        timer_cond_.wait(lk);
+        continue;
+      }
+      const std::chrono::steady_clock::time_point deadline = timers_.begin()->first;
+      if(std::chrono::steady_clock::now() < deadline){
+        timer_cond_.wait_until(lk, deadline);
+        continue;
+      }
+      std::coroutine_handle<> handle = timers_.begin()->second;
+      timers_.erase(timers_.begin());
+      schedule(handle);
+    }
+  }
+
+  concurrent_queue::ConcurrentQueue<std::coroutine_handle<>> ready_;
+  std::vector<std::thread> workers_;
+  std::mutex timer_mutex_;
+  std::condition_variable timer_cond_;
+  std::multimap<std::chrono::steady_clock::time_point, std::coroutine_handle<>> timers_;
+  std::thread timer_thread_;
+  bool stopped_;
+};
+
+template <typename... Args>
+DetachedTask::promise_type::promise_type(PipelineExecutor &executor, Args&&...): scheduler(&executor) {}
+
+/**
+ * Pipeline module whose spinOnce() is a coroutine, for stages that mostly wait, e.g. on disk or network I/O.
+ * It pops inputs with `co_await input_queue->pop()`, so a module waiting for input or for I/O holds no thread.
+ * Modules run on a PipelineExecutor shared with many other modules. `concurrency` run loops of the same module can
+ * have inputs in flight at once, so outputs may leave out of order when it is above 1.
+ * Outputs go to the output queue, or to the output sink if one is set, e.g. to feed the next async module:
+ *   reader.setOutputSink([&](OutputSharedPtr output){
+ *     return parser_input_queue->push(PayloadPool<Parsed>::makeUnique(*output));
+ *   });
+ * Call shutdownQueues() and waitUntilStopped() before the module or its executor is destroyed.
+ */
+template <typename Input, typename Output>
+class AsyncPipelineModule {
+public:
+  using InputType = Input;
+  using OutputType = Output;
+  using InputUniquePtr = std::unique_ptr<Input, PayloadDeleter<Input>>;
+  using OutputSharedPtr = std::shared_ptr<Output>;
+  using InputQueue = concurrent_queue::AwaitableQueue<InputUniquePtr>;
+  using InputQueueSharedPtr = std::shared_ptr<InputQueue>;
+  using OutputQueue = concurrent_queue::AwaitableQueue<OutputSharedPtr>;
+  using OutputQueueSharedPtr = std::shared_ptr<OutputQueue>;
+
+  AsyncPipelineModule(InputQueueSharedPtr &input_queue, OutputQueueSharedPtr &output_queue,
+                      const std::string &module_id, size_t concurrency = 1)
+  : input_queue_(input_queue), output_queue_(output_queue), output_sink_(), module_id_(module_id),
+    concurrency_(concurrency == 0 ? 1 : concurrency), executor_(nullptr), stop_mutex_(), stop_cond_(),
+    running_loops_(0), processed_inputs_(0), failed_inputs_(0) {
+    CHECK(input_queue_) << logPrefix() << "input queue is null";
+  }
+  virtual ~AsyncPipelineModule(){
+    LOG(INFO) << logPrefix() << "destructor called!";
+  }
+  AsyncPipelineModule(const AsyncPipelineModule&) = delete;
+  void operator=(const AsyncPipelineModule&) = delete;
+
+  /**
+   * Start `concurrency` run loops on `executor`. They run until the input queue is shutdown.
+   */
+  void start(PipelineExecutor &executor){
+    CHECK(!isRunning()) << logPrefix() << "already started";
+    executor_ = &executor;
+    running_loops_ = concurrency_;
+    for(size_t i = 0; i < concurrency_; ++i){
+      executor.spawn(runLoop());
+    }
+  }
+
+  /**
+   * Send outputs to `sink` instead of the output queue. Must be called before start().
+   */
+  void setOutputSink(std::function<bool(OutputSharedPtr)> sink){
+    output_sink_ = std::move(sink);
+  }
+
+  /**
+   * Shutdown the input and output queues. The run loops finish their current input, then stop.
+   */
+  void shutdownQueues(){
+    LOG(INFO) << logPrefix() << "shutdownQueues called!";
+    input_queue_->shutdown();
+    if(output_queue_) output_queue_->shutdown();
+  }
+
+  void restartQueues(){
+    input_queue_->restart();
+    if(output_queue_) output_queue_->restart();
+  }
+
+  /**
+   * Block the calling thread until every run loop has stopped. Must not be called from a coroutine of the executor.
+   */
+  void waitUntilStopped(){
+    std::unique_lock<std::mutex> lk(stop_mutex_);
+    stop_cond_.wait(lk, [this]{return running_loops_ == 0;});
+  }
+
+  bool isRunning() const{
+    return running_loops_ != 0;
+  }
+
+  uint64_t numProcessedInputs() const{
+    return processed_inputs_;
+  }
+
+  uint64_t numFailedInputs() const{
+    return failed_inputs_;
+  }
+
+  const InputQueueSharedPtr& inputQueue() const{
+    return input_queue_;
+  }
+
+  const OutputQueueSharedPtr& outputQueue() const{
+    return output_queue_;
+  }
+
+  virtual inline std::string logPrefix(){
+    return "Module [" + module_id_  + "]: ";
+  }
+
+  template <typename... Args>
+  static InputUniquePtr makeInputPayload(Args&&... args){
+    return PayloadPool<Input>::makeUnique(std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  static OutputSharedPtr makeOutputPayload(Args&&... args){
+    return PayloadPool<Output>::makeShared(std::forward<Args>(args)...);
+  }
+
+protected:
+  /**
+   * Compute the output of `input`. It may co_await I/O, executor().sleepFor() or other tasks.
+   * A null output is dropped. An exception counts the input as failed.
+   */
+  virtual Task<OutputSharedPtr> spinOnce(InputUniquePtr input) = 0;
+
+  /**
+   * The executor the module runs on, valid after start()
+   */
+  PipelineExecutor& executor(){
+    return *executor_;
+  }
+
+private:
+  Task<void> runLoop(){
+    while(true){
+      std::optional<InputUniquePtr> input = co_await input_queue_->pop();
+      if(!input) break;
+      OutputSharedPtr output;
+      try {
+        output = co_await spinOnce(std::move(*input));
+      } catch(const std::exception &e) {
+        ++failed_inputs_;
+        LOG(WARNING) << logPrefix() << "spinOnce failed: " << e.what();
+      } catch(...) {
+        ++failed_inputs_;
+        LOG(WARNING) << logPrefix() << "spinOnce failed";
+      }
+      if(output && !sendOutputPayload(std::move(output))){
+        LOG(WARNING) << logPrefix() << "send output failed!";
+      }
+      ++processed_inputs_;
+    }
+    std::lock_guard<std::mutex> lk(stop_mutex_);
+    if(--running_loops_ == 0) stop_cond_.notify_all();
+  }
+
+  bool sendOutputPayload(OutputSharedPtr output){
+    if(output_sink_) return output_sink_(std::move(output));
+    return output_queue_ && output_queue_->push(std::move(output));
+  }
+
+  InputQueueSharedPtr input_queue_;
+  OutputQueueSharedPtr output_queue_;
+  std::function<bool(OutputSharedPtr)> output_sink_;
+  std::string module_id_;
+  const size_t concurrency_;
+  PipelineExecutor *executor_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cond_;
+  std::atomic<size_t> running_loops_;
+  std::atomic<uint64_t> processed_inputs_;
+  std::atomic<uint64_t> failed_inputs_;
+};
+}
+#endif //MODULAR_PIPELINE_ASYNC_PIPELINE_MODULE_HPP
@@ -0,0 +1,225 @@
+#ifndef MODULAR_PIPELINE_FUSED_PIPELINE_HPP
+#define MODULAR_PIPELINE_FUSED_PIPELINE_HPP
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "concurrent_queue.hpp"
+#include "pipeline_module.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * Fails to compile with a readable message unless the Output of every stage is the Input of the next one
+ */
+template <typename... Stages>
+struct CheckStageChain {};
+
+template <typename First, typename Second, typename... Rest>
+struct CheckStageChain<First, Second, Rest...> : CheckStageChain<Second, Rest...> {
+  static_assert(std::is_same<typename First::Output, typename Second::Input>::value,
+                "FusedStages: the Output of every stage must be the Input of the next stage");
+};
+
+/**
+ * Stage made of a function `bool fn(In &&input, Out &output)`, see makeStage()
+ */
+template <typename In, typename Out, typename Fn>
+class FunctionStage {
+public:
+  using Input = In;
+  using Output = Out;
+
+  explicit FunctionStage(Fn fn): fn_(std::move(fn)) {}
+
+  bool operator()(Input &&input, Output &output){
+    return fn_(std::move(input), output);
+  }
+
+private:
+  Fn fn_;
+};
+
+/**
+ * Make a stage from a function or lambda `bool(In &&input, Out &output)`:
+ *   auto scale = makeStage<Frame, Frame>([](Frame &&in, Frame &out){ out = std::move(in); out.scale(2); return true; });
+ */
+template <typename In, typename Out, typename Fn>
+FunctionStage<In, Out, Fn> makeStage(Fn fn){
+  return FunctionStage<In, Out, Fn>(std::move(fn));
+}
+
+/**
+ * Stage that runs the spinOnce() of an existing SISO or SIMO module, so a stage written as a module can be fused
+ * without rewriting it:
+ *   auto decode = makeModuleStage(std::make_shared<Decoder>(unused_queue, unused_output_queue, "decode", true));
+ * The module is only used for its spinOnce(), its queues and threads stay idle. Every call still pays what the
+ * signature of spinOnce() costs: a pooled input payload, a virtual call, an output payload and a move of the output.
+ * Only the queue hop and the thread switch are saved, so stages written as functors are faster.
+ */
+template <typename Module>
+class ModuleStage {
+public:
+  using Input = typename Module::InputType;
+  using Output = typename Module::OutputType;
+
+  explicit ModuleStage(std::shared_ptr<Module> module): module_(std::move(module)) {
+    CHECK_NOTNULL(module_.get());
+  }
+
+  bool operator()(Input &&input, Output &output){
+    typename Module::InputUniquePtr payload = Module::makeInputPayload(std::move(input));
+    typename Module::OutputSharedPtr result = (module_.get()->*spinOnceOf())(std::move(payload));
+    if(!result) return false;
+    output = std::move(*result);
+    return true;
+  }
+
+  Module& module(){
+    return *module_;
+  }
+
+private:
+  // spinOnce() is protected, a derived class can name it for us
+  struct Access : Module {
+    using Module::spinOnce;
+  };
+
+  static typename Module::OutputSharedPtr (Module::*spinOnceOf())(typename Module::InputUniquePtr){
+    return &Access::spinOnce;
+  }
+
+  std::shared_ptr<Module> module_;
+};
+
+/**
+ * Make a stage from a module, see ModuleStage
+ */
+template <typename Module>
+ModuleStage<Module> makeModuleStage(std::shared_ptr<Module> module){
+  return ModuleStage<Module>(std::move(module));
+}
+
+/**
+ * Runs several stages back to back as one function call, without a queue, a thread hop or a virtual call between
+ * them. A stage is any class with `Input` and `Output` types and a non-virtual
+ *   bool operator()(Input &&input, Output &output);
+ * that writes its output and returns False to drop the input, like a spinOnce() returning nullptr. The chain is
+ * checked at compile time and the calls are inlined by the compiler. Intermediate payloads live on the stack, so
+ * they must be default constructible.
+ */
+template <typename... Stages>
+class FusedStages {
+  static_assert(sizeof...(Stages) > 0, "FusedStages: needs at least one stage");
+  static const size_t kNumStages = sizeof...(Stages);
+  using StageTuple = std::tuple<Stages...>;
+  template <size_t I>
+  using StageAt = typename std::tuple_element<I, StageTuple>::type;
+  static_assert(sizeof(CheckStageChain<Stages...>) > 0, "FusedStages: the stages are not a chain");
+
+public:
+  using Input = typename StageAt<0>::Input;
+  using Output = typename StageAt<kNumStages - 1>::Output;
+
+  FusedStages(): stages_() {}
+  explicit FusedStages(Stages... stages): stages_(std::move(stages)...) {}
+
+  /**
+   * Run all stages on `input`. Return False if a stage dropped it, then `output` is unspecified.
+   */
+  bool operator()(Input &&input, Output &output){
+    return run<0>(std::move(input), output, std::integral_constant<bool, kNumStages == 1>());
+  }
+
+  template <size_t I>
+  StageAt<I>& stage(){
+    return std::get<I>(stages_);
+  }
+
+  static constexpr size_t numStages(){
+    return sizeof...(Stages);
+  }
+
+private:
+  // the last stage writes the output of the chain
+  template <size_t I>
+  bool run(typename StageAt<I>::Input &&input, Output &output, std::true_type){
+    return std::get<I>(stages_)(std::move(input), output);
+  }
+
+  template <size_t I>
+  bool run(typename StageAt<I>::Input &&input, Output &output, std::false_type){
+    typename StageAt<I>::Output intermediate;
+    return std::get<I>(stages_)(std::move(input), intermediate)
+           && run<I + 1>(std::move(intermediate), output, std::integral_constant<bool, I + 2 == kNumStages>());
+  }
+
+  StageTuple stages_;
+};
+
+/**
+ * Make a FusedStages from stage objects, e.g. lambdas wrapped by makeStage()
+ */
+template <typename... Stages>
+FusedStages<Stages...> fuseStages(Stages... stages){
+  return FusedStages<Stages...>(std::move(stages)...);
+}
+
+/**
+ * SISO pipeline module that runs a FusedStages chain, so a chain of cheap SISO stages costs one queue hop instead of
+ * one per stage. Its input is the Input of the first stage and its output the Output of the last one:
+ *   using Preprocess = FusedStages<Decode, Resize, Normalize>;
+ *   FusedPipelineModule<Preprocess> preprocess(input_queue, output_queue, "preprocess", false);
+ * A module is still the unit of threads, batching and metrics, so the per-stage metrics become one for the chain.
+ */
+template <typename Chain,
+    template<typename> class InputQueueT = concurrent_queue::ConcurrentQueue,
+    template<typename> class OutputQueueT = concurrent_queue::ConcurrentQueue>
+class FusedPipelineModule
+    : public SISOPipelineModule<typename Chain::Input, typename Chain::Output, InputQueueT, OutputQueueT> {
+public:
+  using SISO = SISOPipelineModule<typename Chain::Input, typename Chain::Output, InputQueueT, OutputQueueT>;
+  using PIO = typename SISO::PIO;
+  using MISO = typename SISO::MISO;
+
+  static_assert(std::is_default_constructible<typename Chain::Output>::value,
+                "FusedPipelineModule: the Output of the last stage must be default constructible");
+
+  FusedPipelineModule(typename SISO::InputQueueSharedPtr &input_queue,
+      typename MISO::OutputQueueSharedPtr &output_queue, const std::string &module_id, const bool &sequential_mode,
+      Chain chain = Chain())
+      : SISO(input_queue, output_queue, module_id, sequential_mode), chain_(std::move(chain)) {}
+
+  /**
+   * Return the chain, e.g. to configure a stage with chain().template stage<1>()
+   */
+  Chain& chain(){
+    return chain_;
+  }
+
+protected:
+  typename PIO::OutputSharedPtr spinOnce(typename PIO::InputUniquePtr input) override {
+    typename PIO::OutputSharedPtr output = PIO::makeOutputPayload();
+    return chain_(std::move(*input), *output) ? output : nullptr;
+  }
+
+  /**
+   * Same as spinOnce() for every input, without a virtual call per input
+   */
+  void spinBatch(std::vector<typename PIO::InputUniquePtr> &inputs,
+      std::vector<typename PIO::OutputSharedPtr> &outputs) override {
+    for(typename PIO::InputUniquePtr &input : inputs){
+      typename PIO::OutputSharedPtr output = PIO::makeOutputPayload();
+      if(chain_(std::move(*input), *output)){
+        outputs.push_back(std::move(output));
+      }
+    }
+  }
+
+private:
+  Chain chain_;
+};
+}
+#endif //MODULAR_PIPELINE_FUSED_PIPELINE_HPP
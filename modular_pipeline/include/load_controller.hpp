@@ -0,0 +1,440 @@
+#ifndef MODULAR_PIPELINE_LOAD_CONTROLLER_HPP
+#define MODULAR_PIPELINE_LOAD_CONTROLLER_HPP
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+#include "module_metrics.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * What a stage does with its inputs once its latency SLO is at risk
+ */
+enum class SheddingPolicy {
+  // never shed, only adapt the batch size
+  None,
+  // keep a fraction of the inputs, evenly spread
+  Sample,
+  // shed the lowest priority classes first. Priority 0 is the highest and is never shed.
+  DropLowestPriority,
+  // keep the stage intact and reject new traffic at the ingress of the pipeline, see LoadController::ingressShedder()
+  RejectAtIngress
+};
+
+inline const char* toString(SheddingPolicy policy){
+  switch(policy){
+    case SheddingPolicy::Sample: return "sample";
+    case SheddingPolicy::DropLowestPriority: return "drop_lowest_priority";
+    case SheddingPolicy::RejectAtIngress: return "reject_at_ingress";
+    default: return "none";
+  }
+}
+
+/**
+ * Admission gate with a shedding level from 0 (admit everything) to 1 (shed everything it may shed).
+ * admit() is lock-free and may be called from many threads while the level is changed.
+ */
+class LoadShedder {
+public:
+  explicit LoadShedder(SheddingPolicy policy = SheddingPolicy::Sample, size_t num_priorities = 1)
+  : policy_(policy), num_priorities_(std::max<size_t>(num_priorities, 1)), level_permille_(0), sequence_(0),
+    admitted_(0), shed_(0) {}
+  LoadShedder(const LoadShedder&) = delete;
+  void operator=(const LoadShedder&) = delete;
+
+  /**
+   * Return True if an input of `priority` is admitted at the current level, False if it has to be shed
+   */
+  bool admit(size_t priority = 0){
+    const uint64_t level = level_permille_.load(std::memory_order_relaxed);
+    bool admitted = true;
+    if(level > 0){
+      if(policy_ == SheddingPolicy::DropLowestPriority){
+        admitted = priority < priorityCutoff(level);
+      } else {
+        // keep (1000 - level) of every 1000 inputs
+        const uint64_t keep = 1000 - level;
+        const uint64_t n = sequence_.fetch_add(1, std::memory_order_relaxed);
+        admitted = (n + 1) * keep / 1000 != n * keep / 1000;
+      }
+    }
+    (admitted ? admitted_ : shed_).fetch_add(1, std::memory_order_relaxed);
+    return admitted;
+  }
+
+  void setLevel(double level){
+    level = std::min(std::max(level, 0.0), 1.0);
+    level_permille_.store(static_cast<uint64_t>(level * 1000 + 0.5), std::memory_order_relaxed);
+  }
+
+  double level() const{
+    return level_permille_.load(std::memory_order_relaxed) / 1000.0;
+  }
+
+  SheddingPolicy policy() const{
+    return policy_;
+  }
+
+  uint64_t numAdmitted() const{
+    return admitted_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t numShed() const{
+    return shed_.load(std::memory_order_relaxed);
+  }
+
+private:
+  // priorities from the returned one on are shed
+  size_t priorityCutoff(uint64_t level) const{
+    const size_t num_shed = static_cast<size_t>((level * num_priorities_ + 500) / 1000);
+    return num_shed >= num_priorities_ ? 1 : num_priorities_ - num_shed;
+  }
+
+  const SheddingPolicy policy_;
+  const size_t num_priorities_;
+  std::atomic<uint64_t> level_permille_;
+  std::atomic<uint64_t> sequence_;
+  std::atomic<uint64_t> admitted_;
+  std::atomic<uint64_t> shed_;
+};
+
+/**
+ * How the LoadController drives one stage
+ */
+struct StageLoadConfig {
+  StageLoadConfig(): latency_slo(std::chrono::milliseconds(100)), min_batch_size(1), max_batch_size(0),
+                     policy(SheddingPolicy::None), num_priorities(1), shed_threshold(1.0), shed_step(0.1),
+                     max_shed_level(0.9) {}
+
+  // target time an input spends queued and processed in the stage
+  std::chrono::microseconds latency_slo;
+  // the batch limit stays in [min_batch_size, max_batch_size]. 0 is the max_batch_size of setBatching().
+  size_t min_batch_size;
+  size_t max_batch_size;
+  SheddingPolicy policy;
+  // number of priority classes of DropLowestPriority
+  size_t num_priorities;
+  // shedding rises while the estimated latency is above shed_threshold * latency_slo
+  // and falls while it is below half of it
+  double shed_threshold;
+  // change of the shedding level per tick
+  double shed_step;
+  // the shedding level never goes above it, so a Sample stage keeps at least 1 - max_shed_level of its inputs
+  double max_shed_level;
+};
+
+/**
+ * Decisions of the LoadController for one stage at one point in time
+ */
+struct StageLoadSnapshot {
+  StageLoadSnapshot(): module_id(), policy(SheddingPolicy::None), batch_limit(0), max_batch_size(0), queue_depth(0),
+                       service_ns(0), estimated_latency_ns(0), pressure(0), shed_level(0), admitted(0), shed(0),
+                       batch_increases(0), batch_decreases(0), shed_increases(0), shed_decreases(0) {}
+
+  std::string toText() const{
+    std::ostringstream out;
+    out << "[" << module_id << "] batch=" << batch_limit << "/" << max_batch_size << " queue=" << queue_depth
+        << " service=" << service_ns << "ns latency=" << estimated_latency_ns << "ns pressure=" << pressure
+        << " " << toString(policy) << "=" << shed_level << " admitted=" << admitted << " shed=" << shed
+        << " batch_up=" << batch_increases << " batch_down=" << batch_decreases
+        << " shed_up=" << shed_increases << " shed_down=" << shed_decreases;
+    return out.str();
+  }
+
+  std::string toJson() const{
+    std::ostringstream out;
+    out << "{\"module\":\"" << jsonEscape(module_id) << "\",\"policy\":\"" << toString(policy) << "\",\"batch_limit\":"
+        << batch_limit << ",\"max_batch_size\":" << max_batch_size << ",\"queue_depth\":" << queue_depth
+        << ",\"service_ns\":" << service_ns << ",\"estimated_latency_ns\":" << estimated_latency_ns
+        << ",\"pressure\":" << pressure << ",\"shed_level\":" << shed_level << ",\"admitted\":" << admitted
+        << ",\"shed\":" << shed << ",\"batch_increases\":" << batch_increases
+        << ",\"batch_decreases\":" << batch_decreases << ",\"shed_increases\":" << shed_increases
+        << ",\"shed_decreases\":" << shed_decreases << "}";
+    return out.str();
+  }
+
+  std::string module_id;
+  SheddingPolicy policy;
+  size_t batch_limit;
+  size_t max_batch_size;
+  uint64_t queue_depth;
+  // mean time spinOnce() spends on one input, smoothed over the ticks
+  uint64_t service_ns;
+  // time a new input would wait in the queue and be processed
+  uint64_t estimated_latency_ns;
+  // estimated latency / latency SLO
+  double pressure;
+  double shed_level;
+  uint64_t admitted;
+  uint64_t shed;
+  uint64_t batch_increases;
+  uint64_t batch_decreases;
+  uint64_t shed_increases;
+  uint64_t shed_decreases;
+};
+
+/**
+ * Watches the input queue depth and the service time of pipeline modules and adapts them at runtime, so an
+ * overloaded pipeline degrades gracefully instead of queueing without limit:
+ * - the batch limit of a stage doubles while its backlog is more than twice the batch limit and halves while the
+ *   backlog is below half of it, so batches are large when catching up and small when idle.
+ * - when the estimated latency of a stage, backlog * service time / workers, is above its SLO, the stage sheds by
+ *   its SheddingPolicy, one step per tick, and recovers one step per tick when the latency is back under half of it.
+ * The service time comes from the spin histogram of ModuleMetrics, so timing must stay enabled.
+ *   modular_pipeline::LoadController controller;
+ *   modular_pipeline::StageLoadConfig config;
+ *   config.latency_slo = std::chrono::milliseconds(20);
+ *   config.policy = modular_pipeline::SheddingPolicy::Sample;
+ *   controller.addStage(decoder, config);
+ *   controller.start(std::chrono::milliseconds(100));
+ */
+class LoadController {
+public:
+  using Format = MetricsReporter::Format;
+  using Sink = MetricsReporter::Sink;
+  // returns the priority class of an input of `Module`, 0 is the highest
+  template <typename Module>
+  using PriorityFn = std::function<size_t(const typename Module::InputType &input)>;
+
+  /**
+   * `ingress_priorities` is the number of priority classes the ingress shedder drops from the lowest, 1 to sample
+   */
+  explicit LoadController(size_t ingress_priorities = 1)
+  : stages_(), ingress_(std::make_shared<LoadShedder>(ingress_priorities > 1 ? SheddingPolicy::DropLowestPriority
+                                                                               : SheddingPolicy::Sample,
+                                                      ingress_priorities)),
+    running_(false), mutex_(), run_mutex_(), cond_(), thread_() {}
+  ~LoadController(){
+    stop();
+  }
+  LoadController(const LoadController&) = delete;
+  void operator=(const LoadController&) = delete;
+
+  /**
+   * Control `module`, a PipelineModule. `priority_fn` returns the priority class of an input for
+   * DropLowestPriority. Sample and DropLowestPriority add a shedder to the input filters of the module, next to the
+   * filters it already has, so this must be called before the module spins. The module must outlive the controller.
+   */
+  template <typename Module>
+  void addStage(Module &module, const StageLoadConfig &config = StageLoadConfig(),
+                const PriorityFn<Module> &priority_fn = PriorityFn<Module>()){
+    CHECK(!running_) << "LoadController: addStage() must be called before start()";
+    CHECK(config.latency_slo.count() > 0)
+        << "LoadController: " << module.moduleId() << ": latency_slo must be positive";
+    CHECK(config.policy != SheddingPolicy::DropLowestPriority || priority_fn)
+        << "LoadController: " << module.moduleId() << ": DropLowestPriority needs a priority function";
+    std::unique_ptr<Stage> stage(new Stage());
+    stage->config = config;
+    stage->max_batch_size = config.max_batch_size == 0 ? module.maxBatchSize()
+                                                       : std::min(config.max_batch_size, module.maxBatchSize());
+    stage->min_batch_size = std::max<size_t>(1, std::min(config.min_batch_size, stage->max_batch_size));
+    stage->shedder = std::make_shared<LoadShedder>(config.policy, config.num_priorities);
+    Module *m = &module;
+    stage->snapshot = [m]{ return m->metricsSnapshot(); };
+    stage->num_workers = [m]{ return m->numWorkers(); };
+    stage->batch_limit = [m]{ return m->batchLimit(); };
+    stage->set_batch_limit = [m](size_t batch_limit){ m->setBatchLimit(batch_limit); };
+    if(config.policy == SheddingPolicy::Sample || config.policy == SheddingPolicy::DropLowestPriority){
+      std::shared_ptr<LoadShedder> shedder = stage->shedder;
+      module.addInputFilter([shedder, priority_fn](const typename Module::InputType &input){
+        return shedder->admit(priority_fn ? priority_fn(input) : 0);
+      });
+    }
+    module.setBatchLimit(stage->min_batch_size);
+    stage->previous = module.metricsSnapshot();
+    std::lock_guard<std::mutex> lk(mutex_);
+    stages_.push_back(std::move(stage));
+  }
+
+  /**
+   * Shed at the ingress of the pipeline for the stages with RejectAtIngress: its level is the highest shedding level
+   * of those stages. The source checks it before it creates work, so rejected traffic costs nothing downstream:
+   *   if(controller.ingressShedder().admit(request.priority)) input_queue->push(std::move(payload));
+   */
+  LoadShedder& ingressShedder(){
+    return *ingress_;
+  }
+
+  /**
+   * Install the ingress shedder as an input filter of `module`, the first module of the pipeline. It is combined
+   * with the filters the module already has, e.g. the shedder of its own stage. Must be called before the module spins.
+   */
+  template <typename Module>
+  void setIngressModule(Module &module, const PriorityFn<Module> &priority_fn = PriorityFn<Module>()){
+    std::shared_ptr<LoadShedder> shedder = ingress_;
+    module.addInputFilter([shedder, priority_fn](const typename Module::InputType &input){
+      return shedder->admit(priority_fn ? priority_fn(input) : 0);
+    });
+  }
+
+  /**
+   * Measure every stage and adapt its batch limit and shedding level. Called every period by start().
+   */
+  void tick(){
+    std::lock_guard<std::mutex> lk(mutex_);
+    double ingress_level = 0;
+    for(std::unique_ptr<Stage> &stage : stages_){
+      control(*stage);
+      if(stage->config.policy == SheddingPolicy::RejectAtIngress){
+        ingress_level = std::max(ingress_level, stage->shed_level);
+      }
+    }
+    ingress_->setLevel(ingress_level);
+  }
+
+  std::vector<StageLoadSnapshot> snapshot() const{
+    std::lock_guard<std::mutex> lk(mutex_);
+    std::vector<StageLoadSnapshot> result;
+    result.reserve(stages_.size());
+    for(const std::unique_ptr<Stage> &stage : stages_){
+      StageLoadSnapshot snapshot = stage->decisions;
+      snapshot.module_id = stage->previous.module_id;
+      snapshot.policy = stage->config.policy;
+      snapshot.batch_limit = stage->batch_limit();
+      snapshot.max_batch_size = stage->max_batch_size;
+      snapshot.shed_level = stage->shed_level;
+      const LoadShedder &shedder = stage->config.policy == SheddingPolicy::RejectAtIngress ? *ingress_
+                                                                                           : *stage->shedder;
+      snapshot.admitted = shedder.numAdmitted();
+      snapshot.shed = shedder.numShed();
+      result.push_back(snapshot);
+    }
+    return result;
+  }
+
+  /**
+   * Return one line per stage for Text, or a JSON array for Json
+   */
+  std::string report(Format format) const{
+    std::ostringstream out;
+    const std::vector<StageLoadSnapshot> snapshots = snapshot();
+    if(format == Format::Json){
+      out << "[";
+      for(size_t i = 0; i < snapshots.size(); ++i){
+        out << (i == 0 ? "" : ",") << snapshots[i].toJson();
+      }
+      out << "]";
+    } else {
+      for(const StageLoadSnapshot &stage : snapshots){
+        out << stage.toText() << "\n";
+      }
+    }
+    return out.str();
+  }
+
+  /**
+   * tick() every `period` on a thread of the controller. If `sink` is set, it gets a report after every tick.
+   */
+  void start(const std::chrono::milliseconds &period, Format format = Format::Text, const Sink &sink = Sink()){
+    {
+      std::lock_guard<std::mutex> lk(run_mutex_);
+      CHECK(!running_) << "LoadController: start() is already called";
+      running_ = true;
+    }
+    thread_ = std::thread([this, period, format, sink]{
+      std::unique_lock<std::mutex> lk(run_mutex_);
+      while(!cond_.wait_for(lk, period, [this]{ return !running_; })){
+        lk.unlock();
+        tick();
+        if(sink){
+          sink(report(format));
+        }
+        lk.lock();
+      }
+    });
+  }
+
+  void stop(){
+    {
+      std::lock_guard<std::mutex> lk(run_mutex_);
+      if(!running_) return;
+      running_ = false;
+    }
+    cond_.notify_all();
+    thread_.join();
+  }
+
+private:
+  struct Stage {
+    Stage(): config(), min_batch_size(1), max_batch_size(1), shedder(), snapshot(), num_workers(), batch_limit(),
+             set_batch_limit(), previous(), decisions(), shed_level(0) {}
+
+    StageLoadConfig config;
+    size_t min_batch_size;
+    size_t max_batch_size;
+    std::shared_ptr<LoadShedder> shedder;
+    std::function<ModuleMetricsSnapshot()> snapshot;
+    std::function<size_t()> num_workers;
+    std::function<size_t()> batch_limit;
+    std::function<void(size_t)> set_batch_limit;
+    // metrics at the previous tick
+    ModuleMetricsSnapshot previous;
+    StageLoadSnapshot decisions;
+    double shed_level;
+  };
+
+  static void control(Stage &stage){
+    ModuleMetricsSnapshot current = stage.snapshot();
+    StageLoadSnapshot &decisions = stage.decisions;
+    // service time of the inputs spun since the previous tick, shed inputs skip spinOnce()
+    const uint64_t spun = (current.inputs - stage.previous.inputs)
+                          - (current.shed_inputs - stage.previous.shed_inputs);
+    const uint64_t spin_ns = current.spin.sum_ns - stage.previous.spin.sum_ns;
+    if(spun > 0 && spin_ns > 0){
+      const uint64_t service_ns = spin_ns / spun;
+      decisions.service_ns = decisions.service_ns == 0 ? service_ns : (3 * decisions.service_ns + service_ns) / 4;
+    }
+    const size_t batch_limit = stage.batch_limit();
+    const uint64_t depth = current.queue_depth;
+    decisions.queue_depth = depth;
+    decisions.estimated_latency_ns = (depth + batch_limit) * decisions.service_ns
+                                     / std::max<size_t>(stage.num_workers(), 1);
+    decisions.pressure = static_cast<double>(decisions.estimated_latency_ns)
+                         / std::chrono::duration_cast<std::chrono::nanoseconds>(stage.config.latency_slo).count();
+
+    if(depth >= 2 * batch_limit && batch_limit < stage.max_batch_size){
+      stage.set_batch_limit(std::min(2 * batch_limit, stage.max_batch_size));
+      ++decisions.batch_increases;
+    } else if(2 * depth < batch_limit && batch_limit > stage.min_batch_size){
+      stage.set_batch_limit(std::max(batch_limit / 2, stage.min_batch_size));
+      ++decisions.batch_decreases;
+    }
+
+    if(stage.config.policy != SheddingPolicy::None){
+      if(decisions.pressure > stage.config.shed_threshold
+         && stage.shed_level < stage.config.max_shed_level){
+        stage.shed_level = std::min(stage.shed_level + stage.config.shed_step, stage.config.max_shed_level);
+        ++decisions.shed_increases;
+        LOG(WARNING) << "LoadController: " << current.module_id << ": latency " << decisions.estimated_latency_ns
+                     << "ns over the SLO, " << toString(stage.config.policy) << " level " << stage.shed_level;
+      } else if(decisions.pressure < stage.config.shed_threshold / 2 && stage.shed_level > 0){
+        stage.shed_level = std::max(stage.shed_level - stage.config.shed_step, 0.0);
+        ++decisions.shed_decreases;
+      }
+      stage.shedder->setLevel(stage.shed_level);
+    }
+    stage.previous = std::move(current);
+  }
+
+  std::vector<std::unique_ptr<Stage>> stages_;
+  std::shared_ptr<LoadShedder> ingress_;
+  bool running_;
+  // guards the stages
+  mutable std::mutex mutex_;
+  // guards running_ for the controller thread
+  std::mutex run_mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+};
+}
+#endif //MODULAR_PIPELINE_LOAD_CONTROLLER_HPP
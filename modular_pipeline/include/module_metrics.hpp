@@ -0,0 +1,440 @@
+#ifndef MODULAR_PIPELINE_MODULE_METRICS_HPP
+#define MODULAR_PIPELINE_MODULE_METRICS_HPP
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+#include "aligned_allocator.hpp"
+#include "event_count.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * Escape `text` for a JSON string literal, e.g. a module id in the JSON of the metrics
+ */
+inline std::string jsonEscape(const std::string &text){
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string escaped;
+  escaped.reserve(text.size());
+  for(char c : text){
+    const unsigned char byte = static_cast<unsigned char>(c);
+    if(c == '"' || c == '\\'){
+      escaped += '\\';
+      escaped += c;
+    } else if(byte < 0x20){
+      escaped += "\\u00";
+      escaped += kHexDigits[byte >> 4];
+      escaped += kHexDigits[byte & 0xf];
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+/**
+ * Copy of a LatencyHistogram at one point in time
+ */
+struct HistogramSnapshot {
+  static constexpr size_t kNumBuckets = 48;
+
+  HistogramSnapshot(): count(0), sum_ns(0), max_ns(0), buckets() {}
+
+  /**
+   * Return the mean in nanoseconds
+   */
+  double mean() const{
+    return count == 0 ? 0.0 : static_cast<double>(sum_ns) / count;
+  }
+
+  /**
+   * Return an upper bound of the `quantile` (0 to 1) in nanoseconds. Exact to a power of two.
+   */
+  uint64_t percentile(double quantile) const{
+    if(count == 0) return 0;
+    uint64_t rank = static_cast<uint64_t>(quantile * count);
+    if(rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for(size_t i = 0; i < kNumBuckets; ++i){
+      seen += buckets[i];
+      if(seen > rank){
+        const uint64_t upper = i == 0 ? 0 : (uint64_t(1) << i) - 1;
+        return upper < max_ns ? upper : max_ns;
+      }
+    }
+    return max_ns;
+  }
+
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[kNumBuckets];
+};
+
+/**
+ * Histogram of durations with one bucket per power of two nanoseconds.
+ * record() only does relaxed atomic additions. They are cheap as long as one thread writes the histogram, like the
+ * shards of ModuleMetrics.
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram(): count_(0), sum_ns_(0), max_ns_(0), buckets_() {
+    for(std::atomic<uint64_t> &bucket : buckets_){
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  void operator=(const LatencyHistogram&) = delete;
+
+  void record(uint64_t ns){
+    buckets_[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max_ns = max_ns_.load(std::memory_order_relaxed);
+    while(ns > max_ns && !max_ns_.compare_exchange_weak(max_ns, ns, std::memory_order_relaxed)) {}
+  }
+
+  HistogramSnapshot snapshot() const{
+    HistogramSnapshot result;
+    result.count = count_.load(std::memory_order_relaxed);
+    result.sum_ns = sum_ns_.load(std::memory_order_relaxed);
+    result.max_ns = max_ns_.load(std::memory_order_relaxed);
+    for(size_t i = 0; i < HistogramSnapshot::kNumBuckets; ++i){
+      result.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  void reset(){
+    for(std::atomic<uint64_t> &bucket : buckets_){
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_ns_.store(0, std::memory_order_relaxed);
+    max_ns_.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  // bucket i holds durations in [2^(i-1), 2^i)
+  static size_t bucketIndex(uint64_t ns){
+    if(ns == 0) return 0;
+#if defined(__GNUC__)
+    size_t index = 64 - __builtin_clzll(ns);
+#else
+    size_t index = 0;
+    while(ns != 0){
+      ns >>= 1;
+      ++index;
+    }
+#endif
+    return index < HistogramSnapshot::kNumBuckets ? index : HistogramSnapshot::kNumBuckets - 1;
+  }
+
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_ns_;
+  std::atomic<uint64_t> max_ns_;
+  std::atomic<uint64_t> buckets_[HistogramSnapshot::kNumBuckets];
+};
+
+/**
+ * Copy of the metrics of one module at one point in time
+ */
+struct ModuleMetricsSnapshot {
+  ModuleMetricsSnapshot(): module_id(), inputs(0), outputs(0), dropped_outputs(0), failed_sends(0), shed_inputs(0),
+                           queue_depth(0), queue_high_water_mark(0), prepare(), spin(), send() {}
+
+  std::string toText() const{
+    std::ostringstream out;
+    out << "[" << module_id << "] in=" << inputs << " out=" << outputs << " dropped=" << dropped_outputs
+        << " failed=" << failed_sends << " shed=" << shed_inputs << " queue=" << queue_depth
+        << " queue_hwm=" << queue_high_water_mark;
+    appendText(out, "prepare", prepare);
+    appendText(out, "spin", spin);
+    appendText(out, "send", send);
+    return out.str();
+  }
+
+  std::string toJson() const{
+    std::ostringstream out;
+    out << "{\"module\":\"" << jsonEscape(module_id) << "\",\"inputs\":" << inputs << ",\"outputs\":" << outputs
+        << ",\"dropped_outputs\":" << dropped_outputs << ",\"failed_sends\":" << failed_sends
+        << ",\"shed_inputs\":" << shed_inputs
+        << ",\"queue_depth\":" << queue_depth << ",\"queue_high_water_mark\":" << queue_high_water_mark;
+    appendJson(out, "prepare", prepare);
+    appendJson(out, "spin", spin);
+    appendJson(out, "send", send);
+    out << "}";
+    return out.str();
+  }
+
+  std::string module_id;
+  uint64_t inputs;
+  uint64_t outputs;
+  // spinOnce() returned no output
+  uint64_t dropped_outputs;
+  // sendOutputPayload() returned false
+  uint64_t failed_sends;
+  // rejected by the input filter, e.g. by load shedding
+  uint64_t shed_inputs;
+  uint64_t queue_depth;
+  uint64_t queue_high_water_mark;
+  // time spent getting inputs, including the time blocked on an empty queue
+  HistogramSnapshot prepare;
+  // time spent in spinOnce() or spinBatch()
+  HistogramSnapshot spin;
+  // time spent sending outputs, including the time blocked on a full queue
+  HistogramSnapshot send;
+
+private:
+  static void appendText(std::ostringstream &out, const char *name, const HistogramSnapshot &histogram){
+    out << " " << name << "{n=" << histogram.count << " mean=" << static_cast<uint64_t>(histogram.mean())
+        << "ns p50=" << histogram.percentile(0.5) << "ns p99=" << histogram.percentile(0.99)
+        << "ns max=" << histogram.max_ns << "ns}";
+  }
+
+  static void appendJson(std::ostringstream &out, const char *name, const HistogramSnapshot &histogram){
+    out << ",\"" << name << "\":{\"count\":" << histogram.count << ",\"sum_ns\":" << histogram.sum_ns
+        << ",\"mean_ns\":" << static_cast<uint64_t>(histogram.mean())
+        << ",\"p50_ns\":" << histogram.percentile(0.5) << ",\"p99_ns\":" << histogram.percentile(0.99)
+        << ",\"max_ns\":" << histogram.max_ns << "}";
+  }
+};
+
+/**
+ * Counters and histograms of one module. All updates are relaxed atomics.
+ * Every thread updates its own cache line aligned shard, picked once per thread, so the workers of a parallel module
+ * don't write to the same cache lines on every input. snapshot() sums the shards.
+ * The durations are measured with laps: startLap() returns the current time, recordLap() records the time since
+ * the previous lap and starts the next one. Both return 0 and record nothing while timing is disabled.
+ */
+class ModuleMetrics {
+public:
+  static constexpr size_t kNumShards = 8;
+
+  enum class Counter { Inputs, Outputs, DroppedOutputs, FailedSends, ShedInputs };
+  enum class Stage { Prepare, Spin, Send };
+
+  ModuleMetrics(): shards_(kNumShards), queue_high_water_mark_(0), timing_enabled_(true) {}
+  ModuleMetrics(const ModuleMetrics&) = delete;
+  void operator=(const ModuleMetrics&) = delete;
+
+  void setTimingEnabled(bool enabled){
+    timing_enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  bool isTimingEnabled() const{
+    return timing_enabled_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t startLap() const{
+    return isTimingEnabled() ? nowNs() : 0;
+  }
+
+  uint64_t recordLap(Stage stage, uint64_t lap){
+    if(lap == 0) return 0;
+    const uint64_t now = nowNs();
+    localShard().histograms[static_cast<size_t>(stage)].record(now > lap ? now - lap : 0);
+    return now;
+  }
+
+  /**
+   * Add `value` to `counter` and return the value of the counter in the shard of the calling thread before
+   */
+  uint64_t add(Counter counter, uint64_t value = 1){
+    return localShard().counters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+  }
+
+  void updateQueueDepth(uint64_t depth){
+    uint64_t high_water = queue_high_water_mark_.load(std::memory_order_relaxed);
+    while(depth > high_water
+          && !queue_high_water_mark_.compare_exchange_weak(high_water, depth, std::memory_order_relaxed)) {}
+  }
+
+  ModuleMetricsSnapshot snapshot(const std::string &module_id, uint64_t queue_depth) const{
+    ModuleMetricsSnapshot result;
+    result.module_id = module_id;
+    result.inputs = sum(Counter::Inputs);
+    result.outputs = sum(Counter::Outputs);
+    result.dropped_outputs = sum(Counter::DroppedOutputs);
+    result.failed_sends = sum(Counter::FailedSends);
+    result.shed_inputs = sum(Counter::ShedInputs);
+    result.queue_depth = queue_depth;
+    result.queue_high_water_mark = queue_high_water_mark_.load(std::memory_order_relaxed);
+    if(queue_depth > result.queue_high_water_mark) result.queue_high_water_mark = queue_depth;
+    result.prepare = merge(Stage::Prepare);
+    result.spin = merge(Stage::Spin);
+    result.send = merge(Stage::Send);
+    return result;
+  }
+
+  void reset(){
+    for(Shard &shard : shards_){
+      for(std::atomic<uint64_t> &counter : shard.counters){
+        counter.store(0, std::memory_order_relaxed);
+      }
+      for(LatencyHistogram &histogram : shard.histograms){
+        histogram.reset();
+      }
+    }
+    queue_high_water_mark_.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr size_t kNumCounters = 5;
+  static constexpr size_t kNumStages = 3;
+
+  struct alignas(concurrent_queue::kCacheLineSize) Shard {
+    Shard(): counters(), histograms() {
+      for(std::atomic<uint64_t> &counter : counters){
+        counter.store(0, std::memory_order_relaxed);
+      }
+    }
+    std::atomic<uint64_t> counters[kNumCounters];
+    LatencyHistogram histograms[kNumStages];
+  };
+
+  static uint64_t nowNs(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // the shard index of the calling thread, the same in every module. Threads are spread round robin.
+  static size_t shardIndex(){
+    static std::atomic<size_t> next_index(0);
+    static thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+    return index;
+  }
+
+  Shard& localShard(){
+    return shards_[shardIndex()];
+  }
+
+  uint64_t sum(Counter counter) const{
+    uint64_t total = 0;
+    for(const Shard &shard : shards_){
+      total += shard.counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  HistogramSnapshot merge(Stage stage) const{
+    HistogramSnapshot result;
+    for(const Shard &shard : shards_){
+      const HistogramSnapshot histogram = shard.histograms[static_cast<size_t>(stage)].snapshot();
+      result.count += histogram.count;
+      result.sum_ns += histogram.sum_ns;
+      if(histogram.max_ns > result.max_ns) result.max_ns = histogram.max_ns;
+      for(size_t i = 0; i < HistogramSnapshot::kNumBuckets; ++i){
+        result.buckets[i] += histogram.buckets[i];
+      }
+    }
+    return result;
+  }
+
+  // the shards are cache line aligned, which plain `new` doesn't honour before C++17
+  std::vector<Shard, concurrent_queue::AlignedAllocator<Shard>> shards_;
+  std::atomic<uint64_t> queue_high_water_mark_;
+  std::atomic_bool timing_enabled_;
+};
+
+/**
+ * Collects the metrics of many modules and dumps them as text or JSON, on demand or periodically on its own thread.
+ */
+class MetricsReporter {
+public:
+  enum class Format { Text, Json };
+  using Sink = std::function<void(const std::string &report)>;
+
+  MetricsReporter(): sources_(), running_(false), mutex_(), cond_(), thread_() {}
+  ~MetricsReporter(){
+    stop();
+  }
+  MetricsReporter(const MetricsReporter&) = delete;
+  void operator=(const MetricsReporter&) = delete;
+
+  /**
+   * Add a module, anything with a `metricsSnapshot()` method. The module must outlive the reporter.
+   */
+  template <typename Module>
+  void addModule(const Module &module){
+    CHECK(!running_) << "MetricsReporter: addModule() must be called before start()";
+    const Module *m = &module;
+    sources_.push_back([m]{ return m->metricsSnapshot(); });
+  }
+
+  std::vector<ModuleMetricsSnapshot> snapshot() const{
+    std::vector<ModuleMetricsSnapshot> result;
+    result.reserve(sources_.size());
+    for(const std::function<ModuleMetricsSnapshot()> &source : sources_){
+      result.push_back(source());
+    }
+    return result;
+  }
+
+  /**
+   * Return one line per module for Text, or a JSON array for Json
+   */
+  std::string report(Format format) const{
+    std::ostringstream out;
+    const std::vector<ModuleMetricsSnapshot> snapshots = snapshot();
+    if(format == Format::Json){
+      out << "[";
+      for(size_t i = 0; i < snapshots.size(); ++i){
+        out << (i == 0 ? "" : ",") << snapshots[i].toJson();
+      }
+      out << "]";
+    } else {
+      for(const ModuleMetricsSnapshot &module : snapshots){
+        out << module.toText() << "\n";
+      }
+    }
+    return out.str();
+  }
+
+  /**
+   * Send a report to `sink` every `period`. By default the report goes to LOG(INFO).
+   */
+  void start(const std::chrono::milliseconds &period, Format format = Format::Text, const Sink &sink = Sink()){
+    CHECK(!running_) << "MetricsReporter: start() is already called";
+    running_ = true;
+    thread_ = std::thread([this, period, format, sink]{
+      std::unique_lock<std::mutex> lk(mutex_);
+      while(!cond_.wait_for(lk, period, [this]{ return !running_; })){
+        lk.unlock();
+        const std::string text = report(format);
+        if(sink){
+          sink(text);
+        } else {
+          LOG(INFO) << "Pipeline metrics:\n" << text;
+        }
+        lk.lock();
+      }
+    });
+  }
+
+  void stop(){
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      if(!running_) return;
+      running_ = false;
+    }
+    cond_.notify_all();
+    thread_.join();
+  }
+
+private:
+  std::vector<std::function<ModuleMetricsSnapshot()>> sources_;
+  bool running_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+};
+}
+#endif //MODULAR_PIPELINE_MODULE_METRICS_HPP
@@ -0,0 +1,550 @@
+#ifndef MODULAR_PIPELINE_PAYLOAD_POOL_HPP
+#define MODULAR_PIPELINE_PAYLOAD_POOL_HPP
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <glog/logging.h>
+#include "aligned_allocator.hpp"
+#include "mpmc_queue.hpp"
+#include "thread_affinity.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * Counters of a FixedBlockPool
+ */
+struct PoolStats {
+  // blocks carved from slabs, they are never returned to the system
+  uint64_t pooled_blocks;
+  // blocks allocated from the heap because the pool reached its maximum size
+  uint64_t heap_blocks;
+  // blocks in the shared free list, not counting the thread-local caches
+  uint64_t free_blocks;
+};
+
+/**
+ * Type erased access to one FixedBlockPool, e.g. the pool of the std::allocate_shared control blocks of a payload,
+ * whose type is only known to the standard library
+ */
+struct BlockPoolHandle {
+  void (*reserve)(size_t num_blocks);
+  PoolStats (*stats)();
+};
+
+/**
+ * Lock-free pool of fixed size memory blocks, one instance per block size and alignment.
+ * The blocks are kept per NUMA node: every node has its own slabs and free list, and only threads running on a node
+ * carve new slabs for it, so the first-touch policy of the kernel puts them in the memory of that node. A block always
+ * goes back to the free list of its node, whichever thread frees it.
+ * Every thread keeps a small cache of free blocks of its own node and one of another node, e.g. the node of the
+ * module it sends its outputs to, so allocate() and deallocate() usually touch no shared state. The caches exchange
+ * blocks in batches with the MpmcQueue free lists.
+ * A node grows by slabs of blocks up to kMaxBlocks and never returns them to the system, so a pipeline in steady
+ * state does no system allocation at all. Past kMaxBlocks blocks come from the heap and go back to it.
+ */
+template <size_t BlockSize, size_t Alignment>
+class FixedBlockPool {
+  static_assert(Alignment <= alignof(std::max_align_t), "over-aligned payloads are not supported");
+public:
+  static constexpr size_t kMaxBlocks = 16384;
+  static constexpr size_t kBlocksPerSlab = 64;
+  static constexpr size_t kCacheSize = 64;
+  // nodes from kMaxNodes on share the free list of `node % kMaxNodes`
+  static constexpr int kMaxNodes = 8;
+
+  /**
+   * The pool of this block size. It is never destroyed, because the caches of exiting threads give their blocks
+   * back to it, possibly after static destructors ran.
+   */
+  static FixedBlockPool& instance(){
+    static FixedBlockPool *pool = new FixedBlockPool();
+    return *pool;
+  }
+
+  static const BlockPoolHandle& handle(){
+    static const BlockPoolHandle pool_handle = {&reserveInstance, &instanceStats};
+    return pool_handle;
+  }
+
+  /**
+   * Return the NUMA node of the CPU the calling thread runs on, folded to [0, kMaxNodes). Always 0 off Linux.
+   */
+  static int currentNode(){
+#ifndef __linux__
+    return 0;
+#else
+    // the topology lookup is cached, the CPU only changes when the thread migrates
+    static thread_local int last_cpu = -1;
+    static thread_local int last_node = 0;
+    const int cpu = sched_getcpu();
+    if(cpu != last_cpu){
+      const int node = cpu < 0 ? -1 : CpuTopology::instance().nodeOfCpu(cpu);
+      last_cpu = cpu;
+      last_node = node < 0 ? 0 : node % kMaxNodes;
+    }
+    return last_node;
+#endif
+  }
+
+  /**
+   * Allocate a block of the node the calling thread runs on
+   */
+  void* allocate(){
+    Cache &cache = localCaches().local;
+    if(cache.count == 0 && !refill(cache, currentNode())){
+      return allocateFromHeap();
+    }
+    return cache.blocks[--cache.count];
+  }
+
+  /**
+   * Allocate a block of NUMA node `node`, e.g. the node of the module that will use it. Only threads on a node
+   * carve new blocks for it, so if `node` has no free block the block comes from the node of the calling thread.
+   * A negative `node` is the node of the calling thread.
+   */
+  void* allocateOn(int node){
+    if(node < 0) return allocate();
+    node %= kMaxNodes;
+    Caches &caches = localCaches();
+    if(node == caches.local.node) return allocate();
+    Cache &cache = caches.remote;
+    if(cache.node != node){
+      flush(cache, cache.count);
+      cache.node = node;
+    }
+    if(cache.count == 0 && !refill(cache, node)){
+      return allocate();
+    }
+    return cache.blocks[--cache.count];
+  }
+
+  void deallocate(void *block){
+    Header *header = headerOf(block);
+    if(!header->pooled){
+      ::operator delete(header);
+      return;
+    }
+    Caches &caches = localCaches();
+    if(caches.local.count == 0){
+      caches.local.node = currentNode();
+    }
+    Cache *cache = &caches.local;
+    if(header->node != caches.local.node){
+      if(caches.remote.node != header->node){
+        flush(caches.remote, caches.remote.count);
+        caches.remote.node = header->node;
+      }
+      cache = &caches.remote;
+    }
+    if(cache->count == kCacheSize){
+      flush(*cache, kCacheSize / 2);
+    }
+    cache->blocks[cache->count++] = block;
+  }
+
+  /**
+   * Grow the free list of the node the calling thread runs on to at least `num_blocks` blocks and touch them, so the
+   * first payloads don't pay for page faults. Call it from a thread pinned to the node the payloads should live on.
+   */
+  void reserve(size_t num_blocks){
+    const int node = currentNode();
+    Shard &shard = shardOf(node);
+    std::lock_guard<std::mutex> lk(shard.grow_mutex);
+    while(shard.pooled_blocks < num_blocks && shard.pooled_blocks < kMaxBlocks){
+      std::vector<void*> blocks;
+      addSlab(shard, node, blocks);
+      for(void *block : blocks){
+        shard.free_list.try_push(std::move(block));
+      }
+    }
+  }
+
+  /**
+   * Counters of all nodes
+   */
+  PoolStats stats() const{
+    PoolStats result;
+    result.pooled_blocks = 0;
+    result.heap_blocks = heap_blocks_.load(std::memory_order_relaxed);
+    result.free_blocks = 0;
+    for(int node = 0; node < kMaxNodes; ++node){
+      const Shard *shard = shards_[node].load(std::memory_order_acquire);
+      if(!shard) continue;
+      result.pooled_blocks += shard->pooled_blocks.load(std::memory_order_relaxed);
+      result.free_blocks += shard->free_list.size();
+    }
+    return result;
+  }
+
+  /**
+   * Counters of NUMA node `node`. Heap blocks are not counted per node.
+   */
+  PoolStats stats(int node) const{
+    PoolStats result;
+    const Shard *shard = node < 0 ? nullptr : shards_[node % kMaxNodes].load(std::memory_order_acquire);
+    result.pooled_blocks = shard ? shard->pooled_blocks.load(std::memory_order_relaxed) : 0;
+    result.heap_blocks = 0;
+    result.free_blocks = shard ? shard->free_list.size() : 0;
+    return result;
+  }
+
+private:
+  struct Header {
+    bool pooled;
+    // the node whose free list the block belongs to
+    uint8_t node;
+  };
+
+  struct Cache {
+    Cache(): blocks(), count(0), node(-1) {}
+    void *blocks[kCacheSize];
+    size_t count;
+    // the node of the cached blocks, -1 before the first one
+    int node;
+  };
+
+  struct Caches {
+    ~Caches(){
+      instance().flush(local, local.count);
+      instance().flush(remote, remote.count);
+    }
+    // blocks of the node the thread runs on
+    Cache local;
+    // blocks of the last other node the thread allocated on or freed to
+    Cache remote;
+  };
+
+  struct Shard {
+    Shard(): free_list(kMaxBlocks), grow_mutex(), slabs(), pooled_blocks(0) {}
+    concurrent_queue::MpmcQueue<void*> free_list;
+    std::mutex grow_mutex;
+    std::vector<std::unique_ptr<char[]>> slabs;
+    std::atomic<size_t> pooled_blocks;
+  };
+
+  static constexpr size_t kHeaderSize = (sizeof(Header) + Alignment - 1) / Alignment * Alignment;
+  static constexpr size_t kStride = kHeaderSize + (BlockSize + Alignment - 1) / Alignment * Alignment;
+
+  FixedBlockPool(): shards_(), shards_mutex_(), heap_blocks_(0) {
+    for(int node = 0; node < kMaxNodes; ++node){
+      shards_[node].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+  FixedBlockPool(const FixedBlockPool&) = delete;
+  void operator=(const FixedBlockPool&) = delete;
+
+  static void reserveInstance(size_t num_blocks){
+    instance().reserve(num_blocks);
+  }
+
+  static PoolStats instanceStats(){
+    return instance().stats();
+  }
+
+  static Caches& localCaches(){
+    static thread_local Caches caches;
+    return caches;
+  }
+
+  static Header* headerOf(void *block){
+    return reinterpret_cast<Header*>(static_cast<char*>(block) - kHeaderSize);
+  }
+
+  // the free list of `node`, created on first use. The shards live as long as the pool.
+  Shard& shardOf(int node){
+    Shard *shard = shards_[node].load(std::memory_order_acquire);
+    if(shard) return *shard;
+    std::lock_guard<std::mutex> lk(shards_mutex_);
+    shard = shards_[node].load(std::memory_order_relaxed);
+    if(!shard){
+      // the free list is cache line aligned, which plain `new` doesn't honour before C++17
+      shard = new (concurrent_queue::alignedAllocate(sizeof(Shard), alignof(Shard))) Shard();
+      shards_[node].store(shard, std::memory_order_release);
+    }
+    return *shard;
+  }
+
+  // take half a cache of blocks of `node` from its free list. If it is empty, carve a new slab when the calling thread
+  // runs on `node`. `cache` must be empty.
+  bool refill(Cache &cache, int node){
+    Shard &shard = shardOf(node);
+    cache.node = node;
+    cache.count = shard.free_list.pop_bulk(cache.blocks, kCacheSize / 2);
+    if(cache.count != 0) return true;
+    if(node != currentNode()) return false;
+    std::lock_guard<std::mutex> lk(shard.grow_mutex);
+    if(shard.pooled_blocks >= kMaxBlocks) return false;
+    std::vector<void*> blocks;
+    addSlab(shard, node, blocks);
+    for(void *block : blocks){
+      if(cache.count < kCacheSize / 2){
+        cache.blocks[cache.count++] = block;
+      } else {
+        shard.free_list.try_push(std::move(block));
+      }
+    }
+    return true;
+  }
+
+  // move the `n` oldest cached blocks to the free list of their node. It can hold every pooled block of the node, so
+  // it never fails.
+  void flush(Cache &cache, size_t n){
+    if(n == 0) return;
+    Shard &shard = shardOf(cache.node);
+    for(size_t i = 0; i < n; ++i){
+      shard.free_list.try_push(std::move(cache.blocks[i]));
+    }
+    for(size_t i = n; i < cache.count; ++i){
+      cache.blocks[i - n] = cache.blocks[i];
+    }
+    cache.count -= n;
+  }
+
+  // carve a slab for `shard`, the shard of `node`. Must be called with its `grow_mutex` held, from a thread on `node`.
+  void addSlab(Shard &shard, int node, std::vector<void*> &blocks){
+    const size_t remaining = kMaxBlocks - shard.pooled_blocks;
+    const size_t num_blocks = remaining < kBlocksPerSlab ? remaining : kBlocksPerSlab;
+    // value-initialized, so the pages are touched here, on the node of the calling thread, and not on the hot path
+    std::unique_ptr<char[]> slab(new char[num_blocks * kStride]());
+    for(size_t i = 0; i < num_blocks; ++i){
+      char *block = slab.get() + i * kStride + kHeaderSize;
+      new (headerOf(block)) Header();
+      headerOf(block)->pooled = true;
+      headerOf(block)->node = static_cast<uint8_t>(node);
+      blocks.push_back(block);
+    }
+    shard.slabs.push_back(std::move(slab));
+    shard.pooled_blocks += num_blocks;
+  }
+
+  void* allocateFromHeap(){
+    char *block = static_cast<char*>(::operator new(kStride)) + kHeaderSize;
+    new (headerOf(block)) Header();
+    headerOf(block)->pooled = false;
+    heap_blocks_.fetch_add(1, std::memory_order_relaxed);
+    return block;
+  }
+
+  std::atomic<Shard*> shards_[kMaxNodes];
+  std::mutex shards_mutex_;
+  std::atomic<uint64_t> heap_blocks_;
+};
+
+/**
+ * Gives back a payload that was not allocated with new, e.g. to its pool or to the shared memory slot it lives in
+ */
+template <typename T>
+class PayloadReleaser {
+public:
+  virtual ~PayloadReleaser() = default;
+  virtual void release(T *payload) const = 0;
+};
+
+/**
+ * Releaser of the payloads made by PayloadPool<T>::makeUnique()
+ */
+template <typename T>
+class PooledPayloadReleaser : public PayloadReleaser<T> {
+public:
+  // never destroyed, like the pools, so payloads can still be deleted after static destructors ran
+  static const PooledPayloadReleaser& instance(){
+    static const PooledPayloadReleaser *releaser = new PooledPayloadReleaser();
+    return *releaser;
+  }
+
+  void release(T *payload) const override {
+    payload->~T();
+    FixedBlockPool<sizeof(T), alignof(T)>::instance().deallocate(payload);
+  }
+};
+
+/**
+ * Deleter of pipeline input payloads. It hands pooled and other borrowed payloads to their releaser and deletes the
+ * others, so a `std::unique_ptr<T>` still converts to a `std::unique_ptr<T, PayloadDeleter<T>>`.
+ */
+template <typename T>
+class PayloadDeleter {
+public:
+  PayloadDeleter() noexcept : releaser_(nullptr) {}
+  explicit PayloadDeleter(bool pooled) noexcept
+  : releaser_(pooled ? &PooledPayloadReleaser<T>::instance() : nullptr) {}
+  explicit PayloadDeleter(const PayloadReleaser<T> *releaser) noexcept : releaser_(releaser) {}
+  template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+  PayloadDeleter(const std::default_delete<U>&) noexcept : releaser_(nullptr) {}
+
+  void operator()(T *payload) const{
+    if(releaser_){
+      releaser_->release(payload);
+    } else {
+      delete payload;
+    }
+  }
+
+private:
+  const PayloadReleaser<T> *releaser_;
+};
+
+/**
+ * Remembers which FixedBlockPool std::allocate_shared takes the blocks of `Payload` from, see PoolAllocator
+ */
+template <typename Payload>
+class SharedBlockPool {
+public:
+  static void attach(const BlockPoolHandle &handle){
+    const BlockPoolHandle *current = slot().load(std::memory_order_acquire);
+    if(current == &handle) return;
+    // PayloadPool<Payload>::sharedPool() guessed another pool than the one allocate_shared really uses
+    CHECK(current == nullptr) << "SharedBlockPool: allocate_shared uses another pool than the probed one";
+    slot().store(&handle, std::memory_order_release);
+  }
+
+  // nullptr until a block of `Payload` was allocated
+  static const BlockPoolHandle* get(){
+    return slot().load(std::memory_order_acquire);
+  }
+
+private:
+  static std::atomic<const BlockPoolHandle*>& slot(){
+    static std::atomic<const BlockPoolHandle*> handle(nullptr);
+    return handle;
+  }
+};
+
+/**
+ * Allocator that takes single objects from a FixedBlockPool, e.g. for std::allocate_shared, which then stores the
+ * control block and the payload in one pooled block. `Payload` survives the rebind to the control block, so the
+ * rebound allocator registers its pool as the shared pool of `Payload`.
+ */
+template <typename T, typename Payload = T>
+class PoolAllocator {
+public:
+  typedef T value_type;
+  template <typename U>
+  struct rebind {
+    typedef PoolAllocator<U, Payload> other;
+  };
+
+  PoolAllocator() noexcept {}
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U, Payload>&) noexcept {}
+
+  T* allocate(size_t n){
+    if(n != 1) return static_cast<T*>(::operator new(n * sizeof(T)));
+    if(!std::is_same<T, Payload>::value){
+      SharedBlockPool<Payload>::attach(FixedBlockPool<sizeof(T), alignof(T)>::handle());
+    }
+    return static_cast<T*>(FixedBlockPool<sizeof(T), alignof(T)>::instance().allocate());
+  }
+
+  void deallocate(T *p, size_t n){
+    if(n != 1){
+      ::operator delete(p);
+    } else {
+      FixedBlockPool<sizeof(T), alignof(T)>::instance().deallocate(p);
+    }
+  }
+};
+
+template <typename T, typename U, typename Payload>
+bool operator==(const PoolAllocator<T, Payload>&, const PoolAllocator<U, Payload>&){
+  return true;
+}
+
+template <typename T, typename U, typename Payload>
+bool operator!=(const PoolAllocator<T, Payload>&, const PoolAllocator<U, Payload>&){
+  return false;
+}
+
+/**
+ * Pooled payloads of type T
+ *   InputUniquePtr input = PayloadPool<Input>::makeUnique(args...);
+ *   OutputSharedPtr output = PayloadPool<Output>::makeShared(args...);
+ */
+template <typename T>
+class PayloadPool {
+public:
+  using UniquePtr = std::unique_ptr<T, PayloadDeleter<T>>;
+
+  template <typename... Args>
+  static UniquePtr makeUnique(Args&&... args){
+    return makeUniqueOn(-1, std::forward<Args>(args)...);
+  }
+
+  /**
+   * Same as makeUnique(), but the payload is taken from the blocks of NUMA node `node`, e.g. the node of the module
+   * that consumes it. They come from the node of the calling thread if `node` is negative or has no free block left.
+   */
+  template <typename... Args>
+  static UniquePtr makeUniqueOn(int node, Args&&... args){
+    FixedBlockPool<sizeof(T), alignof(T)> &pool = FixedBlockPool<sizeof(T), alignof(T)>::instance();
+    void *block = pool.allocateOn(node);
+    T *payload = nullptr;
+    try {
+      payload = new (block) T(std::forward<Args>(args)...);
+    } catch(...) {
+      pool.deallocate(block);
+      throw;
+    }
+    return UniquePtr(payload, PayloadDeleter<T>(true));
+  }
+
+  template <typename... Args>
+  static std::shared_ptr<T> makeShared(Args&&... args){
+    return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Preallocate blocks for `num_payloads` payloads made by makeUnique() on the NUMA node of the calling thread.
+   * makeShared() uses another pool, see reserveShared().
+   */
+  static void reserve(size_t num_payloads){
+    FixedBlockPool<sizeof(T), alignof(T)>::instance().reserve(num_payloads);
+  }
+
+  /**
+   * Counters of the pool of makeUnique()
+   */
+  static PoolStats stats(){
+    return FixedBlockPool<sizeof(T), alignof(T)>::instance().stats();
+  }
+
+  /**
+   * Preallocate blocks for `num_payloads` payloads made by makeShared() on the NUMA node of the calling thread.
+   * They are sized for the control block.
+   */
+  static void reserveShared(size_t num_payloads){
+    sharedPool().reserve(num_payloads);
+  }
+
+  /**
+   * Counters of the pool of makeShared()
+   */
+  static PoolStats sharedStats(){
+    return sharedPool().stats();
+  }
+
+private:
+  // The control block type of allocate_shared is private to the standard library, so before the first makeShared()
+  // the pool is found by making a shared payload of the same size and alignment, which has the same control block
+  // size. The first makeShared() checks that it uses this pool.
+  static const BlockPoolHandle& sharedPool(){
+    const BlockPoolHandle *handle = SharedBlockPool<T>::get();
+    if(!handle){
+      using Storage = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+      std::allocate_shared<Storage>(PoolAllocator<Storage, T>());
+      handle = SharedBlockPool<T>::get();
+    }
+    return *handle;
+  }
+};
+}
+#endif //MODULAR_PIPELINE_PAYLOAD_POOL_HPP
@@ -0,0 +1,547 @@
+#ifndef MODULAR_PIPELINE_PIPELINE_GRAPH_HPP
+#define MODULAR_PIPELINE_PIPELINE_GRAPH_HPP
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <glog/logging.h>
+#include "aligned_allocator.hpp"
+#include "payload_pool.hpp"
+#include "pipeline_module.hpp"
+#include "pipeline_runner.hpp"
+#include "thread_affinity.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * Turn an output payload of one module into a pooled input payload of the next one, taken from the pool of NUMA node
+ * `node`, the node of the next module, or of the calling thread if `node` is negative.
+ * The payload is moved if `payload` is its only owner, otherwise it is copied.
+ */
+template <typename T>
+typename PayloadPool<T>::UniquePtr toInputPayload(std::shared_ptr<T> &&payload, int node = -1){
+  if(!payload) return typename PayloadPool<T>::UniquePtr();
+  if(payload.use_count() == 1){
+    return PayloadPool<T>::makeUniqueOn(node, std::move(*payload));
+  }
+  return PayloadPool<T>::makeUniqueOn(node, *payload);
+}
+
+/**
+ * Same as above, but always copies because the caller keeps its reference, e.g. an output callback.
+ */
+template <typename T>
+typename PayloadPool<T>::UniquePtr toInputPayload(const std::shared_ptr<T> &payload, int node = -1){
+  if(!payload) return typename PayloadPool<T>::UniquePtr();
+  return PayloadPool<T>::makeUniqueOn(node, *payload);
+}
+
+/**
+ * Builds a pipeline from modules and manages their threads.
+ * connect(upstream, downstream) sends the outputs of `upstream` to the input queue of `downstream`. The payload types
+ * are checked at compile time and the queue type of the edge is the input queue policy of `downstream`.
+ * Modules are linked with an output sink, so no extra queue or thread sits between two modules.
+ * start() runs every module on its own thread, or on a shared PipelineRunner for modules in sequential mode.
+ * Before the threads are started, start() runs the warmup of every module, see PipelineModule::setWarmup(). The graph
+ * is ready once every module thread runs, and the time from start() to ready is reported by readyReport().
+ * drain() shuts the modules down in topological order, each one only after everything its upstream modules sent is
+ * processed, so no payload is lost. A drained graph can be started again.
+ * Modules are not owned and must outlive the graph.
+ */
+class PipelineGraph {
+public:
+  explicit PipelineGraph(size_t num_runner_threads = std::thread::hardware_concurrency())
+    : num_runner_threads_(num_runner_threads), running_(false), ready_(false), time_to_ready_(0), nodes_(),
+      node_index_(), edges_(), order_(), runner_() {}
+  ~PipelineGraph(){
+    stop();
+  }
+  PipelineGraph(const PipelineGraph&) = delete;
+  void operator=(const PipelineGraph&) = delete;
+
+  /**
+   * Create an input queue for `Module` with its own queue policy, e.g. `makeInputQueue<SISO>(1024)`.
+   * The queue is allocated with the alignment of its type, so cache line aligned queues keep their padding.
+   */
+  template <typename Module, typename... Args>
+  static typename Module::InputQueueSharedPtr makeInputQueue(Args&&... args){
+    return concurrent_queue::makeSharedAligned<typename Module::InputQueue>(std::forward<Args>(args)...);
+  }
+
+  /**
+   * Same as makeInputQueue(), but the queue is constructed on a thread pinned to `placement`, so a queue that
+   * allocates its buffer in its constructor, e.g. MpmcQueue, has it on the NUMA node of the module that consumes it:
+   *   auto input_queue = PipelineGraph::makeInputQueueOn<SISO>(ThreadPlacement::onNode(1), 1024);
+   */
+  template <typename Module, typename... Args>
+  static typename Module::InputQueueSharedPtr makeInputQueueOn(const ThreadPlacement &placement, Args&&... args){
+    typename Module::InputQueueSharedPtr queue;
+    runPinned(placement, [&]{ queue = makeInputQueue<Module>(std::forward<Args>(args)...); });
+    return queue;
+  }
+
+  /**
+   * Register a module without connecting it, e.g. a module that is fed from outside the graph.
+   * connect() registers its modules itself.
+   */
+  template <typename Module>
+  void addModule(Module &module){
+    nodeIndex(module);
+  }
+
+  /**
+   * Send the outputs of `upstream` to the input queue of `downstream`.
+   * `downstream` must have an input queue (SIMO or SISO). Must be called before start(), once per edge.
+   * An input payload is owned by its module, so the payload is moved into the downstream queue when the edge holds
+   * its last reference. Otherwise it is copied: every edge of a module with several outgoing edges but the last one,
+   * and every edge of a payload that an output callback or asynchronous subscriber still holds.
+   */
+  template <typename Upstream, typename Downstream>
+  void connect(Upstream &upstream, Downstream &downstream){
+    static_assert(std::is_same<typename Upstream::OutputType, typename Downstream::InputType>::value,
+                  "PipelineGraph: the output type of the upstream module must be the input type of the downstream one");
+    CHECK(!running_) << "PipelineGraph: connect() must be called before start()";
+    auto queue = inputQueueOf(downstream);
+    CHECK(queue) << "PipelineGraph: module [" << downstream.moduleId() << "] has no input queue";
+    using Queue = typename decltype(queue)::element_type;
+
+    const size_t from = nodeIndex(upstream);
+    const size_t to = nodeIndex(downstream);
+    CHECK_NE(from, to) << "PipelineGraph: module [" << upstream.moduleId() << "] can't be connected to itself";
+    Node &node = *nodes_[to];
+    CHECK(!(IsSingleProducerQueue<Queue>::value && !node.inputs.empty()))
+      << "PipelineGraph: module [" << downstream.moduleId() << "] has a single producer input queue and can't have "
+      << "more than one upstream module";
+    node.single_producer_input = IsSingleProducerQueue<Queue>::value;
+
+    edges_.emplace_back(new Edge(from, to));
+    Edge *edge = edges_.back().get();
+    nodes_[from]->outputs.push_back(edges_.size() - 1);
+    node.inputs.push_back(edges_.size() - 1);
+    linkOutput(upstream, EdgeSink<Queue, typename Upstream::OutputType>(queue, edge));
+    VLOG(1) << "PipelineGraph: connected [" << upstream.moduleId() << "] -> [" << downstream.moduleId() << "]";
+  }
+
+  /**
+   * Start all modules. Modules that were shutdown, e.g. by a previous drain(), are restarted first. Then the modules
+   * are warmed up in topological order and their threads are started. Returns once the graph is ready.
+   */
+  void start(){
+    CHECK(!running_) << "PipelineGraph: start() is already called";
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    computeOrder();
+    for(const std::unique_ptr<Node> &node : nodes_){
+      if(!node->single_producer_input) continue;
+      for(size_t e : node->inputs){
+        const Node &upstream = *nodes_[edges_[e]->from];
+        // ordered workers send one at a time, so they are a single producer
+        CHECK(upstream.module->numWorkers() == 1 || upstream.module->preservesOrder())
+          << "PipelineGraph: module [" << upstream.module->moduleId() << "] runs on several unordered threads and "
+          << "can't feed the single producer input queue of module [" << node->module->moduleId() << "]";
+      }
+    }
+    for(std::unique_ptr<Edge> &edge : edges_){
+      edge->sent = 0;
+    }
+
+    runner_.reset(new PipelineRunner(num_runner_threads_));
+    size_t num_sequential = 0;
+    for(std::unique_ptr<Node> &node : nodes_){
+      if(node->module->isShutdown()){
+        node->module->restart();
+      }
+      node->processed_base = node->module->numProcessedInputs() + node->module->numDroppedInputs();
+      if(node->module->isSequential()){
+        node->module->addTo(*runner_);
+        ++num_sequential;
+      }
+    }
+    for(size_t index : order_){
+      nodes_[index]->module->warmup();
+    }
+    // wake the runner when a module on it gets input, instead of waiting for its next poll, and make the input
+    // payloads of a pinned module on its NUMA node
+    for(std::unique_ptr<Edge> &edge : edges_){
+      edge->runner = nodes_[edge->to]->module->isSequential() ? runner_.get() : nullptr;
+      edge->node = nodes_[edge->to]->module->placementNode();
+    }
+    running_ = true;
+    if(num_sequential > 0){
+      runner_->start();
+    }
+    for(std::unique_ptr<Node> &node : nodes_){
+      if(!node->module->isSequential()){
+        ModuleHandle *module = node->module.get();
+        std::atomic_bool *started = &node->started;
+        *started = false;
+        node->thread = std::thread([module, started]{
+          *started = true;
+          module->spin();
+        });
+      }
+    }
+    for(std::unique_ptr<Node> &node : nodes_){
+      while(node->thread.joinable() && !node->started){
+        std::this_thread::yield();
+      }
+    }
+    time_to_ready_ = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+    ready_ = true;
+    LOG(INFO) << "PipelineGraph: started " << nodes_.size() << " modules, " << num_sequential
+              << " of them on the runner, ready in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(time_to_ready_).count() << "us";
+  }
+
+  /**
+   * Shutdown the modules in topological order. A module is shutdown once all its upstream modules are stopped and
+   * it processed everything they sent. Modules without an input queue generate their own inputs and are shutdown
+   * as soon as their turn comes.
+   * @return False if `timeout` expired first. The remaining modules are shutdown anyway, unprocessed payloads are lost.
+   */
+  bool drain(const std::chrono::milliseconds &timeout = std::chrono::milliseconds(10000)){
+    if(!running_) return true;
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    bool drained = true;
+    for(size_t index : order_){
+      Node &node = *nodes_[index];
+      if(drained && node.has_input_queue){
+        while(!isDrained(node)){
+          if(std::chrono::steady_clock::now() >= deadline){
+            LOG(WARNING) << "PipelineGraph: drain timed out on module [" << node.module->moduleId() << "]";
+            drained = false;
+            break;
+          }
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+      }
+      stopNode(node);
+    }
+    finishStop();
+    LOG(INFO) << "PipelineGraph: drain " << (drained ? "finished" : "timed out");
+    return drained;
+  }
+
+  /**
+   * Shutdown all modules now, in topological order, without waiting for queued payloads
+   */
+  void stop(){
+    if(!running_) return;
+    for(size_t index : order_){
+      stopNode(*nodes_[index]);
+    }
+    finishStop();
+    LOG(INFO) << "PipelineGraph: stopped";
+  }
+
+  bool isRunning() const{
+    return running_;
+  }
+
+  /**
+   * Return True once start() warmed up the modules and started their threads, until the graph is stopped
+   */
+  bool isReady() const{
+    return ready_;
+  }
+
+  /**
+   * Return the time the last start() took until the graph was ready
+   */
+  std::chrono::nanoseconds timeToReady() const{
+    return time_to_ready_;
+  }
+
+  /**
+   * The time to ready of the last start() followed by one line per module with its warmup time
+   */
+  std::string readyReport() const{
+    std::string report = "ready in "
+        + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(time_to_ready_).count()) + "us\n";
+    for(size_t index : order_){
+      const ModuleHandle &module = *nodes_[index]->module;
+      report += module.moduleId() + ": warmup "
+          + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(module.warmupTime()).count())
+          + "us\n";
+    }
+    return report;
+  }
+
+  size_t numModules() const{
+    return nodes_.size();
+  }
+
+  size_t numEdges() const{
+    return edges_.size();
+  }
+
+  /**
+   * Give every registered module its entry of `config`, see PipelineModule::setPlacement().
+   * Must be called before start(). Entries of unknown modules are logged and ignored.
+   * @return the number of placed modules
+   */
+  size_t applyPlacement(const PlacementConfig &config){
+    CHECK(!running_) << "PipelineGraph: applyPlacement() must be called before start()";
+    size_t placed = 0;
+    for(const auto &entry : config.entries()){
+      bool found = false;
+      for(std::unique_ptr<Node> &node : nodes_){
+        if(node->module->moduleId() != entry.first) continue;
+        node->module->setPlacement(entry.second.placement, entry.second.prefault_payloads);
+        found = true;
+        ++placed;
+      }
+      LOG_IF(WARNING, !found) << "PipelineGraph: placement of unknown module [" << entry.first << "]";
+    }
+    return placed;
+  }
+
+  /**
+   * The NUMA nodes of the machine followed by one line per module about where it runs
+   */
+  std::string topologyReport(const CpuTopology &topology = CpuTopology::instance()) const{
+    std::string report = topology.describe();
+    for(const std::unique_ptr<Node> &node : nodes_){
+      report += node->module->placementReport(topology) + "\n";
+    }
+    return report;
+  }
+
+private:
+  /**
+   * Type erased access to a module of any payload types
+   */
+  class ModuleHandle {
+  public:
+    virtual ~ModuleHandle() = default;
+    virtual void spin() = 0;
+    virtual void shutdown() = 0;
+    virtual void restart() = 0;
+    virtual std::chrono::nanoseconds warmup() = 0;
+    virtual std::chrono::nanoseconds warmupTime() const = 0;
+    virtual void addTo(PipelineRunner &runner) = 0;
+    virtual bool hasInputPayload() const = 0;
+    virtual bool isWorking() const = 0;
+    virtual bool isSpinning() const = 0;
+    virtual bool isShutdown() const = 0;
+    virtual bool isSequential() const = 0;
+    virtual size_t numWorkers() const = 0;
+    virtual bool preservesOrder() const = 0;
+    virtual uint64_t numProcessedInputs() const = 0;
+    virtual uint64_t numDroppedInputs() const = 0;
+    virtual const std::string& moduleId() const = 0;
+    virtual void setPlacement(const ThreadPlacement &placement, size_t prefault_payloads) = 0;
+    virtual int placementNode() const = 0;
+    virtual std::string placementReport(const CpuTopology &topology) const = 0;
+  };
+
+  template <typename Input, typename Output>
+  class TypedModuleHandle : public ModuleHandle {
+  public:
+    explicit TypedModuleHandle(PipelineModule<Input, Output> &module): module_(module) {}
+    void spin() override { module_.spin(); }
+    void shutdown() override { module_.shutdown(); }
+    void restart() override { module_.restart(); }
+    std::chrono::nanoseconds warmup() override { return module_.warmup(); }
+    std::chrono::nanoseconds warmupTime() const override { return module_.warmupTime(); }
+    void addTo(PipelineRunner &runner) override { runner.addModule(module_); }
+    bool hasInputPayload() const override { return module_.hasInputPayload(); }
+    bool isWorking() const override { return module_.isWorking(); }
+    bool isSpinning() const override { return module_.isSpinning(); }
+    bool isShutdown() const override { return module_.isShutdown(); }
+    bool isSequential() const override { return module_.isSequential(); }
+    size_t numWorkers() const override { return module_.numWorkers(); }
+    bool preservesOrder() const override { return module_.preservesOrder(); }
+    uint64_t numProcessedInputs() const override { return module_.numProcessedInputs(); }
+    uint64_t numDroppedInputs() const override { return module_.numDroppedInputs(); }
+    const std::string& moduleId() const override { return module_.moduleId(); }
+    void setPlacement(const ThreadPlacement &placement, size_t prefault_payloads) override {
+      module_.setPlacement(placement, prefault_payloads);
+    }
+    int placementNode() const override { return module_.placementNode(); }
+    std::string placementReport(const CpuTopology &topology) const override {
+      return module_.placementReport(topology);
+    }
+  private:
+    PipelineModule<Input, Output> &module_;
+  };
+
+  struct Node {
+    Node(): module(), has_input_queue(false), single_producer_input(false), processed_base(0), inputs(), outputs(),
+            thread(), started(false) {}
+    std::unique_ptr<ModuleHandle> module;
+    bool has_input_queue;
+    bool single_producer_input;
+    uint64_t processed_base;
+    std::vector<size_t> inputs;
+    std::vector<size_t> outputs;
+    std::thread thread;
+    // set by the thread of the module before it spins
+    std::atomic_bool started;
+  };
+
+  struct Edge {
+    Edge(size_t from_index, size_t to_index): from(from_index), to(to_index), sent(0), runner(nullptr), node(-1) {}
+    const size_t from;
+    const size_t to;
+    // number of payloads pushed to the downstream input queue since start()
+    std::atomic<uint64_t> sent;
+    // the runner of the downstream module if it is sequential, set by start()
+    std::atomic<PipelineRunner*> runner;
+    // the NUMA node of the downstream module if it is pinned to one, -1 otherwise, set by start()
+    std::atomic_int node;
+  };
+
+  /**
+   * Pushes the outputs of the upstream module of `edge` to the input queue of its downstream module
+   */
+  template <typename Queue, typename Payload>
+  struct EdgeSink {
+    EdgeSink(const std::shared_ptr<Queue> &input_queue, Edge *queue_edge): queue(input_queue), edge(queue_edge) {}
+    bool operator()(const std::shared_ptr<Payload> &output) const{
+      return push(toInputPayload(output, edge->node.load(std::memory_order_relaxed)));
+    }
+    bool operator()(std::shared_ptr<Payload> &&output) const{
+      return push(toInputPayload(std::move(output), edge->node.load(std::memory_order_relaxed)));
+    }
+    bool push(typename PayloadPool<Payload>::UniquePtr input) const{
+      if(!input || !queue->push(std::move(input))) return false;
+      ++edge->sent;
+      PipelineRunner *runner = edge->runner.load(std::memory_order_acquire);
+      if(runner){
+        runner->notifyIfIdle();
+      }
+      return true;
+    }
+    std::shared_ptr<Queue> queue;
+    Edge *edge;
+  };
+
+  // the last output sink gets the payload by move, so its edge moves it when nobody else holds it
+  template <typename Input, typename Output, typename Sink>
+  static void linkOutput(MIMOPipelineModule<Input, Output> &upstream, Sink sink){
+    upstream.registerOutputSink([sink](std::shared_ptr<Output> output){ return sink(std::move(output)); });
+  }
+
+  // the output sink owns the payload, so the edge moves it when nobody else holds it
+  template <typename Input, typename Output, template<typename> class OutputQueueT, typename Sink>
+  static void linkOutput(MISOPipelineModule<Input, Output, OutputQueueT> &upstream, Sink sink){
+    upstream.setOutputSink([sink](std::shared_ptr<Output> output){ return sink(std::move(output)); });
+  }
+
+  template <typename Input, typename Output, template<typename> class InputQueueT>
+  static typename SIMOPipelineModule<Input, Output, InputQueueT>::InputQueueSharedPtr
+  inputQueueOf(SIMOPipelineModule<Input, Output, InputQueueT> &module){
+    return module.inputQueue();
+  }
+
+  template <typename Input, typename Output, template<typename> class InputQueueT,
+      template<typename> class OutputQueueT>
+  static typename SISOPipelineModule<Input, Output, InputQueueT, OutputQueueT>::InputQueueSharedPtr
+  inputQueueOf(SISOPipelineModule<Input, Output, InputQueueT, OutputQueueT> &module){
+    return module.inputQueue();
+  }
+
+  template <typename Input, typename Output, template<typename> class InputQueueT>
+  static bool hasInputQueue(SIMOPipelineModule<Input, Output, InputQueueT> &){
+    return true;
+  }
+
+  template <typename Input, typename Output, template<typename> class InputQueueT,
+      template<typename> class OutputQueueT>
+  static bool hasInputQueue(SISOPipelineModule<Input, Output, InputQueueT, OutputQueueT> &){
+    return true;
+  }
+
+  template <typename Input, typename Output>
+  static bool hasInputQueue(PipelineModule<Input, Output> &){
+    return false;
+  }
+
+  // return the node of `module`, registering it on first use
+  template <typename Module>
+  size_t nodeIndex(Module &module){
+    CHECK(!running_) << "PipelineGraph: modules must be added before start()";
+    using Base = PipelineModule<typename Module::InputType, typename Module::OutputType>;
+    Base &base = module;
+    auto it = node_index_.find(&base);
+    if(it != node_index_.end()) return it->second;
+    std::unique_ptr<Node> node(new Node());
+    node->module.reset(new TypedModuleHandle<typename Module::InputType, typename Module::OutputType>(base));
+    node->has_input_queue = hasInputQueue(module);
+    nodes_.push_back(std::move(node));
+    node_index_[&base] = nodes_.size() - 1;
+    return nodes_.size() - 1;
+  }
+
+  // Kahn's algorithm. Fails if the modules form a cycle, which could never be drained.
+  void computeOrder(){
+    std::vector<size_t> in_degree(nodes_.size(), 0);
+    for(const std::unique_ptr<Edge> &edge : edges_){
+      ++in_degree[edge->to];
+    }
+    order_.clear();
+    for(size_t i = 0; i < nodes_.size(); ++i){
+      if(in_degree[i] == 0) order_.push_back(i);
+    }
+    for(size_t i = 0; i < order_.size(); ++i){
+      for(size_t e : nodes_[order_[i]]->outputs){
+        if(--in_degree[edges_[e]->to] == 0) order_.push_back(edges_[e]->to);
+      }
+    }
+    CHECK_EQ(order_.size(), nodes_.size()) << "PipelineGraph: the modules form a cycle";
+  }
+
+  // all upstream modules are stopped here, so nothing new can arrive. Inputs dropped by the input queue, e.g. expired
+  // ones, are consumed too.
+  bool isDrained(const Node &node) const{
+    uint64_t sent = 0;
+    for(size_t e : node.inputs){
+      sent += edges_[e]->sent;
+    }
+    const uint64_t consumed = node.module->numProcessedInputs() + node.module->numDroppedInputs();
+    return consumed - node.processed_base >= sent
+        && !node.module->hasInputPayload() && !node.module->isWorking();
+  }
+
+  // shutdown a module and wait until its last output is sent
+  void stopNode(Node &node){
+    if(!node.module->isShutdown()){
+      node.module->shutdown();
+    }
+    if(node.thread.joinable()){
+      node.thread.join();
+    }
+    while(node.module->isSpinning()){
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  void finishStop(){
+    for(std::unique_ptr<Edge> &edge : edges_){
+      edge->runner = nullptr;
+    }
+    if(runner_){
+      runner_->stop();
+      runner_.reset();
+    }
+    running_ = false;
+    ready_ = false;
+  }
+
+  const size_t num_runner_threads_;
+  bool running_;
+  std::atomic_bool ready_;
+  std::chrono::nanoseconds time_to_ready_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+  std::map<const void*, size_t> node_index_;
+  std::vector<std::unique_ptr<Edge>> edges_;
+  std::vector<size_t> order_;
+  std::unique_ptr<PipelineRunner> runner_;
+};
+}
+#endif //MODULAR_PIPELINE_PIPELINE_GRAPH_HPP
@@ -1,11 +1,122 @@
 #ifndef MODULAR_PIPELINE_PIPELINE_MODULE_HPP
 #define MODULAR_PIPELINE_PIPELINE_MODULE_HPP
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <glog/logging.h>
 #include "concurrent_queue.hpp"
+#include "event_tracer.hpp"
+#include "module_metrics.hpp"
+#include "payload_pool.hpp"
+#include "spsc_ring_queue.hpp"
+#include "thread_affinity.hpp"
 
 namespace modular_pipeline {
 
+/**
+ * Take up to `max_n` payloads from `queue` and append them to `payloads`.
+ * If `wait` is true, wait for the first payload. Then keep collecting for at most `linger` until `max_n` payloads
+ * are gathered.
+ * @return the number of payloads appended to `payloads`
+ */
+template <typename Queue, typename Payload>
+size_t popPayloadBatch(Queue &queue, std::vector<Payload> &payloads, size_t max_n, bool wait,
+    const std::chrono::microseconds &linger){
+  size_t count = wait ? queue.wait_and_pop_bulk(std::back_inserter(payloads), max_n)
+                      : queue.pop_bulk(std::back_inserter(payloads), max_n);
+  if(count == 0 || linger.count() <= 0) return count;
+  const auto deadline = std::chrono::steady_clock::now() + linger;
+  while(count < max_n){
+    const auto now = std::chrono::steady_clock::now();
+    if(now >= deadline) break;
+    size_t popped = queue.wait_and_pop_bulk(std::back_inserter(payloads), max_n - count, deadline - now);
+    if(popped == 0) break;
+    count += popped;
+  }
+  return count;
+}
+
+/**
+ * Call `queue.reserve(n)` if the queue type has it, e.g. to allocate a ConcurrentQueue buffer on the NUMA node of
+ * its consumer. Return False for queues that allocate their buffer in their constructor, they can only be placed by
+ * constructing them on the node, see PipelineGraph::makeInputQueueOn().
+ */
+template <typename Queue>
+auto reserveQueue(Queue &queue, size_t n, int) -> decltype(queue.reserve(n), bool()){
+  queue.reserve(n);
+  return true;
+}
+
+template <typename Queue>
+bool reserveQueue(Queue &, size_t, long){
+  return false;
+}
+
+/**
+ * Call `queue.setTraceName(name)` if the queue type has it, so its events in a trace are named after the module
+ */
+template <typename Queue>
+auto setQueueTraceName(Queue &queue, const std::string &name, int) -> decltype(queue.setTraceName(name), void()){
+  queue.setTraceName(name);
+}
+
+template <typename Queue>
+void setQueueTraceName(Queue &, const std::string &, long){}
+
+/**
+ * Return `queue.numExpired()` if the queue type has it, e.g. the inputs a PriorityConcurrentQueue dropped because
+ * their deadline passed. Other queues never drop an input.
+ */
+template <typename Queue>
+auto numExpiredInQueue(const Queue &queue, int) -> decltype(queue.numExpired(), uint64_t()){
+  return queue.numExpired();
+}
+
+template <typename Queue>
+uint64_t numExpiredInQueue(const Queue &, long){
+  return 0;
+}
+
+/**
+ * True for queue types that allow only one producer thread, so they can't be the input of a fan-in edge or the
+ * output queue of a module with several workers.
+ */
+template <typename Queue>
+struct IsSingleProducerQueue : std::false_type {};
+
+template <typename T, size_t Capacity>
+struct IsSingleProducerQueue<concurrent_queue::SpscRingQueue<T, Capacity>> : std::true_type {};
+
+/**
+ * True for queue types that allow only one consumer thread, so they can't be the input queue of a module with several
+ * unordered workers.
+ */
+template <typename Queue>
+struct IsSingleConsumerQueue : std::false_type {};
+
+template <typename T, size_t Capacity>
+struct IsSingleConsumerQueue<concurrent_queue::SpscRingQueue<T, Capacity>> : std::true_type {};
+
+/**
+ * What to do with an output when the queue of an asynchronous subscriber is full
+ */
+enum class OverflowPolicy {
+  Block,      // wait for free space, which slows down the module
+  DropOldest, // drop the oldest queued output of the subscriber
+  DropNewest  // drop the new output
+};
+
 /**
  * This is an abstract class of a PipeLine module. Template on expected input and expected output payloads.
  * This class handles spinning the module by getting and sending from/to the input/output.
@@ -14,44 +125,243 @@ namespace modular_pipeline {
 template <typename Input, typename Output>
 class PipelineModule {
 public:
-  using InputUniquePtr = std::unique_ptr<Input>;
+  using InputType = Input;
+  using OutputType = Output;
+  // a std::unique_ptr<Input> converts to it. Payloads from makeInputPayload() go back to their pool.
+  using InputUniquePtr = std::unique_ptr<Input, PayloadDeleter<Input>>;
   using OutputSharedPtr = std::shared_ptr<Output>;
+  using WarmupInputFn = std::function<InputUniquePtr()>;
 
   PipelineModule(const std::string &module_id, const bool &sequential_mode)
-  : shutdown_(false), module_id_(module_id), sequential_mode_(sequential_mode) {};
+  : working_workers_(0), spinning_workers_(0), processed_inputs_(0), shutdown_(false), module_id_(module_id), sequential_mode_(sequential_mode),
+    max_batch_size_(1), batch_limit_(1), max_batch_linger_(0), num_workers_(1), preserve_order_(false),
+    input_filter_(),
+    placement_(), prefault_payloads_(0), pinned_workers_(0), failed_pins_(0),
+    trace_name_(concurrent_queue::traceName(module_id)),
+    warmup_queue_depth_(0), warmup_inputs_(0), make_warmup_input_(), warmup_time_(0),
+    next_input_sequence_(0), next_output_sequence_(0) {};
   virtual ~PipelineModule() {
     LOG(INFO) << logPrefix() << "destructor called!";
   }
 
   /**
    * The spin() function will be called by a thread. Run until the module is shutdown.
+   * If batching is enabled with setBatching(), inputs are processed in batches by spinBatch().
+   * If parallelism is enabled with setParallelism(), spin() starts the extra worker threads and joins them before
+   * it returns.
    */
   void spin(){
-    while(!shutdown_){
-      InputUniquePtr input = prepareInputPayload();
-      if(input){
-        OutputSharedPtr output = spinOnce(std::move(input));
-        if(output){
-          if(sendOutputPayload(output)){
-            VLOG(2) << logPrefix() << "sent output!";
-          } else {
-            LOG(WARNING) << logPrefix() << "send output failed!";
-          }
-        } else {
-          LOG_IF(WARNING, VLOG_IS_ON(1))
-          << logPrefix() << "No output payload";
-          // TODO: call failure callbacks to notify other modules
-        }
-      } else {
-        LOG_IF(WARNING, VLOG_IS_ON(1))
-          << logPrefix() << "No input payload";
+    if(num_workers_ > 1 && !sequential_mode_){
+      std::vector<std::thread> helpers;
+      helpers.reserve(num_workers_ - 1);
+      for(size_t i = 1; i < num_workers_; ++i){
+        helpers.emplace_back(&PipelineModule::spinWorker, this);
+      }
+      spinWorker();
+      for(std::thread &helper : helpers){
+        helper.join();
       }
+      return;
+    }
+    spinWorker();
+  }
 
-      // Break the while loop if we are in the sequential mode
-      if(sequential_mode_){
-        return;
+  /**
+   * Opt in to micro-batching. spin() then gathers up to `max_batch_size` inputs, waiting at most `max_linger` after
+   * the first one, and hands them to spinBatch(). The outputs are sent with one sendOutputPayloads() call.
+   * Must be called before spin() is started. A `max_batch_size` of 1 disables batching.
+   */
+  void setBatching(size_t max_batch_size, const std::chrono::microseconds &max_linger){
+    CHECK_GT(max_batch_size, 0u) << logPrefix() << "max_batch_size must be positive";
+    max_batch_size_ = max_batch_size;
+    batch_limit_ = max_batch_size;
+    max_batch_linger_ = max_linger;
+  }
+
+  /**
+   * Change the number of inputs a batch takes at most while the module runs, between 1 and the `max_batch_size` of
+   * setBatching(), e.g. small batches for low latency when idle and large ones to catch up with a backlog.
+   */
+  void setBatchLimit(size_t batch_limit){
+    batch_limit_.store(std::max<size_t>(1, std::min(batch_limit, max_batch_size_)), std::memory_order_relaxed);
+  }
+
+  inline size_t batchLimit() const{
+    return batch_limit_.load(std::memory_order_relaxed);
+  }
+
+  inline size_t maxBatchSize() const{
+    return max_batch_size_;
+  }
+
+  /**
+   * Shed inputs for which `filter` returns False: they are dropped before spinOnce() and counted as shed inputs,
+   * e.g. by a LoadShedder when the module is overloaded. `filter` may be called from several threads at once.
+   * It replaces the filter installed before, if any, see addInputFilter().
+   * Must be called before spin() is started.
+   */
+  void setInputFilter(const std::function<bool(const Input &input)> &filter){
+    input_filter_ = filter;
+  }
+
+  /**
+   * Same as setInputFilter(), but an input must pass the filter installed before as well. `filter` only sees the
+   * inputs the earlier filter admitted. Must be called before spin() is started.
+   */
+  void addInputFilter(const std::function<bool(const Input &input)> &filter){
+    if(!input_filter_){
+      input_filter_ = filter;
+      return;
+    }
+    std::function<bool(const Input &input)> previous = std::move(input_filter_);
+    input_filter_ = [previous, filter](const Input &input){
+      return previous(input) && filter(input);
+    };
+  }
+
+  /**
+   * Run `num_workers` threads that pull from the same input and call spinOnce() concurrently.
+   * Only for stateless modules: spinOnce(), prepareInputPayload() and sendOutputPayload() are called from several
+   * threads at once, so the input queue must allow multiple consumers (not SpscRingQueue). The output queue and the
+   * output callbacks must allow multiple producers as well, unless `preserve_order` is true.
+   * If `preserve_order` is true, inputs are numbered when they are taken and outputs are sent in that order.
+   * Taking inputs and sending are then serialized, so single consumer and single producer queues are allowed.
+   * Several unordered workers with an SpscRingQueue on either side fail a CHECK.
+   * Must be called before spin() is started.
+   */
+  void setParallelism(size_t num_workers, bool preserve_order = false){
+    CHECK_GT(num_workers, 0u) << logPrefix() << "num_workers must be positive";
+    CHECK(num_workers == 1 || preserve_order || !hasSingleProducerOutput())
+      << logPrefix() << "several workers can't send to a single producer output queue without preserve_order";
+    CHECK(num_workers == 1 || preserve_order || !hasSingleConsumerInput())
+      << logPrefix() << "several workers can't take from a single consumer input queue without preserve_order";
+    num_workers_ = num_workers;
+    preserve_order_ = preserve_order;
+  }
+
+  /**
+   * Pin the threads of spin() to `placement`, e.g. the cores of one socket. The first pinned thread then prefaults
+   * `prefault_payloads` input and output payloads in the pools of its NUMA node and reserves as much room in the input
+   * queue, so they are allocated on the node of this module instead of the node of its producer. PipelineGraph edges
+   * into the module take its input payloads from the pool of that node, see placementNode().
+   * Queue types without reserve(), e.g. MpmcQueue and SpscRingQueue, allocate their buffer when they are constructed:
+   * create them with PipelineGraph::makeInputQueueOn() to place them, a warning is logged otherwise.
+   * Sequential modules are not pinned, their thread belongs to the caller of spin(), e.g. a PipelineRunner.
+   * Must be called before spin() is started.
+   */
+  void setPlacement(const ThreadPlacement &placement, size_t prefault_payloads = 0){
+    placement_ = placement;
+    prefault_payloads_ = prefault_payloads;
+  }
+
+  inline const ThreadPlacement& placement() const{
+    return placement_;
+  }
+
+  /**
+   * Return the NUMA node the threads of spin() are pinned to, -1 if they are not pinned or the placement spans
+   * several nodes
+   */
+  int placementNode(const CpuTopology &topology = CpuTopology::instance()) const{
+    if(sequential_mode_ || placement_.empty()) return -1;
+    int node = -1;
+    for(int cpu : placement_.resolve(topology)){
+      const int cpu_node = topology.nodeOfCpu(cpu);
+      if(cpu_node < 0 || (node >= 0 && cpu_node != node)) return -1;
+      node = cpu_node;
+    }
+    return node;
+  }
+
+  /**
+   * Return the number of threads of spin() that were pinned to the placement
+   */
+  inline size_t numPinnedWorkers() const{
+    return pinned_workers_;
+  }
+
+  /**
+   * One line about where the module runs, e.g. "decoder: node=1 -> cpus 8-15 (node 1), 2 threads pinned"
+   */
+  std::string placementReport(const CpuTopology &topology = CpuTopology::instance()) const{
+    std::string report = module_id_ + ": " + placement_.toString();
+    if(placement_.empty()) return report + ", not pinned";
+    const std::vector<int> cpus = placement_.resolve(topology);
+    std::set<int> nodes;
+    for(int cpu : cpus){
+      nodes.insert(topology.nodeOfCpu(cpu));
+    }
+    report += " -> cpus " + CpuTopology::formatCpuList(cpus) + " (node";
+    for(int node : nodes){
+      report += " " + std::to_string(node);
+    }
+    report += ")";
+    if(sequential_mode_) return report + ", sequential module, not pinned";
+    report += ", " + std::to_string(pinned_workers_) + " threads pinned";
+    if(failed_pins_ > 0) report += ", " + std::to_string(failed_pins_) + " failed";
+    return report;
+  }
+
+  /**
+   * Get the module ready for traffic in warmup(), so the first real inputs don't pay for cold allocators, page faults
+   * and lazily initialized state. warmup() reserves room for `queue_depth` inputs in the input queue and prefaults
+   * `queue_depth` input and output payloads in their pools. Then it runs `synthetic_inputs` inputs made by
+   * `make_input` through spinOnce(), or spinBatch() in batching mode. Their outputs are dropped and they are not
+   * counted in the metrics, so spinOnce() must have no side effect other than its output for them.
+   * Must be called before spin() is started.
+   */
+  void setWarmup(size_t queue_depth, size_t synthetic_inputs = 0, const WarmupInputFn &make_input = nullptr){
+    warmup_queue_depth_ = queue_depth;
+    warmup_inputs_ = make_input ? synthetic_inputs : 0;
+    make_warmup_input_ = make_input;
+  }
+
+  /**
+   * Run the warmup of setWarmup() on the calling thread, e.g. before the threads of spin() are started.
+   * A module pinned by setPlacement() prefaults its pools and its input queue on its own thread instead, so they land
+   * on its NUMA node.
+   * @return the time it took
+   */
+  std::chrono::nanoseconds warmup(){
+    CHECK(!isSpinning()) << logPrefix() << "warmup() must be called before spin()";
+    warmup_time_ = std::chrono::nanoseconds(0);
+    if(warmup_queue_depth_ == 0 && warmup_inputs_ == 0) return warmup_time_;
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    if(warmup_queue_depth_ > 0 && (sequential_mode_ || placement_.empty())){
+      PayloadPool<Input>::reserve(warmup_queue_depth_);
+      PayloadPool<Output>::reserveShared(warmup_queue_depth_);
+      reserveInputQueue(warmup_queue_depth_);
+    }
+    std::vector<InputUniquePtr> inputs;
+    std::vector<OutputSharedPtr> outputs;
+    for(size_t i = 0; i < warmup_inputs_;){
+      const size_t batch_size = std::min(batchLimit(), warmup_inputs_ - i);
+      for(size_t n = 0; n < batch_size; ++n){
+        InputUniquePtr input = make_warmup_input_();
+        if(input) inputs.push_back(std::move(input));
+      }
+      i += batch_size;
+      if(inputs.empty()) continue;
+      if(max_batch_size_ > 1){
+        spinBatch(inputs, outputs);
+      } else {
+        outputs.push_back(spinOnce(std::move(inputs.front())));
       }
+      inputs.clear();
+      outputs.clear();
     }
+    warmup_time_ = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+    LOG(INFO) << logPrefix() << "warmed up in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(warmup_time_).count() << "us, "
+              << warmup_inputs_ << " synthetic inputs";
+    return warmup_time_;
+  }
+
+  /**
+   * Return the time the last warmup() took
+   */
+  inline std::chrono::nanoseconds warmupTime() const{
+    return warmup_time_;
   }
 
   /**
@@ -65,11 +375,120 @@ public:
     LOG(INFO) << logPrefix() << "shutdown finished!";
   }
 
+  /**
+   * Restart the queues of a module that was shutdown, so spin() can be called again
+   */
+  virtual void restart(){
+    LOG_IF(WARNING, !shutdown_) << logPrefix() << "restart() is called on a running module.";
+    restartQueues();
+    shutdown_ = false;
+    LOG(INFO) << logPrefix() << "restart finished!";
+  }
+
   /**
    * Return True if the module is processing data. False if waiting for input.
    */
   virtual inline bool isWorking() const{
-    return is_working_;
+    return working_workers_ > 0;
+  }
+
+  /**
+   * Return True if prepareInputPayload() has something to work on. Schedulers use this to skip idle modules.
+   * By default True, e.g. for modules that generate their own inputs. Modules with an input queue check the queue.
+   */
+  virtual bool hasInputPayload() const{
+    return true;
+  }
+
+  /**
+   * Return True if spin() runs a single step per call
+   */
+  inline bool isSequential() const{
+    return sequential_mode_;
+  }
+
+  /**
+   * Return True if shutdown() was called
+   */
+  inline bool isShutdown() const{
+    return shutdown_;
+  }
+
+  inline const std::string& moduleId() const{
+    return module_id_;
+  }
+
+  /**
+   * Return the number of threads that spin() runs on
+   */
+  inline size_t numWorkers() const{
+    return num_workers_;
+  }
+
+  /**
+   * Return True if the workers of spin() send their outputs one at a time, in input order, see setParallelism()
+   */
+  inline bool preservesOrder() const{
+    return preserve_order_;
+  }
+
+  /**
+   * Return True while a thread is inside spin()
+   */
+  inline bool isSpinning() const{
+    return spinning_workers_ > 0;
+  }
+
+  /**
+   * Return the number of inputs whose outputs have been sent
+   */
+  inline uint64_t numProcessedInputs() const{
+    return processed_inputs_;
+  }
+
+  /**
+   * Create an input payload from the payload pool of `Input`, without a system allocation in steady state
+   */
+  template <typename... Args>
+  static InputUniquePtr makeInputPayload(Args&&... args){
+    return PayloadPool<Input>::makeUnique(std::forward<Args>(args)...);
+  }
+
+  /**
+   * Create an output payload, and its shared_ptr control block, from a payload pool
+   */
+  template <typename... Args>
+  static OutputSharedPtr makeOutputPayload(Args&&... args){
+    return PayloadPool<Output>::makeShared(std::forward<Args>(args)...);
+  }
+
+  /**
+   * Return the number of inputs waiting in the input queue. 0 for modules without an input queue.
+   */
+  virtual size_t inputQueueSize() const{
+    return 0;
+  }
+
+  /**
+   * Return the number of inputs the input queue dropped before they were popped, e.g. expired inputs of a
+   * PriorityConcurrentQueue. They are consumed without being processed. 0 for modules without an input queue.
+   */
+  virtual uint64_t numDroppedInputs() const{
+    return 0;
+  }
+
+  /**
+   * Return the counters and histograms of the module, e.g. to reset them or to disable timing
+   */
+  ModuleMetrics& metrics(){
+    return metrics_;
+  }
+
+  /**
+   * Return a copy of the metrics of the module. Cheap enough to call periodically from another thread.
+   */
+  ModuleMetricsSnapshot metricsSnapshot() const{
+    return metrics_.snapshot(module_id_, inputQueueSize());
   }
 protected:
   /**
@@ -77,6 +496,22 @@ protected:
    */
   virtual InputUniquePtr prepareInputPayload() = 0;
 
+  /**
+   * function to prepare up to `max_n` input payloads at once and append them to `inputs`.
+   * By default this calls prepareInputPayload() once. Modules with an input queue override it to take several
+   * inputs from the queue in a single critical section and keep collecting for at most `linger`.
+   * @return the number of input payloads appended to `inputs`
+   */
+  virtual size_t prepareInputPayloads(std::vector<InputUniquePtr> &inputs, size_t max_n,
+      const std::chrono::microseconds &linger){
+    (void) linger;
+    if(max_n == 0) return 0;
+    InputUniquePtr input = prepareInputPayload();
+    if(!input) return 0;
+    inputs.push_back(std::move(input));
+    return 1;
+  }
+
   /**
    * abstract function to handle the input pointer and return the output pointer
    * @param input: an input payload unique ptr created by prepareInputPayload
@@ -89,20 +524,401 @@ protected:
    */
   virtual bool sendOutputPayload(OutputSharedPtr output) = 0;
 
+  /**
+   * function to handle a batch of inputs in batching mode. Append the outputs to `outputs`.
+   * By default this calls spinOnce() for every input. Override it for stages that are faster on whole batches.
+   */
+  virtual void spinBatch(std::vector<InputUniquePtr> &inputs, std::vector<OutputSharedPtr> &outputs){
+    for(InputUniquePtr &input : inputs){
+      OutputSharedPtr output = spinOnce(std::move(input));
+      if(output){
+        outputs.push_back(std::move(output));
+      } else {
+        LOG_IF(WARNING, VLOG_IS_ON(1))
+          << logPrefix() << "No output payload";
+      }
+    }
+  }
+
+  /**
+   * function to send all outputs of a batch. The outputs may be moved from.
+   * By default this calls sendOutputPayload() for every output.
+   */
+  virtual bool sendOutputPayloads(std::vector<OutputSharedPtr> &outputs){
+    bool success = true;
+    for(OutputSharedPtr &output : outputs){
+      success = sendOutputPayload(std::move(output)) && success;
+    }
+    return success;
+  }
+
   /**
    * abstract function to shutdown all the input and output queues if needed.
    */
   virtual void shutdownQueues() = 0;
 
+  /**
+   * function to restart all the input and output queues after shutdownQueues(). Does nothing by default.
+   */
+  virtual void restartQueues() {};
+
+  /**
+   * function to reserve room for `n` inputs in the input queue, called on a pinned thread. Does nothing by default.
+   * Return False if the input queue type has nothing to reserve, so its buffer stays where it was constructed.
+   */
+  virtual bool reserveInputQueue(size_t n) { (void) n; return true; };
+
+  /**
+   * Return True if the outputs go to a queue that allows only one producer thread
+   */
+  virtual bool hasSingleProducerOutput() const { return false; }
+
+  /**
+   * Return True if the inputs come from a queue that allows only one consumer thread
+   */
+  virtual bool hasSingleConsumerInput() const { return false; }
+
   virtual inline std::string logPrefix(){
     return "Module [" + module_id_  + "]: ";
   }
 
+  /**
+   * spin() loop of a single worker thread
+   */
+  void spinWorker(){
+    if(!sequential_mode_ && !placement_.empty()){
+      applyPlacement();
+    }
+    concurrent_queue::traceThreadName(module_id_);
+    ++spinning_workers_;
+    if(max_batch_size_ > 1){
+      spinBatches();
+    } else {
+      spinSingles();
+    }
+    --spinning_workers_;
+  }
+
+  /**
+   * spin() loop that handles one input per iteration
+   */
+  void spinSingles(){
+    while(!shutdown_){
+      uint64_t sequence = 0;
+      uint64_t lap = metrics_.startLap();
+      uint64_t trace_begin = concurrent_queue::traceBegin();
+      InputUniquePtr input = preserve_order_ ? prepareOrderedInputPayload(sequence) : prepareInputPayload();
+      lap = metrics_.recordLap(ModuleMetrics::Stage::Prepare, lap);
+      if(input){
+        const uint64_t message_id = traceInput(*input);
+        concurrent_queue::traceComplete(concurrent_queue::TraceKind::Prepare, trace_name_, message_id, trace_begin);
+        countInputs(1);
+        const bool shed = !admitInput(*input);
+        trace_begin = concurrent_queue::traceBegin();
+        ++working_workers_;
+        OutputSharedPtr output = shed ? nullptr : spinOnce(std::move(input));
+        --working_workers_;
+        lap = metrics_.recordLap(ModuleMetrics::Stage::Spin, lap);
+        concurrent_queue::traceComplete(concurrent_queue::TraceKind::Spin, trace_name_, message_id, trace_begin);
+        if(output){
+          traceOutput(*output, message_id);
+        }
+        trace_begin = concurrent_queue::traceBegin();
+        if(!output && !shed){
+          metrics_.add(ModuleMetrics::Counter::DroppedOutputs);
+        }
+        if(preserve_order_){
+          std::vector<OutputSharedPtr> outputs;
+          if(output){
+            outputs.push_back(std::move(output));
+          }
+          publishInOrder(sequence, 1, outputs);
+        } else {
+          if(output){
+            if(sendOutputPayload(std::move(output))){
+              metrics_.add(ModuleMetrics::Counter::Outputs);
+              VLOG(2) << logPrefix() << "sent output!";
+            } else {
+              metrics_.add(ModuleMetrics::Counter::FailedSends);
+              LOG(WARNING) << logPrefix() << "send output failed!";
+            }
+          } else {
+            LOG_IF(WARNING, VLOG_IS_ON(1))
+            << logPrefix() << "No output payload";
+            // TODO: call failure callbacks to notify other modules
+          }
+          ++processed_inputs_;
+        }
+        metrics_.recordLap(ModuleMetrics::Stage::Send, lap);
+        concurrent_queue::traceComplete(concurrent_queue::TraceKind::Send, trace_name_, message_id, trace_begin);
+      } else {
+        LOG_IF(WARNING, VLOG_IS_ON(1))
+          << logPrefix() << "No input payload";
+      }
+
+      // Break the while loop if we are in the sequential mode
+      if(sequential_mode_){
+        return;
+      }
+    }
+  }
+
+  /**
+   * spin() loop of the batching mode
+   */
+  void spinBatches(){
+    std::vector<InputUniquePtr> inputs;
+    std::vector<OutputSharedPtr> outputs;
+    inputs.reserve(max_batch_size_);
+    outputs.reserve(max_batch_size_);
+    std::vector<InputUniquePtr> admitted;
+    std::vector<uint64_t> message_ids;
+    while(!shutdown_){
+      inputs.clear();
+      outputs.clear();
+      uint64_t sequence = 0;
+      uint64_t lap = metrics_.startLap();
+      uint64_t trace_begin = concurrent_queue::traceBegin();
+      size_t num_inputs = preserve_order_ ? prepareOrderedInputPayloads(inputs, sequence)
+                                          : prepareInputPayloads(inputs, batchLimit(), max_batch_linger_);
+      lap = metrics_.recordLap(ModuleMetrics::Stage::Prepare, lap);
+      if(num_inputs > 0){
+        countInputs(num_inputs);
+        const size_t num_admitted = input_filter_ ? shedInputs(inputs, admitted) : num_inputs;
+        const uint64_t message_id = traceInputs(inputs, message_ids);
+        concurrent_queue::traceComplete(concurrent_queue::TraceKind::Prepare, trace_name_, message_id, trace_begin);
+        trace_begin = concurrent_queue::traceBegin();
+        ++working_workers_;
+        if(num_admitted > 0){
+          spinBatch(inputs, outputs);
+        }
+        --working_workers_;
+        lap = metrics_.recordLap(ModuleMetrics::Stage::Spin, lap);
+        concurrent_queue::traceComplete(concurrent_queue::TraceKind::Spin, trace_name_, message_id, trace_begin);
+        traceOutputs(outputs, message_ids);
+        trace_begin = concurrent_queue::traceBegin();
+        if(outputs.size() < num_admitted){
+          metrics_.add(ModuleMetrics::Counter::DroppedOutputs, num_admitted - outputs.size());
+        }
+        if(preserve_order_){
+          publishInOrder(sequence, num_inputs, outputs);
+        } else {
+          publishOutputs(outputs);
+          processed_inputs_ += num_inputs;
+        }
+        metrics_.recordLap(ModuleMetrics::Stage::Send, lap);
+        concurrent_queue::traceComplete(concurrent_queue::TraceKind::Send, trace_name_, message_id, trace_begin);
+      } else {
+        LOG_IF(WARNING, VLOG_IS_ON(1))
+          << logPrefix() << "No input payload";
+      }
+
+      // Break the while loop if we are in the sequential mode
+      if(sequential_mode_){
+        return;
+      }
+    }
+  }
+
+  /**
+   * pin the calling thread. The first pinned thread prefaults the payload pools and the input queue buffer on its NUMA
+   * node.
+   */
+  void applyPlacement(){
+    if(!pinCurrentThread(placement_)){
+      ++failed_pins_;
+      return;
+    }
+    ++pinned_workers_;
+    std::call_once(memory_placed_, [this]{
+      const size_t num_inputs = std::max(prefault_payloads_, warmup_queue_depth_);
+      if(num_inputs == 0) return;
+      PayloadPool<Input>::reserve(num_inputs);
+      PayloadPool<Output>::reserveShared(num_inputs);
+      LOG_IF(WARNING, !reserveInputQueue(num_inputs))
+        << logPrefix() << "the input queue type has no reserve(), its buffer is on the node it was constructed on. "
+        << "Unless it was created with PipelineGraph::makeInputQueueOn(), it is not placed.";
+    });
+  }
+
+  /**
+   * Return the trace id of the input, and give it a new one if it has none. Return 0 when tracing is off.
+   */
+  uint64_t traceInput(Input &input){
+    if(!concurrent_queue::tracingEnabled()) return 0;
+    uint64_t message_id = concurrent_queue::traceMessageId(input, 0);
+    if(message_id == 0){
+      message_id = concurrent_queue::traceNextMessageId();
+      concurrent_queue::setTraceMessageId(input, message_id, 0);
+    }
+    return message_id;
+  }
+
+  /**
+   * Give every input of a batch its trace id, see traceInput(), and keep them in `message_ids` in input order.
+   * @return the id of the first input, which tags the events of the whole batch
+   */
+  uint64_t traceInputs(std::vector<InputUniquePtr> &inputs, std::vector<uint64_t> &message_ids){
+    message_ids.clear();
+    if(!concurrent_queue::tracingEnabled()) return 0;
+    for(InputUniquePtr &input : inputs){
+      message_ids.push_back(traceInput(*input));
+    }
+    return message_ids.empty() ? 0 : message_ids.front();
+  }
+
+  /**
+   * Let every output of a batch carry the trace id of its own input. If spinBatch() dropped inputs, the outputs
+   * can't be matched with their inputs and keep the ids spinBatch() gave them.
+   */
+  void traceOutputs(std::vector<OutputSharedPtr> &outputs, const std::vector<uint64_t> &message_ids){
+    if(outputs.size() != message_ids.size()) return;
+    for(size_t i = 0; i < outputs.size(); ++i){
+      traceOutput(*outputs[i], message_ids[i]);
+    }
+  }
+
+  /**
+   * Let the output carry the trace id of its input, unless spinOnce() already set one
+   */
+  void traceOutput(Output &output, uint64_t message_id){
+    if(message_id != 0 && concurrent_queue::traceMessageId(output, 0) == 0){
+      concurrent_queue::setTraceMessageId(output, message_id, 0);
+    }
+  }
+
+  /**
+   * Return False and count the input as shed if the input filter rejects it
+   */
+  bool admitInput(const Input &input){
+    if(!input_filter_ || input_filter_(input)) return true;
+    metrics_.add(ModuleMetrics::Counter::ShedInputs);
+    return false;
+  }
+
+  /**
+   * remove the inputs rejected by the input filter from `inputs`. `admitted` is scratch space.
+   * @return the number of inputs left
+   */
+  size_t shedInputs(std::vector<InputUniquePtr> &inputs, std::vector<InputUniquePtr> &admitted){
+    admitted.clear();
+    for(InputUniquePtr &input : inputs){
+      if(admitInput(*input)){
+        admitted.push_back(std::move(input));
+      }
+    }
+    inputs.swap(admitted);
+    return inputs.size();
+  }
+
+  /**
+   * take one input and number it, so the order preserving mode can send its output in input order
+   */
+  InputUniquePtr prepareOrderedInputPayload(uint64_t &sequence){
+    std::lock_guard<std::mutex> lk(input_mutex_);
+    InputUniquePtr input = prepareInputPayload();
+    if(input){
+      sequence = next_input_sequence_++;
+    }
+    return input;
+  }
+
+  /**
+   * take one batch of inputs and number it, so the order preserving mode can send its outputs in input order
+   */
+  size_t prepareOrderedInputPayloads(std::vector<InputUniquePtr> &inputs, uint64_t &sequence){
+    std::lock_guard<std::mutex> lk(input_mutex_);
+    size_t num_inputs = prepareInputPayloads(inputs, batchLimit(), max_batch_linger_);
+    if(num_inputs > 0){
+      sequence = next_input_sequence_++;
+    }
+    return num_inputs;
+  }
+
+  void publishOutputs(std::vector<OutputSharedPtr> &outputs){
+    if(outputs.empty()) return;
+    if(sendOutputPayloads(outputs)){
+      metrics_.add(ModuleMetrics::Counter::Outputs, outputs.size());
+      VLOG(2) << logPrefix() << "sent " << outputs.size() << " outputs!";
+    } else {
+      metrics_.add(ModuleMetrics::Counter::FailedSends, outputs.size());
+      LOG(WARNING) << logPrefix() << "send outputs failed!";
+    }
+  }
+
+  void countInputs(size_t num_inputs){
+    const uint64_t before = metrics_.add(ModuleMetrics::Counter::Inputs, num_inputs);
+    // sample the queue depth once every 64 inputs of a thread: size() reads counters the producers keep writing, so
+    // reading it on every input would pull their cache lines to this worker
+    if((before >> 6) != ((before + num_inputs) >> 6)){
+      metrics_.updateQueueDepth(inputQueueSize());
+    }
+  }
+
+  /**
+   * hand over the outputs of work item number `sequence`, made of `num_inputs` inputs. Send them, and every buffered
+   * output that follows them, once all earlier work items are sent.
+   */
+  void publishInOrder(uint64_t sequence, size_t num_inputs, std::vector<OutputSharedPtr> &outputs){
+    std::lock_guard<std::mutex> lk(reorder_mutex_);
+    if(sequence != next_output_sequence_){
+      ReorderEntry &entry = reorder_buffer_[sequence];
+      entry.first = num_inputs;
+      entry.second.swap(outputs);
+      return;
+    }
+    publishOutputs(outputs);
+    processed_inputs_ += num_inputs;
+    ++next_output_sequence_;
+    auto it = reorder_buffer_.begin();
+    while(it != reorder_buffer_.end() && it->first == next_output_sequence_){
+      publishOutputs(it->second.second);
+      processed_inputs_ += it->second.first;
+      it = reorder_buffer_.erase(it);
+      ++next_output_sequence_;
+    }
+  }
+
 protected:
-  std::atomic_bool is_working_;
+  // number of inputs and outputs of one work item in the order preserving mode
+  using ReorderEntry = std::pair<size_t, std::vector<OutputSharedPtr>>;
+
+  std::atomic<size_t> working_workers_;
+  std::atomic<size_t> spinning_workers_;
+  std::atomic<uint64_t> processed_inputs_;
   std::atomic_bool shutdown_;
   std::string module_id_;
   bool sequential_mode_;
+  size_t max_batch_size_;
+  // current limit of the batch size, at most max_batch_size_
+  std::atomic<size_t> batch_limit_;
+  std::chrono::microseconds max_batch_linger_;
+  size_t num_workers_;
+  bool preserve_order_;
+  std::function<bool(const Input &input)> input_filter_;
+
+  // thread and memory placement
+  ThreadPlacement placement_;
+  size_t prefault_payloads_;
+  std::atomic<size_t> pinned_workers_;
+  std::atomic<size_t> failed_pins_;
+  std::once_flag memory_placed_;
+  // interned module id in traces
+  uint32_t trace_name_;
+
+  // warmup
+  size_t warmup_queue_depth_;
+  size_t warmup_inputs_;
+  WarmupInputFn make_warmup_input_;
+  std::chrono::nanoseconds warmup_time_;
+
+  // order preserving mode
+  std::mutex input_mutex_;
+  uint64_t next_input_sequence_;
+  std::mutex reorder_mutex_;
+  uint64_t next_output_sequence_;
+  std::map<uint64_t, ReorderEntry> reorder_buffer_;
+  ModuleMetrics metrics_;
 };
 
 /**
@@ -122,9 +938,15 @@ class MIMOPipelineModule : public PipelineModule<Input, Output> {
 public:
   using PIO = PipelineModule<Input, Output>;
   using OutputCallback = std::function<void(const typename PIO::OutputSharedPtr & output)>;
+  using OutputSink = std::function<bool(typename PIO::OutputSharedPtr output)>;
 
   MIMOPipelineModule(const std::string &module_id, const bool &sequential_mode)
-    : PipelineModule<Input, Output>(module_id, sequential_mode), output_callbacks_(){}
+    : PipelineModule<Input, Output>(module_id, sequential_mode), output_callbacks_(), async_subscribers_(),
+      output_sinks_(){}
+
+  virtual ~MIMOPipelineModule(){
+    stopAsyncSubscribers();
+  }
 
   /**
    * Register a output callback to receive the output payload.
@@ -134,6 +956,43 @@ public:
      CHECK(callback) << "callback can't be nullptr";
      output_callbacks_.push_back(callback);
    }
+
+  /**
+   * Register a sink that takes the output, e.g. an edge of a PipelineGraph. Sinks are called after the callbacks
+   * and the asynchronous subscribers, and the last sink gets the module's reference by move, so it can take the
+   * payload without a copy when nobody else holds it. Return False if the output could not be sent.
+   */
+  virtual void registerOutputSink(const OutputSink &sink){
+    CHECK(sink) << "sink can't be nullptr";
+    output_sinks_.push_back(sink);
+  }
+
+  /**
+   * Register a output callback that runs on its own thread.
+   * sendOutputPayload only pushes the output pointer to a bounded queue of `capacity` outputs, so a slow subscriber
+   * doesn't slow down the module or the other subscribers. All subscribers share the same payload without copying
+   * it, so they must not modify it. `policy` decides what happens when the queue is full.
+   * Outputs that are still queued at shutdown are delivered before shutdown() returns.
+   * @return the subscriber index, e.g. for numDroppedOutputs()
+   */
+  virtual size_t registerAsyncOutputCallback(const OutputCallback& callback, size_t capacity = 1024,
+      OverflowPolicy policy = OverflowPolicy::Block){
+    CHECK(callback) << "callback can't be nullptr";
+    CHECK_GT(capacity, 0u) << "the queue of an asynchronous callback must be bounded";
+    async_subscribers_.emplace_back(new AsyncSubscriber(callback, capacity, policy));
+    if(!this->isShutdown()){
+      async_subscribers_.back()->start();
+    }
+    return async_subscribers_.size() - 1;
+  }
+
+  /**
+   * Return the number of outputs dropped by the overflow policy of the asynchronous subscriber `index`
+   */
+  uint64_t numDroppedOutputs(size_t index) const{
+    CHECK_LT(index, async_subscribers_.size()) << "unknown asynchronous subscriber";
+    return async_subscribers_[index]->dropped;
+  }
 protected:
 
   /**
@@ -145,16 +1004,106 @@ protected:
     for(OutputCallback &cb : output_callbacks_){
       cb(output);
     }
-    return true;
+    bool success = true;
+    for(std::unique_ptr<AsyncSubscriber> &subscriber : async_subscribers_){
+      success = subscriber->send(output) && success;
+    }
+    for(size_t i = 0; i < output_sinks_.size(); ++i){
+      const bool sent = i + 1 == output_sinks_.size() ? output_sinks_[i](std::move(output)) : output_sinks_[i](output);
+      success = sent && success;
+    }
+    return success;
   }
 
   /**
    * This function handles shutting down all the queues. User needs to override this to handle queues if needed.
+   * It also stops the asynchronous subscribers, so overrides must call it.
    */
-   void shutdownQueues() override {};
+   void shutdownQueues() override {
+     stopAsyncSubscribers();
+   };
+
+  /**
+   * This function restarts the asynchronous subscribers. Overrides must call it.
+   */
+  void restartQueues() override {
+    for(std::unique_ptr<AsyncSubscriber> &subscriber : async_subscribers_){
+      subscriber->queue.restart();
+      subscriber->start();
+    }
+  }
 
 private:
+  /**
+   * A callback with its own queue and thread
+   */
+  struct AsyncSubscriber {
+    AsyncSubscriber(const OutputCallback &output_callback, size_t capacity, OverflowPolicy overflow_policy)
+      : callback(output_callback), queue(capacity), policy(overflow_policy), dropped(0), thread() {}
+
+    bool send(const typename PIO::OutputSharedPtr &output){
+      switch(policy){
+        case OverflowPolicy::DropOldest: {
+          bool dropped_oldest = false;
+          if(!queue.force_push(output, &dropped_oldest)) return false;
+          if(dropped_oldest) ++dropped;
+          return true;
+        }
+        case OverflowPolicy::DropNewest: {
+          typename PIO::OutputSharedPtr copy = output;
+          if(queue.try_push(std::move(copy))) return true;
+          if(queue.isShutdown()) return false;
+          ++dropped;
+          return true;
+        }
+        default:
+          return queue.push(output);
+      }
+    }
+
+    void start(){
+      if(!thread.joinable()){
+        thread = std::thread(&AsyncSubscriber::run, this);
+      }
+    }
+
+    void stop(){
+      queue.shutdown();
+      if(thread.joinable()){
+        thread.join();
+      }
+    }
+
+    void run(){
+      typename PIO::OutputSharedPtr output;
+      while(queue.wait_and_pop(output)){
+        callback(output);
+        output.reset();
+      }
+      // deliver what was queued before the shutdown
+      std::vector<typename PIO::OutputSharedPtr> outputs;
+      queue.drain_into(outputs);
+      for(typename PIO::OutputSharedPtr &remaining : outputs){
+        callback(remaining);
+      }
+    }
+
+    OutputCallback callback;
+    concurrent_queue::ConcurrentQueue<typename PIO::OutputSharedPtr> queue;
+    const OverflowPolicy policy;
+    std::atomic<uint64_t> dropped;
+    std::thread thread;
+  };
+
+  void stopAsyncSubscribers(){
+    for(std::unique_ptr<AsyncSubscriber> &subscriber : async_subscribers_){
+      subscriber->stop();
+    }
+  }
+
   std::vector<OutputCallback> output_callbacks_;
+  std::vector<std::unique_ptr<AsyncSubscriber>> async_subscribers_;
+  std::vector<OutputSink> output_sinks_;
 };
 
 /**
@@ -163,24 +1112,48 @@ private:
  * Receive inputs via a thread-safe queue and send outputs via callbacks.
  * This is still an abstract class, user needs to implement:
  * - spinOnce(): calculate the output payload from input payload
+ * The input queue type is a policy: any queue template with the `ConcurrentQueue` push/try_pop/wait_and_pop/shutdown
+ * contract can be used, e.g. concurrent_queue::MpmcQueue or an alias of concurrent_queue::SpscRingQueue.
  * Note:
  * - If once implements Multiple output via queues then need to override shutdownQueues to handle both input and
  * output queues.
  */
-template <typename Input, typename Output>
+template <typename Input, typename Output,
+    template<typename> class InputQueueT = concurrent_queue::ConcurrentQueue>
 class SIMOPipelineModule : public MIMOPipelineModule<Input, Output> {
 public:
   using PIO = PipelineModule<Input, Output>;
-  using InputQueue = concurrent_queue::ConcurrentQueue<typename PIO::InputUniquePtr>;
+  using InputQueue = InputQueueT<typename PIO::InputUniquePtr>;
   using InputQueueSharedPtr = std::shared_ptr<InputQueue>;
 
   SIMOPipelineModule(InputQueueSharedPtr &input_queue, const std::string &module_id, const bool &sequential_mode)
       : MIMOPipelineModule<Input, Output>(module_id, sequential_mode), input_queue_(input_queue){
     CHECK_NOTNULL(input_queue_);
+    setQueueTraceName(*input_queue_, module_id + " input", 0);
   }
   virtual ~SIMOPipelineModule() = default;
 
+  bool hasInputPayload() const override {
+    return !input_queue_->empty();
+  }
+
+  size_t inputQueueSize() const override {
+    return input_queue_ ? input_queue_->size() : 0;
+  }
+
+  uint64_t numDroppedInputs() const override {
+    return input_queue_ ? numExpiredInQueue(*input_queue_, 0) : 0;
+  }
+
+  const InputQueueSharedPtr& inputQueue() const{
+    return input_queue_;
+  }
+
 protected:
+  bool hasSingleConsumerInput() const override {
+    return IsSingleConsumerQueue<InputQueue>::value && input_queue_ != nullptr;
+  }
+
   typename PIO::InputUniquePtr prepareInputPayload() override {
     bool success = false;
     typename PIO::InputUniquePtr value = nullptr;
@@ -196,10 +1169,27 @@ protected:
     }
   }
 
+  size_t prepareInputPayloads(std::vector<typename PIO::InputUniquePtr> &inputs, size_t max_n,
+      const std::chrono::microseconds &linger) override {
+    return popPayloadBatch(*input_queue_, inputs, max_n, !PIO::sequential_mode_, linger);
+  }
+
   void shutdownQueues() override {
     if(input_queue_){
       input_queue_->shutdown();
     }
+    MIMOPipelineModule<Input, Output>::shutdownQueues();
+  }
+
+  void restartQueues() override {
+    if(input_queue_){
+      input_queue_->restart();
+    }
+    MIMOPipelineModule<Input, Output>::restartQueues();
+  }
+
+  bool reserveInputQueue(size_t n) override {
+    return !input_queue_ || reserveQueue(*input_queue_, n, 0);
   }
 
 private:
@@ -212,34 +1202,73 @@ private:
  * - prepareInputPayload()
  * - spinOnce()
  * By default, the single output is handled using an output queue.
+ * The output queue type is a policy, see SIMOPipelineModule.
  * We don't know how the user wants with multiple inputs.
  * Note:
  * - One can receive multiple inputs via callbacks. Then, create an input payload in getInputPayload() method.
  */
-template <typename Input, typename Output>
+template <typename Input, typename Output,
+    template<typename> class OutputQueueT = concurrent_queue::ConcurrentQueue>
 class MISOPipelineModule : public PipelineModule<Input, Output> {
 public:
   using PIO = PipelineModule<Input, Output>;
-  using OutputQueue = concurrent_queue::ConcurrentQueue<typename PIO::OutputSharedPtr>;
+  using OutputQueue = OutputQueueT<typename PIO::OutputSharedPtr>;
   using OutputQueueSharedPtr = std::shared_ptr<OutputQueue>;
+  using OutputSink = std::function<bool(typename PIO::OutputSharedPtr output)>;
 
   MISOPipelineModule(OutputQueueSharedPtr &output_queue, const std::string &module_id, const bool &sequential_mode)
-      : PipelineModule<Input, Output>(module_id, sequential_mode), output_queue_(output_queue){}
+      : PipelineModule<Input, Output>(module_id, sequential_mode), output_queue_(output_queue), output_sink_(){}
+
+  /**
+   * Send the outputs to `sink` instead of the output queue, e.g. to link this module to the next one.
+   * The sink receives the only reference to the output payload when nobody else holds it.
+   * Must be called before spin() is started.
+   */
+  void setOutputSink(const OutputSink &sink){
+    output_sink_ = sink;
+  }
+
+  const OutputQueueSharedPtr& outputQueue() const{
+    return output_queue_;
+  }
 
 protected:
+  bool hasSingleProducerOutput() const override {
+    return IsSingleProducerQueue<OutputQueue>::value && output_queue_ != nullptr;
+  }
 
   /**
-   * This function will call a set of output callbacks to send the output payload
+   * This function will send the output payload to the output queue, or to the output sink if one is set
    * @param output : the output payload created by spinOnce()
    * @return False if can not send the output payload
    */
   bool sendOutputPayload(typename PIO::OutputSharedPtr output) override {
+    if(output_sink_){
+      return output_sink_(std::move(output));
+    }
     if(output_queue_){
       return output_queue_->push(output);
     }
     return false;
   }
 
+  /**
+   * This function pushes all outputs of a batch to the output queue at once
+   */
+  bool sendOutputPayloads(std::vector<typename PIO::OutputSharedPtr> &outputs) override {
+    if(output_sink_){
+      bool success = true;
+      for(typename PIO::OutputSharedPtr &output : outputs){
+        success = output_sink_(std::move(output)) && success;
+      }
+      return success;
+    }
+    if(output_queue_){
+      return output_queue_->push_bulk(outputs.begin(), outputs.end()) == outputs.size();
+    }
+    return false;
+  }
+
   /**
    * This function handles shutting down the output queue.
    */
@@ -249,8 +1278,15 @@ protected:
     }
   }
 
+  void restartQueues() override {
+    if(output_queue_){
+      output_queue_->restart();
+    }
+  }
+
 private:
   OutputQueueSharedPtr output_queue_;
+  OutputSink output_sink_;
 };
 
 /**
@@ -259,20 +1295,47 @@ private:
  * - spinOnce()
  * By default, the single input is handled using an input queue.
  * By default, the single output is handled using an output queue (inherit from MISO).
+ * Both queue types are policies, see SIMOPipelineModule.
  */
-template <typename Input, typename Output>
-class SISOPipelineModule : public MISOPipelineModule<Input, Output> {
+template <typename Input, typename Output,
+    template<typename> class InputQueueT = concurrent_queue::ConcurrentQueue,
+    template<typename> class OutputQueueT = concurrent_queue::ConcurrentQueue>
+class SISOPipelineModule : public MISOPipelineModule<Input, Output, OutputQueueT> {
 public:
   using PIO = PipelineModule<Input, Output>;
-  using MISO = MISOPipelineModule<Input, Output>;
-  using InputQueue = concurrent_queue::ConcurrentQueue<typename PIO::InputUniquePtr>;
+  using MISO = MISOPipelineModule<Input, Output, OutputQueueT>;
+  using InputQueue = InputQueueT<typename PIO::InputUniquePtr>;
   using InputQueueSharedPtr = std::shared_ptr<InputQueue>;
 
   SISOPipelineModule(InputQueueSharedPtr &input_queue, typename MISO::OutputQueueSharedPtr &output_queue,
       const std::string &module_id, const bool &sequential_mode)
-      : MISOPipelineModule<Input, Output>(output_queue, module_id, sequential_mode), input_queue_(input_queue){}
+      : MISO(output_queue, module_id, sequential_mode), input_queue_(input_queue){
+    if(input_queue_){
+      setQueueTraceName(*input_queue_, module_id + " input", 0);
+    }
+  }
+
+  bool hasInputPayload() const override {
+    return !input_queue_->empty();
+  }
+
+  size_t inputQueueSize() const override {
+    return input_queue_ ? input_queue_->size() : 0;
+  }
+
+  uint64_t numDroppedInputs() const override {
+    return input_queue_ ? numExpiredInQueue(*input_queue_, 0) : 0;
+  }
+
+  const InputQueueSharedPtr& inputQueue() const{
+    return input_queue_;
+  }
 
 protected:
+  bool hasSingleConsumerInput() const override {
+    return IsSingleConsumerQueue<InputQueue>::value && input_queue_ != nullptr;
+  }
+
 
   typename PIO::InputUniquePtr prepareInputPayload() override {
     bool success = false;
@@ -289,6 +1352,11 @@ protected:
     }
   }
 
+  size_t prepareInputPayloads(std::vector<typename PIO::InputUniquePtr> &inputs, size_t max_n,
+      const std::chrono::microseconds &linger) override {
+    return popPayloadBatch(*input_queue_, inputs, max_n, !PIO::sequential_mode_, linger);
+  }
+
   /**
    * This function handles shutting down the output queue.
    */
@@ -299,6 +1367,17 @@ protected:
     MISO::shutdownQueues();
   }
 
+  void restartQueues() override {
+    if(input_queue_){
+      input_queue_->restart();
+    }
+    MISO::restartQueues();
+  }
+
+  bool reserveInputQueue(size_t n) override {
+    return !input_queue_ || reserveQueue(*input_queue_, n, 0);
+  }
+
 private:
   InputQueueSharedPtr input_queue_;
 };
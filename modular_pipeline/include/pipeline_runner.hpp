@@ -0,0 +1,237 @@
+#ifndef MODULAR_PIPELINE_PIPELINE_RUNNER_HPP
+#define MODULAR_PIPELINE_PIPELINE_RUNNER_HPP
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+#include "event_count.hpp"
+#include "pipeline_module.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * Runs many pipeline modules on a fixed pool of worker threads instead of one thread per module.
+ * Modules must be created in sequential mode: one call to spin() is one unit of work.
+ * A module is scheduled as a task only when hasInputPayload() is True, so an idle module is not stepped, but the
+ * runner still has to poll for new input.
+ * A task is never run by two workers at the same time.
+ * Every worker has its own task deque. A worker runs its newest task first and steals the oldest task of another
+ * worker when its own deque is empty. A task that still has input after its step goes back to the old end.
+ * Idle workers spin for a short while, then poll the modules with an exponential back off that sleeps up to 1 ms, so
+ * an idle runner still wakes up about once per millisecond. Call notify() or notifyIfIdle() after pushing into a
+ * module queue from outside the runner to wake them up immediately, otherwise the input waits up to one poll interval.
+ * PipelineGraph edges into a sequential module do this themselves.
+ */
+class PipelineRunner {
+public:
+  explicit PipelineRunner(size_t num_threads = std::thread::hardware_concurrency())
+    : num_threads_(std::max<size_t>(num_threads, 1)), running_(false), workers_(), threads_(), tasks_(),
+      wake_mutex_(), wake_cond_(), wake_epoch_(0), sleeping_workers_(0) {}
+  ~PipelineRunner(){
+    stop();
+  }
+  PipelineRunner(const PipelineRunner&) = delete;
+  void operator=(const PipelineRunner&) = delete;
+
+  /**
+   * Register a module. The module must outlive the runner or be added before start() and stopped with stop().
+   */
+  template <typename Input, typename Output>
+  void addModule(PipelineModule<Input, Output> &module){
+    CHECK(!running_) << "PipelineRunner: addModule() must be called before start()";
+    CHECK(module.isSequential()) << "PipelineRunner: module [" << module.moduleId()
+                                 << "] must be created in sequential mode";
+    PipelineModule<Input, Output> *m = &module;
+    std::unique_ptr<Task> task(new Task());
+    task->step = [m]{ m->spin(); };
+    task->ready = [m]{ return !m->isShutdown() && m->hasInputPayload(); };
+    tasks_.push_back(std::move(task));
+  }
+
+  /**
+   * Start the worker threads
+   */
+  void start(){
+    CHECK(!running_) << "PipelineRunner: start() is already called";
+    running_ = true;
+    workers_.clear();
+    for(size_t i = 0; i < num_threads_; ++i){
+      workers_.emplace_back(new Worker());
+    }
+    for(size_t i = 0; i < num_threads_; ++i){
+      threads_.emplace_back(&PipelineRunner::workerLoop, this, i);
+    }
+    LOG(INFO) << "PipelineRunner: started " << num_threads_ << " workers for " << tasks_.size() << " modules";
+  }
+
+  /**
+   * Stop and join the worker threads. Modules are not shutdown.
+   */
+  void stop(){
+    if(!running_) return;
+    running_ = false;
+    notify();
+    for(std::thread &t : threads_){
+      t.join();
+    }
+    threads_.clear();
+    for(std::unique_ptr<Task> &task : tasks_){
+      task->scheduled = false;
+    }
+    LOG(INFO) << "PipelineRunner: stopped";
+  }
+
+  /**
+   * Wake idle workers, e.g. after pushing new inputs into a module queue from outside the runner
+   */
+  void notify(){
+    {
+      std::lock_guard<std::mutex> lk(wake_mutex_);
+      ++wake_epoch_;
+    }
+    wake_cond_.notify_all();
+  }
+
+  /**
+   * Same as notify(), but without taking a lock while no worker sleeps, so a producer can call it after every push
+   */
+  void notifyIfIdle(){
+    // pairs with the fence in workerLoop(): either the worker sees the new input or this sees the sleeping worker
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleeping_workers_.load(std::memory_order_relaxed) > 0){
+      notify();
+    }
+  }
+
+  size_t numThreads() const{
+    return num_threads_;
+  }
+
+private:
+  struct Task {
+    Task(): step(), ready(), scheduled(false) {}
+    std::function<void()> step;
+    std::function<bool()> ready;
+    std::atomic_bool scheduled;
+  };
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task*> tasks;
+  };
+
+  static constexpr int kSpinRounds = 64;
+  static constexpr int kMaxIdleSleepUs = 1000;
+
+  void workerLoop(size_t index){
+    int idle_rounds = 0;
+    int sleep_us = 1;
+    while(running_){
+      Task *task = nullptr;
+      if(popLocal(index, task) || steal(index, task)){
+        task->step();
+        if(running_ && task->ready()){
+          requeueLocal(index, task);
+        } else {
+          task->scheduled = false;
+        }
+        idle_rounds = 0;
+        sleep_us = 1;
+        continue;
+      }
+      if(scheduleReadyTasks(index) > 0){
+        idle_rounds = 0;
+        sleep_us = 1;
+        continue;
+      }
+      if(++idle_rounds < kSpinRounds){
+        concurrent_queue::cpuRelax();
+        continue;
+      }
+      // nothing is ready: sleep until notify() or until it is time to poll again. The tasks are checked once more
+      // after the worker is counted as sleeping, so notifyIfIdle() can't miss it.
+      std::unique_lock<std::mutex> lk(wake_mutex_);
+      const uint64_t epoch = wake_epoch_;
+      lk.unlock();
+      sleeping_workers_.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(scheduleReadyTasks(index) > 0){
+        sleeping_workers_.fetch_sub(1, std::memory_order_relaxed);
+        idle_rounds = 0;
+        sleep_us = 1;
+        continue;
+      }
+      lk.lock();
+      wake_cond_.wait_for(lk, std::chrono::microseconds(sleep_us),
+                          [this, epoch]{return wake_epoch_ != epoch || !running_;});
+      lk.unlock();
+      sleeping_workers_.fetch_sub(1, std::memory_order_relaxed);
+      sleep_us = sleep_us * 2 > kMaxIdleSleepUs ? kMaxIdleSleepUs : sleep_us * 2;
+    }
+  }
+
+  // claim every ready task that is not scheduled yet and push it to the deque of worker `index`
+  size_t scheduleReadyTasks(size_t index){
+    size_t scheduled = 0;
+    for(std::unique_ptr<Task> &task : tasks_){
+      if(task->scheduled.load(std::memory_order_relaxed) || !task->ready()) continue;
+      bool expected = false;
+      if(task->scheduled.compare_exchange_strong(expected, true)){
+        pushLocal(index, task.get());
+        ++scheduled;
+      }
+    }
+    return scheduled;
+  }
+
+  void pushLocal(size_t index, Task *task){
+    std::lock_guard<std::mutex> lk(workers_[index]->mutex);
+    workers_[index]->tasks.push_back(task);
+  }
+
+  // put a task that still has work behind the other local tasks, so an always ready module can't starve them
+  void requeueLocal(size_t index, Task *task){
+    std::lock_guard<std::mutex> lk(workers_[index]->mutex);
+    workers_[index]->tasks.push_front(task);
+  }
+
+  bool popLocal(size_t index, Task *&task){
+    std::lock_guard<std::mutex> lk(workers_[index]->mutex);
+    if(workers_[index]->tasks.empty()) return false;
+    task = workers_[index]->tasks.back();
+    workers_[index]->tasks.pop_back();
+    return true;
+  }
+
+  bool steal(size_t index, Task *&task){
+    for(size_t i = 1; i < num_threads_; ++i){
+      Worker &victim = *workers_[(index + i) % num_threads_];
+      std::lock_guard<std::mutex> lk(victim.mutex);
+      if(victim.tasks.empty()) continue;
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+      return true;
+    }
+    return false;
+  }
+
+  const size_t num_threads_;
+  std::atomic_bool running_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::vector<std::unique_ptr<Task>> tasks_;
+
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cond_;
+  uint64_t wake_epoch_;
+  std::atomic<size_t> sleeping_workers_;
+};
+}
+#endif //MODULAR_PIPELINE_PIPELINE_RUNNER_HPP
@@ -0,0 +1,165 @@
+#ifndef MODULAR_PIPELINE_SHM_PIPELINE_QUEUE_HPP
+#define MODULAR_PIPELINE_SHM_PIPELINE_QUEUE_HPP
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <glog/logging.h>
+#include "payload_pool.hpp"
+#include "shm_ring_queue.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * How ShmPipelineQueue hands a shared memory slot to a module as a payload pointer without copying it
+ */
+template <typename Ptr>
+struct ShmPayloadPtr;
+
+template <typename T>
+struct ShmPayloadPtr<std::unique_ptr<T, PayloadDeleter<T>>> {
+  using Payload = T;
+  static std::unique_ptr<T, PayloadDeleter<T>> wrap(T *item, const PayloadReleaser<T> *releaser){
+    return std::unique_ptr<T, PayloadDeleter<T>>(item, PayloadDeleter<T>(releaser));
+  }
+};
+
+template <typename T>
+struct ShmPayloadPtr<std::shared_ptr<T>> {
+  using Payload = T;
+  static std::shared_ptr<T> wrap(T *item, const PayloadReleaser<T> *releaser){
+    return std::shared_ptr<T>(item, [releaser](T *payload){ releaser->release(payload); });
+  }
+};
+
+/**
+ * Queue policy that links two pipeline modules in different processes through a ShmRingQueue, e.g. the output
+ * of a MISO module in one process to the input of a SIMO module in another:
+ *   template<typename T> using ShmQueue = modular_pipeline::ShmPipelineQueue<T>;
+ *   // producer process
+ *   MISO::OutputQueueSharedPtr output_queue = std::make_shared<MISO::OutputQueue>(
+ *       concurrent_queue::ShmRingQueue<Frame>::create("/frames"));
+ *   // consumer process
+ *   SIMO::InputQueueSharedPtr input_queue = std::make_shared<SIMO::InputQueue>(
+ *       concurrent_queue::ShmRingQueue<Frame>::open("/frames"));
+ * Pushing copies the payload into the ring once. Popping does not copy: the payload pointer points into shared
+ * memory and its deleter gives the slot back to the producer, so the queue must outlive the popped payloads.
+ * The payload type must be trivially copyable.
+ */
+template <typename Ptr>
+class ShmPipelineQueue {
+public:
+  using Payload = typename ShmPayloadPtr<Ptr>::Payload;
+  using RingQueue = concurrent_queue::ShmRingQueue<Payload>;
+
+  explicit ShmPipelineQueue(std::unique_ptr<RingQueue> ring)
+  : ring_(std::move(ring)), releaser_(ring_.get()) {
+    CHECK(ring_) << "ShmPipelineQueue: the shared memory ring is null";
+  }
+  ShmPipelineQueue(const ShmPipelineQueue&) = delete;
+  void operator=(const ShmPipelineQueue&) = delete;
+
+  bool push(Ptr value){
+    return value && ring_->push(*value);
+  }
+
+  bool try_push(Ptr &&value){
+    return value && ring_->try_push(*value);
+  }
+
+  template <typename Iterator>
+  size_t push_bulk(Iterator first, Iterator last){
+    size_t pushed = 0;
+    for(; first != last && push(std::move(*first)); ++first, ++pushed) {}
+    return pushed;
+  }
+
+  bool wait_and_pop(Ptr &value){
+    return wrap(ring_->wait_and_peek(), value);
+  }
+
+  bool try_pop(Ptr &value){
+    return wrap(ring_->try_peek(), value);
+  }
+
+  template <typename Rep, typename Period>
+  bool pop_for(Ptr &value, const std::chrono::duration<Rep, Period> &timeout){
+    return wrap(ring_->peek_for(timeout), value);
+  }
+
+  template <typename OutputIt>
+  size_t pop_bulk(OutputIt out, size_t max_n){
+    size_t popped = 0;
+    Ptr value;
+    for(; popped < max_n && try_pop(value); ++popped){
+      *out++ = std::move(value);
+    }
+    return popped;
+  }
+
+  template <typename OutputIt>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n){
+    Ptr value;
+    if(max_n == 0 || !wait_and_pop(value)) return 0;
+    *out++ = std::move(value);
+    return 1 + pop_bulk(out, max_n - 1);
+  }
+
+  template <typename OutputIt, typename Rep, typename Period>
+  size_t wait_and_pop_bulk(OutputIt out, size_t max_n, const std::chrono::duration<Rep, Period> &timeout){
+    Ptr value;
+    if(max_n == 0 || !pop_for(value, timeout)) return 0;
+    *out++ = std::move(value);
+    return 1 + pop_bulk(out, max_n - 1);
+  }
+
+  bool empty() const{
+    return ring_->empty();
+  }
+
+  size_t size() const{
+    return ring_->size();
+  }
+
+  size_t capacity() const{
+    return ring_->capacity();
+  }
+
+  void shutdown(){
+    ring_->shutdown();
+  }
+
+  void restart(){
+    ring_->restart();
+  }
+
+  bool isShutdown() const{
+    return ring_->isShutdown();
+  }
+
+  RingQueue& ring(){
+    return *ring_;
+  }
+
+private:
+  class SlotReleaser : public PayloadReleaser<Payload> {
+  public:
+    explicit SlotReleaser(RingQueue *ring): ring_(ring) {}
+    void release(Payload *payload) const override {
+      ring_->release(payload);
+    }
+  private:
+    RingQueue *ring_;
+  };
+
+  bool wrap(Payload *item, Ptr &value){
+    if(!item) return false;
+    value = ShmPayloadPtr<Ptr>::wrap(item, &releaser_);
+    return true;
+  }
+
+  std::unique_ptr<RingQueue> ring_;
+  const SlotReleaser releaser_;
+};
+}
+#endif //MODULAR_PIPELINE_SHM_PIPELINE_QUEUE_HPP
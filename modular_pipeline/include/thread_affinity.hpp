@@ -0,0 +1,372 @@
+#ifndef MODULAR_PIPELINE_THREAD_AFFINITY_HPP
+#define MODULAR_PIPELINE_THREAD_AFFINITY_HPP
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <glog/logging.h>
+
+namespace modular_pipeline {
+
+/**
+ * CPUs of every NUMA node, read from sysfs. A machine without NUMA information, or any system but Linux, is one
+ * node 0 with all online CPUs.
+ */
+class CpuTopology {
+public:
+#ifdef __linux__
+  static constexpr int kMaxCpus = CPU_SETSIZE;
+#else
+  static constexpr int kMaxCpus = 1024;
+#endif
+
+  /**
+   * The topology of this machine, read once. It is never destroyed, because payload pools look up the node of the
+   * calling thread when payloads are freed, possibly after static destructors ran.
+   */
+  static const CpuTopology& instance(){
+    static const CpuTopology *topology = new CpuTopology(read());
+    return *topology;
+  }
+
+  /**
+   * Read the topology from `node_dir`, the sysfs directory with the `online` node list and the nodeN directories
+   */
+  static CpuTopology read(const std::string &node_dir = "/sys/devices/system/node"){
+    CpuTopology topology;
+#ifdef __linux__
+    for(int node : parseCpuList(readLine(node_dir + "/online"))){
+      std::vector<int> cpus = parseCpuList(readLine(node_dir + "/node" + std::to_string(node) + "/cpulist"));
+      if(!cpus.empty()){
+        topology.addNode(node, cpus);
+      }
+    }
+#else
+    (void) node_dir;
+#endif
+    if(topology.nodes_.empty()){
+#ifdef __linux__
+      std::vector<int> cpus = parseCpuList(readLine("/sys/devices/system/cpu/online"));
+#else
+      std::vector<int> cpus;
+#endif
+      const int num_cpus = static_cast<int>(std::thread::hardware_concurrency());
+      for(int cpu = 0; cpus.empty() && cpu < std::max(num_cpus, 1); ++cpu){
+        cpus.push_back(cpu);
+      }
+      topology.addNode(0, cpus);
+    }
+    return topology;
+  }
+
+  /**
+   * Parse a sysfs CPU list like "0-3,8-11". Return an empty list if it is malformed.
+   */
+  static std::vector<int> parseCpuList(const std::string &list){
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while(std::getline(ranges, range, ',')){
+      if(range.empty()) continue;
+      char *end = nullptr;
+      const long first = std::strtol(range.c_str(), &end, 10);
+      long last = first;
+      if(*end == '-'){
+        last = std::strtol(end + 1, &end, 10);
+      }
+      if(*end != '\0' && *end != '\n') return std::vector<int>();
+      if(first < 0 || last < first || last >= kMaxCpus) return std::vector<int>();
+      for(long cpu = first; cpu <= last; ++cpu){
+        cpus.push_back(static_cast<int>(cpu));
+      }
+    }
+    return cpus;
+  }
+
+  /**
+   * Format a sorted CPU list like "0-3,8-11"
+   */
+  static std::string formatCpuList(const std::vector<int> &cpus){
+    std::string list;
+    for(size_t i = 0; i < cpus.size();){
+      size_t j = i;
+      while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+      if(!list.empty()) list += ",";
+      list += std::to_string(cpus[i]);
+      if(j > i) list += "-" + std::to_string(cpus[j]);
+      i = j + 1;
+    }
+    return list;
+  }
+
+  size_t numNodes() const{
+    return nodes_.size();
+  }
+
+  size_t numCpus() const{
+    return node_of_cpu_.size();
+  }
+
+  /**
+   * Return the CPUs of NUMA node `node`, empty for an unknown node
+   */
+  std::vector<int> cpusOfNode(int node) const{
+    auto it = nodes_.find(node);
+    return it == nodes_.end() ? std::vector<int>() : it->second;
+  }
+
+  /**
+   * Return the NUMA node of `cpu`, -1 for an unknown CPU
+   */
+  int nodeOfCpu(int cpu) const{
+    auto it = node_of_cpu_.find(cpu);
+    return it == node_of_cpu_.end() ? -1 : it->second;
+  }
+
+  /**
+   * One line per node, e.g. "node 1: cpus 8-15"
+   */
+  std::string describe() const{
+    std::string description;
+    for(const auto &node : nodes_){
+      description += "node " + std::to_string(node.first) + ": cpus " + formatCpuList(node.second) + "\n";
+    }
+    return description;
+  }
+
+private:
+  static std::string readLine(const std::string &path){
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+  }
+
+  void addNode(int node, const std::vector<int> &cpus){
+    nodes_[node] = cpus;
+    for(int cpu : cpus){
+      node_of_cpu_[cpu] = node;
+    }
+  }
+
+  std::map<int, std::vector<int>> nodes_;
+  std::map<int, int> node_of_cpu_;
+};
+
+/**
+ * Where the threads of a module run: on a list of CPUs, or on any CPU of a NUMA node. Empty means not pinned.
+ */
+struct ThreadPlacement {
+  ThreadPlacement(): cpus(), node(-1) {}
+
+  static ThreadPlacement onCpus(const std::vector<int> &cpus){
+    ThreadPlacement placement;
+    placement.cpus = cpus;
+    return placement;
+  }
+
+  static ThreadPlacement onNode(int node){
+    ThreadPlacement placement;
+    placement.node = node;
+    return placement;
+  }
+
+  bool empty() const{
+    return cpus.empty() && node < 0;
+  }
+
+  /**
+   * Return the CPUs the threads may run on: `cpus` if set, otherwise the CPUs of `node`
+   */
+  std::vector<int> resolve(const CpuTopology &topology = CpuTopology::instance()) const{
+    return cpus.empty() && node >= 0 ? topology.cpusOfNode(node) : cpus;
+  }
+
+  std::string toString() const{
+    if(!cpus.empty()) return "cpus=" + CpuTopology::formatCpuList(cpus);
+    if(node >= 0) return "node=" + std::to_string(node);
+    return "any";
+  }
+
+  std::vector<int> cpus;
+  int node;
+};
+
+/**
+ * Pin the calling thread to the CPUs of `placement`. Memory the thread touches first is then allocated on their
+ * NUMA node by the default first-touch policy of the kernel.
+ * @return False if the placement has no CPU of this machine or the kernel refused it. Always False off Linux.
+ */
+inline bool pinCurrentThread(const ThreadPlacement &placement, const CpuTopology &topology = CpuTopology::instance()){
+#ifndef __linux__
+  (void) topology;
+  LOG(ERROR) << "pinCurrentThread: can't pin to " << placement.toString() << ", thread placement needs Linux";
+  return false;
+#else
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  size_t num_cpus = 0;
+  for(int cpu : placement.resolve(topology)){
+    if(cpu >= 0 && cpu < CPU_SETSIZE){
+      CPU_SET(cpu, &cpu_set);
+      ++num_cpus;
+    }
+  }
+  if(num_cpus == 0){
+    LOG(ERROR) << "pinCurrentThread: placement " << placement.toString() << " has no CPU";
+    return false;
+  }
+  const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  LOG_IF(ERROR, error != 0) << "pinCurrentThread: can't pin to " << placement.toString() << ": "
+                            << std::strerror(error);
+  return error == 0;
+#endif
+}
+
+/**
+ * Return the CPUs the calling thread may run on. Off Linux, every CPU.
+ */
+inline std::vector<int> currentThreadCpus(){
+#ifndef __linux__
+  std::vector<int> cpus;
+  const int num_cpus = static_cast<int>(CpuTopology::instance().numCpus());
+  for(int cpu = 0; cpu < num_cpus; ++cpu){
+    cpus.push_back(cpu);
+  }
+  return cpus;
+#else
+  std::vector<int> cpus;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if(pthread_getaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) return cpus;
+  for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu){
+    if(CPU_ISSET(cpu, &cpu_set)) cpus.push_back(cpu);
+  }
+  return cpus;
+#endif
+}
+
+/**
+ * Run `fn` on a temporary thread pinned to `placement` and wait for it. Queues and pools created or reserved in
+ * `fn` get their memory from the NUMA node of `placement`, e.g. the node of the module that consumes them:
+ *   runPinned(ThreadPlacement::onNode(1), [&]{ queue = concurrent_queue::makeSharedAligned<Queue>(1024); });
+ */
+template <typename Fn>
+void runPinned(const ThreadPlacement &placement, Fn fn){
+  std::thread thread([&]{
+    pinCurrentThread(placement);
+    fn();
+  });
+  thread.join();
+}
+
+/**
+ * Placement of pipeline modules by module id, read from a configuration with one module per line:
+ *   # module_id   placement          payloads to prefault in its pools and input queue on its node (optional)
+ *   decoder       node=1             prefault=4096
+ *   encoder       cpus=2-3,6
+ */
+class PlacementConfig {
+public:
+  struct Entry {
+    Entry(): placement(), prefault_payloads(0) {}
+    ThreadPlacement placement;
+    size_t prefault_payloads;
+  };
+
+  /**
+   * Read the configuration file `path`. Return false and log the first error if it can't be read or parsed.
+   */
+  bool load(const std::string &path){
+    std::ifstream file(path);
+    if(!file){
+      LOG(ERROR) << "PlacementConfig: can't read " << path << ": " << std::strerror(errno);
+      return false;
+    }
+    return parse(file);
+  }
+
+  /**
+   * Add the entries of a configuration. Return false and log the first error if a line is malformed.
+   */
+  bool parse(std::istream &in){
+    std::string line;
+    for(size_t line_number = 1; std::getline(in, line); ++line_number){
+      line = line.substr(0, line.find('#'));
+      std::stringstream fields(line);
+      std::string module_id;
+      if(!(fields >> module_id)) continue;
+      Entry entry;
+      std::string field;
+      while(fields >> field){
+        if(!parseField(field, entry)){
+          LOG(ERROR) << "PlacementConfig: line " << line_number << ": bad field '" << field << "'";
+          return false;
+        }
+      }
+      if(entry.placement.empty()){
+        LOG(ERROR) << "PlacementConfig: line " << line_number << ": module " << module_id << " has no placement";
+        return false;
+      }
+      entries_[module_id] = entry;
+    }
+    return true;
+  }
+
+  void set(const std::string &module_id, const ThreadPlacement &placement, size_t prefault_payloads = 0){
+    Entry &entry = entries_[module_id];
+    entry.placement = placement;
+    entry.prefault_payloads = prefault_payloads;
+  }
+
+  /**
+   * Return the entry of `module_id`, nullptr if it has none
+   */
+  const Entry* find(const std::string &module_id) const{
+    auto it = entries_.find(module_id);
+    return it == entries_.end() ? nullptr : &it->second;
+  }
+
+  const std::map<std::string, Entry>& entries() const{
+    return entries_;
+  }
+
+private:
+  static bool parseField(const std::string &field, Entry &entry){
+    const size_t equal = field.find('=');
+    if(equal == std::string::npos) return false;
+    const std::string key = field.substr(0, equal);
+    const std::string value = field.substr(equal + 1);
+    char *end = nullptr;
+    if(key == "cpus"){
+      entry.placement.cpus = CpuTopology::parseCpuList(value);
+      return !entry.placement.cpus.empty();
+    }
+    if(key == "node"){
+      const long node = std::strtol(value.c_str(), &end, 10);
+      entry.placement.node = static_cast<int>(node);
+      return !value.empty() && *end == '\0' && node >= 0;
+    }
+    if(key == "prefault"){
+      const unsigned long long payloads = std::strtoull(value.c_str(), &end, 10);
+      entry.prefault_payloads = static_cast<size_t>(payloads);
+      return !value.empty() && *end == '\0';
+    }
+    return false;
+  }
+
+  std::map<std::string, Entry> entries_;
+};
+}
+#endif //MODULAR_PIPELINE_THREAD_AFFINITY_HPP
@@ -0,0 +1,413 @@
+#ifndef MODULAR_PIPELINE_TIME_SYNC_JOIN_HPP
+#define MODULAR_PIPELINE_TIME_SYNC_JOIN_HPP
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <glog/logging.h>
+#include "pipeline_module.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * How the TimeSyncJoinModule matches the other inputs to a payload of the first input, the pivot
+ */
+enum class MatchPolicy {
+  // same timestamp as the pivot
+  Exact,
+  // nearest timestamp, at most `tolerance` away. Waits until an input has a payload at or after the pivot.
+  Nearest,
+  // newest timestamp in [pivot - tolerance, pivot]. Never waits for payloads after the pivot.
+  Window
+};
+
+/**
+ * Configuration of a TimeSyncJoinModule. Timestamps are int64_t in any unit, e.g. nanoseconds, and must increase on
+ * every input. A payload older than the newest one of its input is dropped as out of order.
+ */
+struct TimeSyncConfig {
+  TimeSyncConfig(): policy(MatchPolicy::Nearest), tolerance(std::numeric_limits<int64_t>::max()),
+                    buffer_capacity(64), max_delay(std::numeric_limits<int64_t>::max()) {}
+
+  MatchPolicy policy;
+  // largest timestamp difference of a Nearest match, length of the Window
+  int64_t tolerance;
+  // payloads buffered per input. The oldest payload is evicted when a buffer is full.
+  size_t buffer_capacity;
+  // a pivot still waiting for a match when any input is max_delay newer than it is dropped, e.g. if a sensor stops
+  int64_t max_delay;
+};
+
+/**
+ * Counters of a TimeSyncJoinModule at one point in time
+ */
+struct TimeSyncJoinStats {
+  struct Input {
+    Input(): arrivals(0), out_of_order(0), evicted(0) {}
+    uint64_t arrivals;
+    uint64_t out_of_order;
+    // pushed out of a full buffer
+    uint64_t evicted;
+  };
+
+  TimeSyncJoinStats(): module_id(), inputs(), matched(0), unmatched(0), timed_out(0) {}
+
+  /**
+   * Return the fraction of the decided pivots that were matched
+   */
+  double matchRate() const{
+    const uint64_t decided = matched + unmatched + timed_out;
+    return decided == 0 ? 0.0 : static_cast<double>(matched) / decided;
+  }
+
+  /**
+   * Return the fraction of the arrivals of input `i` that were out of order or evicted
+   */
+  double dropRate(size_t i) const{
+    return inputs[i].arrivals == 0 ? 0.0
+                                   : static_cast<double>(inputs[i].out_of_order + inputs[i].evicted)
+                                     / inputs[i].arrivals;
+  }
+
+  std::string toText() const{
+    std::ostringstream out;
+    out << "[" << module_id << "] matched=" << matched << " unmatched=" << unmatched << " timed_out=" << timed_out
+        << " match_rate=" << matchRate();
+    for(size_t i = 0; i < inputs.size(); ++i){
+      out << " input" << i << "{n=" << inputs[i].arrivals << " out_of_order=" << inputs[i].out_of_order
+          << " evicted=" << inputs[i].evicted << " drop_rate=" << dropRate(i) << "}";
+    }
+    return out.str();
+  }
+
+  std::string toJson() const{
+    std::ostringstream out;
+    out << "{\"module\":\"" << jsonEscape(module_id) << "\",\"matched\":" << matched << ",\"unmatched\":" << unmatched
+        << ",\"timed_out\":" << timed_out << ",\"match_rate\":" << matchRate() << ",\"inputs\":[";
+    for(size_t i = 0; i < inputs.size(); ++i){
+      out << (i == 0 ? "" : ",") << "{\"arrivals\":" << inputs[i].arrivals << ",\"out_of_order\":"
+          << inputs[i].out_of_order << ",\"evicted\":" << inputs[i].evicted << ",\"drop_rate\":" << dropRate(i)
+          << "}";
+    }
+    out << "]}";
+    return out.str();
+  }
+
+  std::string module_id;
+  std::vector<Input> inputs;
+  // pivots joined with every other input
+  uint64_t matched;
+  // pivots dropped because an input has no payload that matches
+  uint64_t unmatched;
+  // pivots dropped after waiting max_delay
+  uint64_t timed_out;
+};
+
+/**
+ * Compile time list of indices, like std::index_sequence of C++14
+ */
+template <size_t... Is>
+struct IndexSequence {};
+
+template <size_t N, size_t... Is>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Is...> {};
+
+template <size_t... Is>
+struct MakeIndexSequence<0, Is...> {
+  using type = IndexSequence<Is...>;
+};
+
+/**
+ * Fixed capacity ring of timestamped payloads in timestamp order, searched by binary search
+ */
+template <typename T>
+class TimestampRing {
+public:
+  struct Entry {
+    Entry(): timestamp(0), payload() {}
+    int64_t timestamp;
+    std::shared_ptr<const T> payload;
+  };
+
+  explicit TimestampRing(size_t capacity): entries_(capacity), head_(0), size_(0) {
+    CHECK_GT(capacity, 0u) << "TimestampRing: capacity must be positive";
+  }
+
+  bool empty() const{
+    return size_ == 0;
+  }
+
+  bool full() const{
+    return size_ == entries_.size();
+  }
+
+  size_t size() const{
+    return size_;
+  }
+
+  const Entry& operator[](size_t i) const{
+    return entries_[(head_ + i) % entries_.size()];
+  }
+
+  const Entry& back() const{
+    return (*this)[size_ - 1];
+  }
+
+  /**
+   * Append a payload newer than back(). The ring must not be full.
+   */
+  void push_back(int64_t timestamp, std::shared_ptr<const T> payload){
+    Entry &entry = entries_[(head_ + size_) % entries_.size()];
+    entry.timestamp = timestamp;
+    entry.payload = std::move(payload);
+    ++size_;
+  }
+
+  /**
+   * Remove the `n` oldest payloads
+   */
+  void pop_front(size_t n = 1){
+    for(; n > 0 && size_ > 0; --n, --size_){
+      entries_[head_].payload.reset();
+      head_ = (head_ + 1) % entries_.size();
+    }
+  }
+
+  /**
+   * Return the index of the first payload at or after `timestamp`, size() if there is none
+   */
+  size_t lowerBound(int64_t timestamp) const{
+    size_t first = 0;
+    size_t count = size_;
+    while(count > 0){
+      const size_t step = count / 2;
+      if((*this)[first + step].timestamp < timestamp){
+        first += step + 1;
+        count -= step + 1;
+      } else {
+        count = step;
+      }
+    }
+    return first;
+  }
+
+  /**
+   * Return the index of the first payload after `timestamp`, size() if there is none
+   */
+  size_t upperBound(int64_t timestamp) const{
+    return timestamp == std::numeric_limits<int64_t>::max() ? size_ : lowerBound(timestamp + 1);
+  }
+
+private:
+  std::vector<Entry> entries_;
+  size_t head_;
+  size_t size_;
+};
+
+/**
+ * Payloads of every input joined at the timestamp of the pivot
+ */
+template <typename... Inputs>
+struct TimeSyncTuple {
+  TimeSyncTuple(): timestamp(0), payloads() {}
+
+  template <size_t I>
+  const typename std::tuple_element<I, std::tuple<Inputs...>>::type& get() const{
+    return *std::get<I>(payloads);
+  }
+
+  // timestamp of the pivot
+  int64_t timestamp;
+  std::tuple<std::shared_ptr<const Inputs>...> payloads;
+};
+
+/**
+ * Joins several streams that arrive at different rates, e.g. sensors, into one tuple per payload of the first input,
+ * the pivot. Every input has a bounded TimestampRing. push<I>() adds a payload and matches the waiting pivots in
+ * timestamp order by the MatchPolicy, with one binary search per input, so a payload costs O(inputs * log capacity).
+ * Matched tuples go to the input queue of the module and spinOnce() processes them, like a SIMO module:
+ *   class Fusion : public TimeSyncJoinModule<Pose, CameraFrame, ImuSample, LidarScan> { spinOnce() ... };
+ *   camera.registerOutputCallback(fusion.inputCallback<0>([](const CameraFrame &f){ return f.stamp_ns; }));
+ *   imu.registerOutputCallback(fusion.inputCallback<1>([](const ImuSample &s){ return s.stamp_ns; }));
+ * push<I>() may be called from several threads. It pushes to the input queue under the lock of the join, so a full
+ * bounded queue blocks the producers of every input.
+ */
+template <typename Output, typename... Inputs>
+class TimeSyncJoinModule : public SIMOPipelineModule<TimeSyncTuple<Inputs...>, Output> {
+public:
+  using Tuple = TimeSyncTuple<Inputs...>;
+  using SIMO = SIMOPipelineModule<Tuple, Output>;
+  using PIO = PipelineModule<Tuple, Output>;
+  static constexpr size_t kNumInputs = sizeof...(Inputs);
+  template <size_t I>
+  using InputType = typename std::tuple_element<I, std::tuple<Inputs...>>::type;
+
+  static_assert(sizeof...(Inputs) >= 2, "TimeSyncJoinModule needs at least two inputs");
+
+  TimeSyncJoinModule(typename SIMO::InputQueueSharedPtr &input_queue, const TimeSyncConfig &config,
+                     const std::string &module_id, const bool &sequential_mode)
+  : SIMO(input_queue, module_id, sequential_mode), config_(config),
+    rings_(TimestampRing<Inputs>(config.buffer_capacity)...), join_mutex_(), newest_(0), has_newest_(false),
+    stats_() {
+    CHECK_GE(config_.tolerance, 0) << PIO::logPrefix() << "tolerance must not be negative";
+    stats_.inputs.resize(sizeof...(Inputs));
+  }
+  virtual ~TimeSyncJoinModule() = default;
+
+  /**
+   * Add a payload of input `I` with its timestamp and send the tuples it completes to the input queue.
+   * @return False if it is dropped as out of order
+   */
+  template <size_t I>
+  bool push(int64_t timestamp, std::shared_ptr<const InputType<I>> payload){
+    std::lock_guard<std::mutex> lk(join_mutex_);
+    TimeSyncJoinStats::Input &stats = stats_.inputs[I];
+    ++stats.arrivals;
+    TimestampRing<InputType<I>> &ring = std::get<I>(rings_);
+    if(!ring.empty() && timestamp <= ring.back().timestamp){
+      ++stats.out_of_order;
+      return false;
+    }
+    if(ring.full()){
+      ring.pop_front();
+      ++stats.evicted;
+    }
+    ring.push_back(timestamp, std::move(payload));
+    if(!has_newest_ || timestamp > newest_){
+      newest_ = timestamp;
+      has_newest_ = true;
+    }
+    joinPivots();
+    return true;
+  }
+
+  /**
+   * Return an output callback of an upstream MIMO/SIMO module that pushes its outputs to input `I`
+   */
+  template <size_t I>
+  std::function<void(const std::shared_ptr<InputType<I>> &payload)> inputCallback(
+      const std::function<int64_t(const InputType<I> &payload)> &timestamp_fn){
+    CHECK(timestamp_fn) << PIO::logPrefix() << "timestamp_fn can't be nullptr";
+    return [this, timestamp_fn](const std::shared_ptr<InputType<I>> &payload){
+      if(payload) push<I>(timestamp_fn(*payload), payload);
+    };
+  }
+
+  TimeSyncJoinStats joinStats() const{
+    std::lock_guard<std::mutex> lk(join_mutex_);
+    TimeSyncJoinStats result = stats_;
+    result.module_id = PIO::moduleId();
+    return result;
+  }
+
+  const TimeSyncConfig& config() const{
+    return config_;
+  }
+
+private:
+  enum class Decision { Match, Wait, Fail };
+
+  // must be called with `join_mutex_` held
+  void joinPivots(){
+    using Others = typename MakeIndexSequence<kNumInputs>::type;
+    TimestampRing<InputType<0>> &pivots = std::get<0>(rings_);
+    size_t matches[kNumInputs];
+    while(!pivots.empty()){
+      const int64_t pivot = pivots[0].timestamp;
+      Decision decision = decideAll(pivot, matches, Others());
+      if(decision == Decision::Wait && newest_ - pivot > config_.max_delay){
+        decision = Decision::Fail;
+        ++stats_.timed_out;
+      } else if(decision == Decision::Fail){
+        ++stats_.unmatched;
+      }
+      if(decision == Decision::Wait) return;
+      if(decision == Decision::Match){
+        typename PIO::InputUniquePtr tuple = PIO::makeInputPayload();
+        tuple->timestamp = pivot;
+        fill(*tuple, matches, Others());
+        ++stats_.matched;
+        SIMO::inputQueue()->push(std::move(tuple));
+      }
+      pivots.pop_front();
+      prune(pivot, Others());
+    }
+  }
+
+  template <size_t... Is>
+  Decision decideAll(int64_t pivot, size_t *matches, IndexSequence<0, Is...>){
+    Decision decisions[] = {decide<Is>(pivot, matches[Is])...};
+    Decision result = Decision::Match;
+    for(Decision decision : decisions){
+      if(decision == Decision::Fail) return Decision::Fail;
+      if(decision == Decision::Wait) result = Decision::Wait;
+    }
+    return result;
+  }
+
+  // find the payload of input `I` that matches `pivot` and set `index` to it
+  template <size_t I>
+  Decision decide(int64_t pivot, size_t &index) const{
+    const TimestampRing<InputType<I>> &ring = std::get<I>(rings_);
+    if(ring.empty()) return Decision::Wait;
+    switch(config_.policy){
+      case MatchPolicy::Exact:
+        index = ring.lowerBound(pivot);
+        if(index < ring.size() && ring[index].timestamp == pivot) return Decision::Match;
+        return ring.back().timestamp > pivot ? Decision::Fail : Decision::Wait;
+      case MatchPolicy::Nearest: {
+        index = ring.lowerBound(pivot);
+        if(index == ring.size()) return Decision::Wait;
+        if(index > 0 && pivot - ring[index - 1].timestamp <= ring[index].timestamp - pivot) --index;
+        const int64_t distance = ring[index].timestamp > pivot ? ring[index].timestamp - pivot
+                                                               : pivot - ring[index].timestamp;
+        return distance <= config_.tolerance ? Decision::Match : Decision::Fail;
+      }
+      default:
+        index = ring.upperBound(pivot);
+        if(index > 0 && pivot - ring[index - 1].timestamp <= config_.tolerance){
+          --index;
+          return Decision::Match;
+        }
+        return index < ring.size() ? Decision::Fail : Decision::Wait;
+    }
+  }
+
+  template <size_t... Is>
+  void fill(Tuple &tuple, const size_t *matches, IndexSequence<0, Is...>){
+    std::get<0>(tuple.payloads) = std::get<0>(rings_)[0].payload;
+    int expand[] = {0, (std::get<Is>(tuple.payloads) = std::get<Is>(rings_)[matches[Is]].payload, 0)...};
+    (void) expand;
+  }
+
+  // drop the payloads no later pivot can match: the pivots come in timestamp order, so only the newest payload at
+  // or before `pivot` and the ones after it are kept
+  template <size_t... Is>
+  void prune(int64_t pivot, IndexSequence<0, Is...>){
+    int expand[] = {0, (pruneInput<Is>(pivot), 0)...};
+    (void) expand;
+  }
+
+  template <size_t I>
+  void pruneInput(int64_t pivot){
+    TimestampRing<InputType<I>> &ring = std::get<I>(rings_);
+    const size_t after = ring.upperBound(pivot);
+    if(after > 1) ring.pop_front(after - 1);
+  }
+
+  const TimeSyncConfig config_;
+  std::tuple<TimestampRing<Inputs>...> rings_;
+  // guards the rings, newest_ and stats_
+  mutable std::mutex join_mutex_;
+  // newest timestamp of any input
+  int64_t newest_;
+  bool has_newest_;
+  TimeSyncJoinStats stats_;
+};
+}
+#endif //MODULAR_PIPELINE_TIME_SYNC_JOIN_HPP
@@ -0,0 +1,658 @@
+#ifndef MODULAR_PIPELINE_TRAFFIC_RECORDER_HPP
+#define MODULAR_PIPELINE_TRAFFIC_RECORDER_HPP
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include "concurrent_queue.hpp"
+#include "mpmc_queue.hpp"
+#include "payload_pool.hpp"
+#include "pipeline_module.hpp"
+
+namespace modular_pipeline {
+
+/**
+ * How a payload type is written to a traffic log and read back.
+ * Trivially copyable types are stored as they are and replayed in place. std::string is supported. Other payload
+ * types need a specialization with the same members.
+ */
+template <typename T, typename Enable = void>
+struct PayloadCodec;
+
+template <typename T>
+struct PayloadCodec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  // the bytes of a record can be used as a T where they are, without decoding
+  static constexpr bool kInPlace = true;
+
+  static size_t encodedSize(const T &){
+    return sizeof(T);
+  }
+
+  static void encode(const T &payload, char *out){
+    std::memcpy(out, &payload, sizeof(T));
+  }
+
+  static T decode(const char *data, size_t size){
+    CHECK_EQ(size, sizeof(T)) << "the traffic log holds another payload type";
+    T payload;
+    std::memcpy(&payload, data, sizeof(T));
+    return payload;
+  }
+};
+
+template <>
+struct PayloadCodec<std::string> {
+  static constexpr bool kInPlace = false;
+
+  static size_t encodedSize(const std::string &payload){
+    return payload.size();
+  }
+
+  static void encode(const std::string &payload, char *out){
+    std::memcpy(out, payload.data(), payload.size());
+  }
+
+  static std::string decode(const char *data, size_t size){
+    return std::string(data, size);
+  }
+};
+
+/**
+ * Layout of a traffic log. A log is a series of segment files `<prefix>.000000.log`, `<prefix>.000001.log`, ...
+ * Every segment starts with a SegmentHeader and holds records, each a RecordHeader followed by the encoded payload
+ * and padded to kAlignment bytes. A record without kRecordMagic ends the segment, e.g. after a crash.
+ */
+struct TrafficLog {
+  static constexpr uint64_t kSegmentMagic = 0x31474f4c46415254ull; // "TRAFLOG1"
+  static constexpr uint32_t kRecordMagic = 0x31434552u; // "REC1"
+  static constexpr size_t kAlignment = 16;
+
+  struct SegmentHeader {
+    uint64_t magic;
+    uint64_t reserved;
+  };
+
+  struct RecordHeader {
+    // steady clock time when the payload was recorded
+    uint64_t timestamp_ns;
+    uint32_t size;
+    uint32_t magic;
+  };
+
+  static std::string segmentPath(const std::string &path_prefix, size_t index){
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%06zu.log", index);
+    return path_prefix + suffix;
+  }
+
+  static size_t alignUp(size_t n){
+    return (n + kAlignment - 1) / kAlignment * kAlignment;
+  }
+};
+
+/**
+ * One record of a traffic log. `data` points into the mapped segment and stays valid while the reader lives.
+ */
+struct RecordView {
+  uint64_t timestamp_ns;
+  char *data;
+  size_t size;
+};
+
+/**
+ * Appends payloads with their timestamps to a segmented traffic log.
+ * record() only copies the encoded payload into a pooled block and pushes it to a bounded lock-free queue, so the
+ * hot path neither allocates nor waits for I/O. A background thread copies the records into memory-mapped segment files of `segment_size` bytes and starts
+ * a new segment when one is full. Records that don't fit in the queue are dropped and counted by numDropped().
+ */
+class TrafficRecorder {
+public:
+  // records up to this size, header and padding included, are encoded into pooled blocks, larger ones on the heap
+  static constexpr size_t kRecordBlockSize = 512;
+  static constexpr size_t kWriteBatch = 256;
+
+  /**
+   * An encoded record on its way to the writer thread: the RecordHeader and the payload, padded to
+   * TrafficLog::kAlignment bytes. Move-only, it gives its block back to the pool when destroyed.
+   */
+  class Record {
+  public:
+    Record(): data_(nullptr), size_(0) {}
+
+    explicit Record(size_t size)
+    : data_(static_cast<char*>(size <= kRecordBlockSize ? BlockPool::instance().allocate() : ::operator new(size))),
+      size_(size) {}
+
+    Record(Record &&other) noexcept: data_(other.data_), size_(other.size_) {
+      other.data_ = nullptr;
+      other.size_ = 0;
+    }
+
+    Record& operator=(Record &&other) noexcept{
+      if(this != &other){
+        release();
+        data_ = other.data_;
+        size_ = other.size_;
+        other.data_ = nullptr;
+        other.size_ = 0;
+      }
+      return *this;
+    }
+
+    ~Record(){
+      release();
+    }
+
+    Record(const Record&) = delete;
+    void operator=(const Record&) = delete;
+
+    char* data(){
+      return data_;
+    }
+
+    const char* data() const{
+      return data_;
+    }
+
+    size_t size() const{
+      return size_;
+    }
+
+    bool empty() const{
+      return data_ == nullptr;
+    }
+
+  private:
+    using BlockPool = FixedBlockPool<kRecordBlockSize, TrafficLog::kAlignment>;
+
+    void release(){
+      if(!data_) return;
+      if(size_ <= kRecordBlockSize){
+        BlockPool::instance().deallocate(data_);
+      } else {
+        ::operator delete(data_);
+      }
+    }
+
+    char *data_;
+    size_t size_;
+  };
+
+  explicit TrafficRecorder(const std::string &path_prefix, size_t segment_size = 64 << 20, size_t capacity = 8192)
+  : path_prefix_(path_prefix), segment_size_(segment_size), queue_(capacity), recorded_(0), dropped_(0),
+    num_segments_(0), fd_(-1), segment_(nullptr), segment_length_(0), segment_used_(0), writer_() {
+    CHECK_GT(segment_size_, sizeof(TrafficLog::SegmentHeader)) << "segment_size is too small";
+    writer_ = std::thread(&TrafficRecorder::run, this);
+  }
+
+  ~TrafficRecorder(){
+    close();
+  }
+
+  TrafficRecorder(const TrafficRecorder&) = delete;
+  void operator=(const TrafficRecorder&) = delete;
+
+  /**
+   * Encode `payload` with the current time, e.g. to append it later with append()
+   */
+  template <typename T>
+  Record encode(const T &payload) const{
+    const size_t size = PayloadCodec<T>::encodedSize(payload);
+    const size_t used = sizeof(TrafficLog::RecordHeader) + size;
+    Record record(TrafficLog::alignUp(used));
+    TrafficLog::RecordHeader header;
+    header.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    header.size = static_cast<uint32_t>(size);
+    header.magic = TrafficLog::kRecordMagic;
+    std::memcpy(record.data(), &header, sizeof(header));
+    PayloadCodec<T>::encode(payload, record.data() + sizeof(header));
+    // only the padding is cleared, so the log doesn't leak old pool contents
+    std::memset(record.data() + used, 0, record.size() - used);
+    return record;
+  }
+
+  /**
+   * Hand an encoded record to the writer thread without waiting. Return false if it was dropped.
+   */
+  bool append(Record &&record){
+    if(queue_.try_push(std::move(record))) return true;
+    ++dropped_;
+    return false;
+  }
+
+  template <typename T>
+  bool record(const T &payload){
+    return append(encode(payload));
+  }
+
+  /**
+   * A callback that records every output of a module, e.g. for MIMOPipelineModule::registerOutputCallback()
+   */
+  template <typename T>
+  std::function<void(const std::shared_ptr<T>&)> outputTap(){
+    return [this](const std::shared_ptr<T> &output){
+      if(output) record(*output);
+    };
+  }
+
+  /**
+   * Write the queued records, finish the last segment and stop the writer thread. Later records are dropped.
+   */
+  void close(){
+    queue_.shutdown();
+    if(writer_.joinable()){
+      writer_.join();
+    }
+  }
+
+  /**
+   * Return the number of records written to the log
+   */
+  uint64_t numRecorded() const{
+    return recorded_;
+  }
+
+  /**
+   * Return the number of records dropped because the queue was full or the log could not be written
+   */
+  uint64_t numDropped() const{
+    return dropped_;
+  }
+
+  size_t numSegments() const{
+    return num_segments_;
+  }
+
+private:
+  void run(){
+    std::vector<Record> records;
+    records.reserve(kWriteBatch);
+    while(queue_.wait_and_pop_bulk(std::back_inserter(records), kWriteBatch) > 0){
+      for(Record &record : records){
+        write(record);
+      }
+      records.clear();
+    }
+    // records pushed before the shutdown
+    queue_.drain_into(records);
+    for(Record &record : records){
+      write(record);
+    }
+    finishSegment();
+  }
+
+  void write(const Record &record){
+    if(!segment_ || segment_used_ + record.size() > segment_length_){
+      finishSegment();
+      if(!openSegment(std::max(segment_size_, sizeof(TrafficLog::SegmentHeader) + record.size()))){
+        ++dropped_;
+        return;
+      }
+    }
+    std::memcpy(segment_ + segment_used_, record.data(), record.size());
+    segment_used_ += record.size();
+    ++recorded_;
+  }
+
+  bool openSegment(size_t length){
+    const std::string path = TrafficLog::segmentPath(path_prefix_, num_segments_);
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd_ < 0){
+      LOG(ERROR) << "TrafficRecorder: can't create " << path << ": " << std::strerror(errno);
+      return false;
+    }
+    void *segment = MAP_FAILED;
+    if(::ftruncate(fd_, length) == 0){
+      segment = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    }
+    if(segment == MAP_FAILED){
+      LOG(ERROR) << "TrafficRecorder: can't map " << path << ": " << std::strerror(errno);
+      ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    segment_ = static_cast<char*>(segment);
+    segment_length_ = length;
+    const TrafficLog::SegmentHeader header = {TrafficLog::kSegmentMagic, 0};
+    std::memcpy(segment_, &header, sizeof(header));
+    segment_used_ = sizeof(header);
+    ++num_segments_;
+    return true;
+  }
+
+  // unmap the current segment and cut the file to the written records
+  void finishSegment(){
+    if(!segment_) return;
+    ::munmap(segment_, segment_length_);
+    if(::ftruncate(fd_, segment_used_) != 0){
+      LOG(WARNING) << "TrafficRecorder: can't truncate segment " << num_segments_ - 1 << ": " << std::strerror(errno);
+    }
+    ::close(fd_);
+    fd_ = -1;
+    segment_ = nullptr;
+    segment_length_ = 0;
+    segment_used_ = 0;
+  }
+
+  const std::string path_prefix_;
+  const size_t segment_size_;
+  concurrent_queue::MpmcQueue<Record> queue_;
+  std::atomic<uint64_t> recorded_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<size_t> num_segments_;
+  // only used by the writer thread
+  int fd_;
+  char *segment_;
+  size_t segment_length_;
+  size_t segment_used_;
+  std::thread writer_;
+};
+
+/**
+ * Reads the records of a traffic log in order. Segments are mapped copy-on-write when they are reached and stay
+ * mapped until the reader is destroyed, so a record can be used and even modified in place without changing the
+ * file. Not thread-safe.
+ */
+class TrafficLogReader {
+public:
+  explicit TrafficLogReader(const std::string &path_prefix)
+  : path_prefix_(path_prefix), segments_(), segment_index_(0), offset_(sizeof(TrafficLog::SegmentHeader)) {}
+
+  ~TrafficLogReader(){
+    for(Segment &segment : segments_){
+      ::munmap(segment.data, segment.length);
+    }
+  }
+
+  TrafficLogReader(const TrafficLogReader&) = delete;
+  void operator=(const TrafficLogReader&) = delete;
+
+  /**
+   * Read the next record. Return false at the end of the log.
+   */
+  bool next(RecordView &record){
+    while(segment_index_ < segments_.size() || mapSegment(segments_.size())){
+      const Segment &segment = segments_[segment_index_];
+      TrafficLog::RecordHeader header;
+      if(offset_ + sizeof(header) <= segment.length){
+        std::memcpy(&header, segment.data + offset_, sizeof(header));
+        if(header.magic == TrafficLog::kRecordMagic && offset_ + sizeof(header) + header.size <= segment.length){
+          record.timestamp_ns = header.timestamp_ns;
+          record.data = segment.data + offset_ + sizeof(header);
+          record.size = header.size;
+          offset_ += TrafficLog::alignUp(sizeof(header) + header.size);
+          return true;
+        }
+      }
+      ++segment_index_;
+      offset_ = sizeof(TrafficLog::SegmentHeader);
+    }
+    return false;
+  }
+
+  /**
+   * Start again from the first record. Records read before stay valid.
+   */
+  void rewind(){
+    segment_index_ = 0;
+    offset_ = sizeof(TrafficLog::SegmentHeader);
+  }
+
+  /**
+   * Return the number of segments mapped so far
+   */
+  size_t numSegments() const{
+    return segments_.size();
+  }
+
+private:
+  struct Segment {
+    char *data;
+    size_t length;
+  };
+
+  bool mapSegment(size_t index){
+    const std::string path = TrafficLog::segmentPath(path_prefix_, index);
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0){
+      LOG_IF(ERROR, index == 0) << "TrafficLogReader: can't open " << path << ": " << std::strerror(errno);
+      return false;
+    }
+    struct stat file_stat;
+    void *data = MAP_FAILED;
+    if(::fstat(fd, &file_stat) == 0 && file_stat.st_size >= static_cast<off_t>(sizeof(TrafficLog::SegmentHeader))){
+      data = ::mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    ::close(fd);
+    if(data == MAP_FAILED){
+      LOG(ERROR) << "TrafficLogReader: can't map " << path;
+      return false;
+    }
+    TrafficLog::SegmentHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if(header.magic != TrafficLog::kSegmentMagic){
+      LOG(ERROR) << "TrafficLogReader: " << path << " is not a traffic log segment";
+      ::munmap(data, file_stat.st_size);
+      return false;
+    }
+    segments_.push_back(Segment{static_cast<char*>(data), static_cast<size_t>(file_stat.st_size)});
+    return true;
+  }
+
+  const std::string path_prefix_;
+  std::vector<Segment> segments_;
+  size_t segment_index_;
+  size_t offset_;
+};
+
+/**
+ * Queue policy that records the payloads pushed to a `QueueT` queue while a TrafficRecorder is attached:
+ *   using SISO = SISOPipelineModule<Input, Output, TrafficTap<concurrent_queue::ConcurrentQueue>::Queue>;
+ *   input_queue->attachRecorder(&recorder);
+ * push(), try_push() and push_bulk() are recorded, only for the payloads that were queued.
+ */
+template <template<typename> class QueueT>
+struct TrafficTap {
+  template <typename Ptr>
+  class Queue : public QueueT<Ptr> {
+  public:
+    using Base = QueueT<Ptr>;
+
+    template <typename... Args>
+    explicit Queue(Args&&... args): Base(std::forward<Args>(args)...), recorder_(nullptr) {}
+
+    /**
+     * Start recording to `recorder`, or stop with nullptr. The recorder must outlive the attachment.
+     */
+    void attachRecorder(TrafficRecorder *recorder){
+      recorder_.store(recorder, std::memory_order_release);
+    }
+
+    bool push(Ptr value){
+      TrafficRecorder *recorder = recorder_.load(std::memory_order_acquire);
+      if(!recorder || !value) return Base::push(std::move(value));
+      TrafficRecorder::Record record = recorder->encode(*value);
+      if(!Base::push(std::move(value))) return false;
+      recorder->append(std::move(record));
+      return true;
+    }
+
+    bool try_push(Ptr &&value){
+      TrafficRecorder *recorder = recorder_.load(std::memory_order_acquire);
+      if(!recorder || !value) return Base::try_push(std::move(value));
+      TrafficRecorder::Record record = recorder->encode(*value);
+      if(!Base::try_push(std::move(value))) return false;
+      recorder->append(std::move(record));
+      return true;
+    }
+
+    template <typename Iterator>
+    size_t push_bulk(Iterator first, Iterator last){
+      TrafficRecorder *recorder = recorder_.load(std::memory_order_acquire);
+      if(!recorder) return Base::push_bulk(first, last);
+      std::vector<TrafficRecorder::Record> records;
+      for(Iterator it = first; it != last; ++it){
+        records.push_back(*it ? recorder->encode(**it) : TrafficRecorder::Record());
+      }
+      const size_t pushed = Base::push_bulk(first, last);
+      for(size_t i = 0; i < pushed; ++i){
+        if(!records[i].empty()) recorder->append(std::move(records[i]));
+      }
+      return pushed;
+    }
+
+  private:
+    std::atomic<TrafficRecorder*> recorder_;
+  };
+};
+
+/**
+ * When a TrafficReplaySource hands out its records
+ */
+enum class ReplayTiming {
+  FullSpeed, // as fast as the pipeline takes them
+  Original   // with the same gaps as when they were recorded
+};
+
+/**
+ * Source module that replays a traffic log as its input payloads, e.g. as a deterministic load generator.
+ * The user implements spinOnce() like for any MISO module.
+ * Payloads with an in-place PayloadCodec point into the mapped log without a copy, so the module must outlive its
+ * input payloads. Other payloads are decoded into pooled payloads.
+ * At the end of the log the source starts again if `loop` is true, otherwise it has no more inputs and isFinished().
+ * A looping source copies every payload into the pool, in place payloads included, because a record handed out again
+ * would alias a payload of the previous loop that may still be in flight.
+ * In sequential mode, a record that is not due yet is not waited for: hasInputPayload() is false until it is.
+ */
+template <typename Input, typename Output,
+    template<typename> class OutputQueueT = concurrent_queue::ConcurrentQueue>
+class TrafficReplaySource : public MISOPipelineModule<Input, Output, OutputQueueT> {
+public:
+  using PIO = PipelineModule<Input, Output>;
+  using MISO = MISOPipelineModule<Input, Output, OutputQueueT>;
+
+  TrafficReplaySource(const std::string &path_prefix, typename MISO::OutputQueueSharedPtr &output_queue,
+      const std::string &module_id, const bool &sequential_mode, ReplayTiming timing = ReplayTiming::FullSpeed,
+      bool loop = false)
+      : MISO(output_queue, module_id, sequential_mode), reader_(path_prefix), timing_(timing), loop_(loop),
+        mutex_(), pending_(), has_pending_(false), first_timestamp_ns_(0), start_ns_(0), due_ns_(kNeverDue),
+        replayed_(0) {
+    has_pending_ = reader_.next(pending_);
+    first_timestamp_ns_ = has_pending_ ? pending_.timestamp_ns : 0;
+    due_ns_ = has_pending_ ? 0 : kNeverDue;
+  }
+
+  bool hasInputPayload() const override {
+    return nowNs() >= due_ns_;
+  }
+
+  /**
+   * Return True once every record was replayed and `loop` is false
+   */
+  bool isFinished() const{
+    return due_ns_ == kNeverDue;
+  }
+
+  /**
+   * Return the number of records handed out as input payloads
+   */
+  uint64_t numReplayed() const{
+    return replayed_;
+  }
+
+protected:
+  typename PIO::InputUniquePtr prepareInputPayload() override {
+    std::unique_lock<std::mutex> lk(mutex_);
+    if(!has_pending_){
+      lk.unlock();
+      // nothing left to replay, don't let a spin() thread busy loop
+      if(!PIO::sequential_mode_) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      return nullptr;
+    }
+    if(timing_ == ReplayTiming::Original){
+      if(start_ns_ == 0) start_ns_ = nowNs();
+      const uint64_t due = start_ns_ + (pending_.timestamp_ns - first_timestamp_ns_);
+      if(PIO::sequential_mode_ && nowNs() < due) return nullptr;
+      std::this_thread::sleep_for(std::chrono::nanoseconds(due > nowNs() ? due - nowNs() : 0));
+    }
+    typename PIO::InputUniquePtr input =
+        makePayload(pending_, std::integral_constant<bool, PayloadCodec<Input>::kInPlace>());
+    ++replayed_;
+    advance();
+    return input;
+  }
+
+private:
+  static constexpr uint64_t kNeverDue = UINT64_MAX;
+
+  // the mapped log owns the payloads
+  class MappedPayloadReleaser : public PayloadReleaser<Input> {
+  public:
+    void release(Input *) const override {}
+  };
+
+  static uint64_t nowNs(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  typename PIO::InputUniquePtr makePayload(const RecordView &record, std::true_type /*in place*/){
+    if(loop_) return makePayload(record, std::false_type());
+    static_assert(alignof(Input) <= TrafficLog::kAlignment, "over-aligned payloads can't be replayed in place");
+    CHECK_EQ(record.size, sizeof(Input)) << this->logPrefix() << "the traffic log holds another payload type";
+    return typename PIO::InputUniquePtr(reinterpret_cast<Input*>(record.data), PayloadDeleter<Input>(&releaser_));
+  }
+
+  typename PIO::InputUniquePtr makePayload(const RecordView &record, std::false_type /*in place*/){
+    return PIO::makeInputPayload(PayloadCodec<Input>::decode(record.data, record.size));
+  }
+
+  // must be called with `mutex_` held
+  void advance(){
+    has_pending_ = reader_.next(pending_);
+    if(!has_pending_ && loop_){
+      reader_.rewind();
+      has_pending_ = reader_.next(pending_);
+      start_ns_ = 0;
+    }
+    if(!has_pending_){
+      due_ns_ = kNeverDue;
+    } else if(timing_ == ReplayTiming::Original && start_ns_ != 0){
+      due_ns_ = start_ns_ + (pending_.timestamp_ns - first_timestamp_ns_);
+    } else {
+      due_ns_ = 0;
+    }
+  }
+
+  TrafficLogReader reader_;
+  const ReplayTiming timing_;
+  const bool loop_;
+  const MappedPayloadReleaser releaser_;
+  std::mutex mutex_;
+  RecordView pending_;
+  bool has_pending_;
+  uint64_t first_timestamp_ns_;
+  uint64_t start_ns_;
+  std::atomic<uint64_t> due_ns_;
+  std::atomic<uint64_t> replayed_;
+};
+}
+#endif //MODULAR_PIPELINE_TRAFFIC_RECORDER_HPP
@@ -1,7 +1,11 @@
 #include <glog/logging.h>
 #include <thread>
 #include "pipeline_module.hpp"
+#include "pipeline_runner.hpp"
+#include "pipeline_graph.hpp"
 #include "concurrent_queue.hpp"
+#include "priority_concurrent_queue.hpp"
+#include "traffic_recorder.hpp"
 
 using MIMO = modular_pipeline::MIMOPipelineModule<std::string, std::string>;
 using OutputSharedPtr = MIMO::OutputSharedPtr;
@@ -9,11 +13,11 @@ using OutputSharedPtr = MIMO::OutputSharedPtr;
 class ExampleMIMOPipelineModule : public MIMO {
 protected:
   PIO::InputUniquePtr prepareInputPayload() override {
-    return std::make_unique<std::string>("a string from prepareInputPayload");
+    return makeInputPayload("a string from prepareInputPayload");
   }
   PIO::OutputSharedPtr spinOnce(PIO::InputUniquePtr input) override{
     std::string output_string = "[Output] = " + *input.get();
-    return std::make_shared<std::string>(output_string);
+    return makeOutputPayload(output_string);
   }
 
 public:
@@ -36,7 +40,7 @@ public:
 protected:
   PIO::OutputSharedPtr spinOnce(PIO::InputUniquePtr input){
     std::string output_string = "[Output SIMO] = " + *input.get();
-    return std::make_shared<std::string>(output_string);
+    return makeOutputPayload(output_string);
   }
 };
 
@@ -47,11 +51,11 @@ using MISO = modular_pipeline::MISOPipelineModule<std::string, std::string>;
 class ExampleMISOPipelineModule : public MISO {
 protected:
   PIO::InputUniquePtr prepareInputPayload() override {
-    return std::make_unique<std::string>("a string from prepareInputPayload");
+    return makeInputPayload("a string from prepareInputPayload");
   }
   PIO::OutputSharedPtr spinOnce(PIO::InputUniquePtr input) override{
     std::string output_string = "[Output MISO] = " + *input.get();
-    return std::make_shared<std::string>(output_string);
+    return makeOutputPayload(output_string);
   }
 
 public:
@@ -69,7 +73,7 @@ class ExampleSISOPipelineModule : public SISO {
 protected:
   PIO::OutputSharedPtr spinOnce(PIO::InputUniquePtr input) override{
     std::string output_string = "[Output SISO] = " + *input.get();
-    return std::make_shared<std::string>(output_string);
+    return makeOutputPayload(output_string);
   }
 
 public:
@@ -83,6 +87,62 @@ SISO::InputQueueSharedPtr siso_input_queue = std::make_shared<SISO::InputQueue>(
 SISO::OutputQueueSharedPtr siso_output_queue = std::make_shared<SISO::OutputQueue>();
 ExampleSISOPipelineModule siso_pipeline_module(siso_input_queue, siso_output_queue,"ExampleSISOPipelineModule", false);
 
+SISO::InputQueueSharedPtr runner_input_queue = std::make_shared<SISO::InputQueue>();
+SISO::OutputQueueSharedPtr runner_output_queue = std::make_shared<SISO::OutputQueue>();
+// sequential mode: each spin() call handles one input, the PipelineRunner decides when to call it
+ExampleSISOPipelineModule runner_siso_pipeline_module(runner_input_queue, runner_output_queue,
+    "RunnerSISOPipelineModule", true);
+
+MISO::OutputQueueSharedPtr graph_unused_output_queue;
+ExampleMISOPipelineModule graph_source_module(graph_unused_output_queue, "GraphSourceModule", false);
+SISO::InputQueueSharedPtr graph_input_queue = modular_pipeline::PipelineGraph::makeInputQueue<SISO>(16);
+SISO::OutputQueueSharedPtr graph_output_queue = std::make_shared<SISO::OutputQueue>();
+ExampleSISOPipelineModule graph_siso_pipeline_module(graph_input_queue, graph_output_queue,
+    "GraphSISOPipelineModule", false);
+
+using PrioritySISO = modular_pipeline::SISOPipelineModule<std::string, std::string,
+    concurrent_queue::PriorityConcurrentQueue>;
+
+class ExampleSlowPrioritySISOPipelineModule : public PrioritySISO {
+protected:
+  PIO::OutputSharedPtr spinOnce(PIO::InputUniquePtr input) override{
+    // slower than the source, so inputs expire in the input queue
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::string output_string = "[Output Priority SISO] = " + *input.get();
+    return makeOutputPayload(output_string);
+  }
+
+public:
+  ExampleSlowPrioritySISOPipelineModule(PrioritySISO::InputQueueSharedPtr &input_queue,
+      PrioritySISO::OutputQueueSharedPtr &output_queue, const std::string module_id, bool sequential_mode)
+      :PrioritySISO(input_queue, output_queue, module_id, sequential_mode) {
+  }
+};
+
+MISO::OutputQueueSharedPtr deadline_unused_output_queue;
+ExampleMISOPipelineModule deadline_source_module(deadline_unused_output_queue, "DeadlineSourceModule", false);
+PrioritySISO::InputQueueSharedPtr deadline_input_queue =
+    modular_pipeline::PipelineGraph::makeInputQueue<PrioritySISO>(100);
+PrioritySISO::OutputQueueSharedPtr deadline_output_queue = std::make_shared<PrioritySISO::OutputQueue>();
+ExampleSlowPrioritySISOPipelineModule deadline_siso_pipeline_module(deadline_input_queue, deadline_output_queue,
+    "DeadlineSISOPipelineModule", false);
+
+using Replay = modular_pipeline::TrafficReplaySource<std::string, std::string>;
+
+class ExampleReplaySourceModule : public Replay {
+protected:
+  PIO::OutputSharedPtr spinOnce(PIO::InputUniquePtr input) override{
+    std::string output_string = "[Output Replay] = " + *input.get();
+    return makeOutputPayload(output_string);
+  }
+
+public:
+  ExampleReplaySourceModule(const std::string &log_prefix, OutputQueueSharedPtr &output_queue,
+      const std::string module_id, bool sequential_mode)
+      :Replay(log_prefix, output_queue, module_id, sequential_mode, modular_pipeline::ReplayTiming::Original) {
+  }
+};
+
 void my_callback(const OutputSharedPtr &output){
   LOG(INFO) << "CB_1 receives: " << *output.get();
 }
@@ -172,5 +232,76 @@ int main(int argc, char* argv[]){
   siso_pipeline_module.shutdown();
   t1.join();
 #endif
+
+#if 0
+  modular_pipeline::PipelineRunner runner;
+  runner.addModule(runner_siso_pipeline_module);
+  runner.start();
+
+  for(int i =0 ; i < 5; i++){
+    runner_input_queue->push(std::make_unique<std::string>("Runner message " + std::to_string(i)));
+  }
+  runner.notify();
+
+  for(int i =0 ; i < 5; i++){
+    SISO::OutputSharedPtr output;
+    if(runner_output_queue->wait_and_pop(output)){
+      LOG(INFO) << "Runner Output Queue receives: " << *output.get();
+    }
+  }
+
+  runner.stop();
+  runner_siso_pipeline_module.shutdown();
+#endif
+
+#if 0
+  modular_pipeline::PipelineGraph graph;
+  graph.connect(graph_source_module, graph_siso_pipeline_module);
+  graph.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  graph.drain(std::chrono::seconds(1));
+
+  std::vector<SISO::OutputSharedPtr> outputs;
+  graph_output_queue->drain_into(outputs);
+  LOG(INFO) << "Graph Output Queue receives " << outputs.size() << " outputs";
+#endif
+
+#if 0
+  // inputs that expire in a PriorityConcurrentQueue count as consumed, so drain() still succeeds
+  using DeadlineQueue = PrioritySISO::InputQueue;
+  deadline_input_queue->setClassifier([](const PrioritySISO::InputUniquePtr &){
+    return DeadlineQueue::Priority{0, DeadlineQueue::Clock::now() + std::chrono::microseconds(500)};
+  });
+  modular_pipeline::PipelineGraph deadline_graph;
+  deadline_graph.connect(deadline_source_module, deadline_siso_pipeline_module);
+  deadline_graph.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  const bool drained = deadline_graph.drain(std::chrono::seconds(1));
+  LOG(INFO) << "Deadline graph drained=" << drained << " expired=" << deadline_input_queue->numExpired()
+            << " processed=" << deadline_siso_pipeline_module.numProcessedInputs();
+#endif
+
+#if 0
+  {
+    modular_pipeline::TrafficRecorder recorder("/tmp/example_traffic");
+    for(int i =0 ; i < 5; i++){
+      recorder.record(std::string("Recorded message " + std::to_string(i)));
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  }
+
+  Replay::OutputQueueSharedPtr replay_output_queue = std::make_shared<Replay::OutputQueue>();
+  ExampleReplaySourceModule replay_source_module("/tmp/example_traffic", replay_output_queue,
+      "ExampleReplaySourceModule", true);
+  // replays the messages 5ms apart, like they were recorded
+  while(!replay_source_module.isFinished()){
+    replay_source_module.spin();
+  }
+
+  Replay::OutputSharedPtr replay_output;
+  while(replay_output_queue->try_pop(replay_output)){
+    LOG(INFO) << "Replay Output Queue receives: " << *replay_output.get();
+  }
+#endif
   return 1;
 }
\ No newline at end of file